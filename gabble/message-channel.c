@@ -83,6 +83,7 @@ enum
   PROP_REQUEST_TYPE,
   PROP_REQUEST_ATTRIBUTES,
   PROP_REQUEST_BODY,
+  PROP_REPLIED,
   LAST_PROPERTY
 };
 
@@ -224,6 +225,7 @@ channel_message_stanza_callback (GObject *source_object,
     }
 
   priv->replied = TRUE;
+  g_object_notify (G_OBJECT (self), "replied");
 
   if (wocky_stanza_extract_errors (stanza, &error_type, &core_error,
       NULL, &specialized_node))
@@ -419,6 +421,9 @@ ytst_message_channel_get_property (GObject *object,
       case PROP_REQUEST_BODY:
         g_value_take_string (value, channel_get_message_body (priv->request));
         break;
+      case PROP_REPLIED:
+        g_value_set_boolean (value, priv->replied);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -556,6 +561,11 @@ ytst_message_channel_class_init (YtstMessageChannelClass *klass)
   g_object_class_install_property (object_class, PROP_REQUEST_ATTRIBUTES,
       param_spec);
 
+  param_spec = g_param_spec_boolean ("replied", "Replied",
+      "Whether the request has been answered, one way or the other", FALSE,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_REPLIED, param_spec);
+
   tp_dbus_properties_mixin_implement_interface (object_class,
       TP_YTS_IFACE_QUARK_CHANNEL,
       tp_dbus_properties_mixin_getter_gobject_properties, NULL,
@@ -674,6 +684,7 @@ done:
   else
     {
       priv->replied = TRUE;
+      g_object_notify (G_OBJECT (self), "replied");
       tp_yts_svc_channel_return_from_reply (context);
     }
 }
@@ -745,6 +756,7 @@ done:
   else
     {
       priv->replied = TRUE;
+      g_object_notify (G_OBJECT (self), "replied");
       tp_yts_svc_channel_return_from_fail (context);
     }
 }
@@ -27,23 +27,38 @@
 
 #include <gabble/plugin.h>
 
+#include <telepathy-glib/dbus.h>
 #include <telepathy-glib/svc-generic.h>
 #include <telepathy-glib/gtypes.h>
 
 #include <telepathy-ytstenut-glib/telepathy-ytstenut-glib.h>
 
+#include "channel-manager.h"
+#include "direct-bus.h"
+#include "status-future.h"
+#include "status-store.h"
 #include "utils.h"
 
 #define DEBUG(msg, ...) \
   g_debug ("%s: " msg, G_STRFUNC, ##__VA_ARGS__)
 
+/* how many publishes can be waiting for the server at once */
+#define DEFAULT_PUBLISH_WINDOW 4
+
+/* how many contacts the initial scan looks at each time round the main
+ * loop */
+#define SCAN_SLICE_SIZE 50
+
 static void sidecar_iface_init (GabbleSidecarInterface *iface);
 
 static void ytst_status_iface_init (TpYtsSvcStatusClass *iface);
+static void ytst_status_future_iface_init (YtstSvcStatusFutureClass *iface);
 
 G_DEFINE_TYPE_WITH_CODE (YtstStatus, ytst_status, G_TYPE_OBJECT,
     G_IMPLEMENT_INTERFACE (GABBLE_TYPE_SIDECAR, sidecar_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_YTS_SVC_STATUS, ytst_status_iface_init);
+    G_IMPLEMENT_INTERFACE (YTST_TYPE_SVC_STATUS_FUTURE,
+      ytst_status_future_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_DBUS_PROPERTIES,
       tp_dbus_properties_mixin_iface_init);
 );
@@ -55,6 +70,12 @@ enum
   PROP_CONNECTION,
   PROP_DISCOVERED_STATUSES,
   PROP_DISCOVERED_SERVICES,
+  PROP_SCAN_COMPLETE,
+  PROP_DROPPED_REQUESTS,
+  PROP_DIRECT_BUS_ADDRESS,
+  PROP_DIRECT_BUS_PATH,
+  PROP_PUBLISH_WINDOW,
+  PROP_WAIT_FOR_ACK,
   LAST_PROPERTY
 };
 
@@ -67,17 +88,34 @@ struct _YtstStatusPrivate
   guint handler_id;
   gulong capabilities_changed_id;
 
-  /* GHashTable<gchar*,
-   *     GHashTable<gchar*,
-   *         GHashTable<gchar*,gchar*>>>
-   */
-  GHashTable *discovered_statuses;
-
-  /* GHashTable<gchar*,
-   *     GHashTable<gchar*,
-   *         GValueArray(gchar*,GHashTable<gchar*,gchar*>,GPtrArray<gchar*>)>>
-   */
-  GHashTable *discovered_services;
+  /* everything we know about everyone's services and statuses, and
+   * when ours next go out */
+  YtstStatusStore *store;
+
+  /* PublishWaiter*s for statuses the store is holding back:
+   * GHashTable<gchar *"<capability>\n<service>", GSList<PublishWaiter*>> */
+  GHashTable *held_waiters;
+
+  /* QueuedPublish* which haven't been sent yet, oldest first, and the
+   * same again by their keys */
+  GQueue *publish_queue;
+  GHashTable *queued_publishes;
+  guint publishes_in_flight;
+  guint publish_window;
+  /* whether AdvertiseStatus waits for the server to say yes */
+  gboolean wait_for_ack;
+
+  /* the contacts the initial scan is looking at, and the next one */
+  TpHandleSet *scan_contacts;
+  GArray *scan_handles;
+  guint scan_next;
+  guint scan_id;
+  gboolean scan_complete;
+
+  /* NULL until someone calls EnableDirectBus, and then where we are
+   * on it */
+  YtstDirectBus *direct_bus;
+  gchar *direct_bus_path;
 
   gboolean dispose_has_run;
 };
@@ -86,219 +124,503 @@ struct _YtstStatusPrivate
  * INTERNAL
  */
 
+static gchar *
+get_node_body (WockyNode *node)
+{
+  WockyXmppWriter *writer;
+  WockyNodeTree *tree;
+  const guint8 *output;
+  gsize length;
+  gchar *result;
 
-/* -----------------------------------------------------------------------------
- * OBJECT
- */
+  writer = wocky_xmpp_writer_new_no_stream ();
+  tree = wocky_node_tree_new_from_node (node);
+  wocky_xmpp_writer_write_node_tree (writer, tree, &output, &length);
+  result = g_strndup ((const gchar*) output, length);
+  g_object_unref (writer);
+  g_object_unref (tree);
+
+  return result;
+}
+
+static gboolean
+pep_event_cb (WockyPorter *porter,
+    WockyStanza *stanza,
+    gpointer user_data)
+{
+  YtstStatus *self = user_data;
+  WockyNode *message, *event, *items, *item, *status;
+  WockyNodeIter iter;
+  const gchar *from, *capability;
+  gboolean handled = FALSE;
+
+  message = wocky_stanza_get_top_node (stanza);
+
+  event = wocky_node_get_first_child (message);
+
+  if (event == NULL || tp_strdiff (event->name, "event"))
+    return FALSE;
+
+  items = wocky_node_get_first_child (event);
+  if (items == NULL || tp_strdiff (items->name, "items"))
+    return TRUE;
+
+  from = wocky_stanza_get_from (stanza);
+  capability = wocky_node_get_attribute (items, "node");
+
+  /* there's one item for each service with a status on this node */
+  wocky_node_iter_init (&iter, items, "item", NULL);
+  while (wocky_node_iter_next (&iter, &item))
+    {
+      const gchar *service_name;
+      gchar *status_str = NULL;
 
+      status = wocky_node_get_first_child (item);
+      if (status == NULL || tp_strdiff (status->name, "status"))
+        continue;
+
+      /* looks good */
+      handled = TRUE;
+
+      service_name = wocky_node_get_attribute (status, "from-service");
+
+      if (wocky_node_get_attribute (status, "activity") != NULL)
+        status_str = get_node_body (status);
+
+      ytst_status_store_update_status (self->priv->store, from, capability,
+          service_name, status_str);
+
+      g_free (status_str);
+    }
+
+  return handled;
+}
+
+/* Someone waiting for the server to acknowledge their statuses before
+ * AdvertiseStatus or AdvertiseStatuses returns */
+typedef struct
+{
+  guint refs;
+  DBusGMethodInvocation *context;
+  /* whether it's AdvertiseStatuses */
+  gboolean several;
+  /* the first thing to go wrong */
+  GError *error;
+} PublishWaiter;
+
+static PublishWaiter *
+publish_waiter_new (DBusGMethodInvocation *context,
+    gboolean several)
+{
+  PublishWaiter *waiter = g_slice_new0 (PublishWaiter);
+
+  waiter->refs = 1;
+  waiter->context = context;
+  waiter->several = several;
+
+  return waiter;
+}
+
+static PublishWaiter *
+publish_waiter_ref (PublishWaiter *waiter)
+{
+  waiter->refs++;
+  return waiter;
+}
+
+/* Once the last reference goes, the method returns, with the first
+ * error anyone gave if there was one */
 static void
-ytst_status_init (YtstStatus *self)
+publish_waiter_unref (PublishWaiter *waiter,
+    const GError *error)
 {
-  YtstStatusPrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
-      YTST_TYPE_STATUS, YtstStatusPrivate);
-  self->priv = priv;
+  if (error != NULL && waiter->error == NULL)
+    waiter->error = g_error_copy (error);
+
+  if (--waiter->refs > 0)
+    return;
+
+  if (waiter->error != NULL)
+    dbus_g_method_return_error (waiter->context, waiter->error);
+  else if (waiter->several)
+    ytst_svc_status_future_return_from_advertise_statuses (waiter->context);
+  else
+    tp_yts_svc_status_return_from_advertise_status (waiter->context);
+
+  g_clear_error (&waiter->error);
+  g_slice_free (PublishWaiter, waiter);
 }
 
 static void
-ytst_status_get_property (GObject *object,
-    guint property_id,
-    GValue *value,
-    GParamSpec *pspec)
+publish_waiters_done (GSList *waiters,
+    const GError *error)
 {
-  YtstStatus *self = YTST_STATUS (object);
+  GSList *l;
+
+  for (l = waiters; l != NULL; l = l->next)
+    publish_waiter_unref (l->data, error);
+
+  g_slist_free (waiters);
+}
+
+static void
+publish_waiters_cancel (GSList *waiters)
+{
+  GError *error;
+
+  if (waiters == NULL)
+    return;
+
+  error = g_error_new_literal (TP_ERROR, TP_ERROR_CANCELLED,
+      "The status was never published");
+  publish_waiters_done (waiters, error);
+  g_error_free (error);
+}
+
+/* What held_waiters and queued_publishes have our statuses under */
+static gchar *
+dup_publish_key (const gchar *capability,
+    const gchar *service_name)
+{
+  return g_strdup_printf ("%s\n%s", capability, service_name);
+}
+
+/* A status waiting for a space in the publish window */
+typedef struct
+{
+  YtstStatus *self;
+  gchar *key;
+  gchar *capability;
+  gchar *service;
+  WockyNodeTree *status_tree;
+  /* PublishWaiter* */
+  GSList *waiters;
+} QueuedPublish;
+
+static void
+queued_publish_free (QueuedPublish *publish)
+{
+  tp_clear_object (&publish->status_tree);
+  publish_waiters_cancel (publish->waiters);
+  g_free (publish->key);
+  g_free (publish->capability);
+  g_free (publish->service);
+  g_slice_free (QueuedPublish, publish);
+}
+
+static void send_queued_publishes (YtstStatus *self);
+
+static void
+publish_reply_cb (GObject *source_object,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  QueuedPublish *publish = user_data;
+  YtstStatus *self = publish->self;
   YtstStatusPrivate *priv = self->priv;
+  WockyStanza *reply;
+  GError *error = NULL;
 
-  switch (property_id)
+  reply = wocky_porter_send_iq_finish (WOCKY_PORTER (source_object),
+      result, &error);
+
+  if (reply != NULL)
     {
-      case PROP_SESSION:
-        g_value_set_object (value, priv->session);
-        break;
-      case PROP_CONNECTION:
-        g_value_set_object (value, priv->connection);
-        break;
-      case PROP_DISCOVERED_STATUSES:
-        g_value_set_boxed (value, priv->discovered_statuses);
-        break;
-      case PROP_DISCOVERED_SERVICES:
-        g_value_set_boxed (value, priv->discovered_services);
-        break;
-      default:
-        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
-        break;
+      wocky_stanza_extract_errors (reply, NULL, &error, NULL, NULL);
+      g_object_unref (reply);
     }
+
+  if (error != NULL)
+    {
+      GError *tp_error = g_error_new (TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "Publishing the status failed: %s", error->message);
+
+      DEBUG ("publishing status for %s/%s failed: %s",
+          publish->capability, publish->service, error->message);
+
+      publish_waiters_done (publish->waiters, tp_error);
+      g_error_free (tp_error);
+      g_clear_error (&error);
+    }
+  else
+    {
+      publish_waiters_done (publish->waiters, NULL);
+    }
+
+  publish->waiters = NULL;
+  queued_publish_free (publish);
+
+  priv->publishes_in_flight--;
+  send_queued_publishes (self);
+
+  /* sent with a reference of its own */
+  g_object_unref (self);
 }
 
 static void
-ytst_status_set_property (GObject *object,
-    guint property_id,
-    const GValue *value,
-    GParamSpec *pspec)
+send_queued_publishes (YtstStatus *self)
 {
-  YtstStatus *self = YTST_STATUS (object);
   YtstStatusPrivate *priv = self->priv;
+  WockyPorter *porter;
 
-  switch (property_id)
+  /* we've been disposed while some were waiting for the server */
+  if (priv->publish_queue == NULL)
+    return;
+
+  porter = wocky_session_get_porter (priv->session);
+
+  while (priv->publishes_in_flight < priv->publish_window
+      && !g_queue_is_empty (priv->publish_queue))
     {
-      case PROP_SESSION:
-        priv->session = g_value_dup_object (value);
-        break;
-      case PROP_CONNECTION:
-        priv->connection = g_value_dup_object (value);
-        break;
-      default:
-        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
-        break;
+      QueuedPublish *publish = g_queue_pop_head (priv->publish_queue);
+      WockyStanza *stanza;
+      WockyNode *item;
+
+      g_hash_table_remove (priv->queued_publishes, publish->key);
+
+      stanza = wocky_pubsub_make_publish_stanza (NULL,
+          publish->capability, NULL, NULL, &item);
+
+      wocky_node_add_node_tree (item, publish->status_tree);
+      tp_clear_object (&publish->status_tree);
+
+      priv->publishes_in_flight++;
+      g_object_ref (self);
+
+      wocky_porter_send_iq_async (porter, stanza, NULL, publish_reply_cb,
+          publish);
+      g_object_unref (stanza);
     }
 }
 
+/* Publishes @status_tree, taking ownership of it and of @waiters, once
+ * there's a space in the publish window. If one for the same
+ * capability and service is still queued up, it's replaced, and whoever
+ * was waiting for that one waits for this one instead. */
 static void
-update_contact_status (YtstStatus *self,
-    const gchar *from,
+send_status (YtstStatus *self,
     const gchar *capability,
     const gchar *service_name,
-    const gchar *status_str)
+    WockyNodeTree *status_tree,
+    GSList *waiters)
 {
   YtstStatusPrivate *priv = self->priv;
-  const gchar *old_status;
-  gboolean emit = FALSE;
+  QueuedPublish *publish;
+  gchar *key;
 
-  GHashTable *capability_service_map;
-  GHashTable *service_status_map;
+  key = dup_publish_key (capability, service_name);
+  publish = g_hash_table_lookup (priv->queued_publishes, key);
 
-  capability_service_map = g_hash_table_lookup (priv->discovered_statuses, from);
-
-  if (capability_service_map == NULL)
+  if (publish != NULL)
     {
-      capability_service_map = g_hash_table_new_full (g_str_hash, g_str_equal,
-          g_free, (GDestroyNotify) g_hash_table_unref);
-      g_hash_table_insert (priv->discovered_statuses, g_strdup (from),
-          capability_service_map);
+      DEBUG ("replacing queued status for %s/%s", capability,
+          service_name);
+
+      g_object_unref (publish->status_tree);
+      publish->status_tree = status_tree;
+      publish->waiters = g_slist_concat (publish->waiters, waiters);
+      g_free (key);
+      return;
     }
 
-  service_status_map = g_hash_table_lookup (capability_service_map,
-      capability);
+  publish = g_slice_new0 (QueuedPublish);
+  publish->self = self;
+  publish->key = key;
+  publish->capability = g_strdup (capability);
+  publish->service = g_strdup (service_name);
+  publish->status_tree = status_tree;
+  publish->waiters = waiters;
 
-  if (service_status_map == NULL)
-    {
-      service_status_map = g_hash_table_new_full (g_str_hash, g_str_equal,
-          g_free, g_free);
-      g_hash_table_insert (capability_service_map,
-          g_strdup (capability), service_status_map);
-    }
+  g_queue_push_tail (priv->publish_queue, publish);
+  g_hash_table_insert (priv->queued_publishes, publish->key, publish);
 
-  old_status = g_hash_table_lookup (service_status_map, service_name);
+  send_queued_publishes (self);
+}
 
-  /* Save this value as old_status will be freed when we call
-   * g_hash_table_insert next and the spec says we need to update the
-   * property before emitting the signal. In reality this wouldn't be
-   * a problem, but let's be nice. */
-  emit = tp_strdiff (old_status, status_str);
+/* The store's let @status_trees, which are for the same capability, go
+ * out. Publishing several items at once is an optional extra in
+ * XEP-0060 we can't count on the server having, so it's one each. */
+static void
+send_statuses_cb (YtstStatusStore *store,
+    const gchar *capability,
+    GPtrArray *status_trees,
+    YtstStatus *self)
+{
+  YtstStatusPrivate *priv = self->priv;
+  guint i;
 
-  if (status_str != NULL)
+  for (i = 0; i < status_trees->len; i++)
     {
-      g_hash_table_insert (service_status_map, g_strdup (service_name),
-          g_strdup (status_str));
-    }
-  else
-    {
-      /* remove the service from the service status map */
-      g_hash_table_remove (service_status_map, service_name);
+      WockyNodeTree *status_tree = g_ptr_array_index (status_trees, i);
+      const gchar *service_name;
+      GSList *waiters = NULL;
+      gpointer key, value;
+      gchar *lookup;
 
-      /* now run along up the hash table cleaning up */
-      if (g_hash_table_size (service_status_map) == 0)
-        g_hash_table_remove (capability_service_map, capability);
+      service_name = wocky_node_get_attribute (
+          wocky_node_tree_get_top_node (status_tree), "from-service");
 
-      if (g_hash_table_size (capability_service_map) == 0)
-        g_hash_table_remove (priv->discovered_statuses, from);
-    }
+      /* whoever was waiting for this one, or one it replaced */
+      lookup = dup_publish_key (capability, service_name);
+
+      if (g_hash_table_lookup_extended (priv->held_waiters, lookup, &key,
+              &value))
+        {
+          g_hash_table_steal (priv->held_waiters, lookup);
+          g_free (key);
+          waiters = value;
+        }
+
+      g_free (lookup);
 
-  if (emit)
-    tp_yts_svc_status_emit_status_changed (self, from, capability,
-        service_name, status_str);
+      send_status (self, capability, service_name,
+          g_object_ref (status_tree), waiters);
+    }
 }
 
-static gchar *
-get_node_body (WockyNode *node)
+/* Has @waiter wait for the status for @capability and @service_name
+ * which is about to go to the store to be acknowledged */
+static void
+hold_waiter (YtstStatus *self,
+    const gchar *capability,
+    const gchar *service_name,
+    PublishWaiter *waiter)
 {
-  WockyXmppWriter *writer;
-  WockyNodeTree *tree;
-  const guint8 *output;
-  gsize length;
-  gchar *result;
+  YtstStatusPrivate *priv = self->priv;
+  GSList *waiters;
+  gchar *key;
 
-  writer = wocky_xmpp_writer_new_no_stream ();
-  tree = wocky_node_tree_new_from_node (node);
-  wocky_xmpp_writer_write_node_tree (writer, tree, &output, &length);
-  result = g_strndup ((const gchar*) output, length);
-  g_object_unref (writer);
-  g_object_unref (tree);
+  key = dup_publish_key (capability, service_name);
+  waiters = g_hash_table_lookup (priv->held_waiters, key);
 
-  return result;
+  /* the list's head doesn't change, so it can stay where it is */
+  if (waiters != NULL)
+    {
+      waiters = g_slist_append (waiters, publish_waiter_ref (waiter));
+      g_free (key);
+      return;
+    }
+
+  g_hash_table_insert (priv->held_waiters, key,
+      g_slist_prepend (NULL, publish_waiter_ref (waiter)));
 }
 
-static gboolean
-pep_event_cb (WockyPorter *porter,
-    WockyStanza *stanza,
-    gpointer user_data)
+typedef struct
 {
-  YtstStatus *self = user_data;
-  WockyNode *message, *event, *items, *item, *status;
-  gchar *status_str = NULL;
-  const gchar *from, *capability, *service_name;
+  YtstStatus *self;
+  WockyXep0115Capabilities *contact;
+  gchar *jid;
+  gchar *uid;
+  gchar *digest;
+} DetailsRequest;
 
-  message = wocky_stanza_get_top_node (stanza);
+static void
+details_request_free (DetailsRequest *request)
+{
+  g_object_unref (request->self);
+  g_object_unref (request->contact);
+  g_free (request->jid);
+  g_free (request->uid);
+  g_free (request->digest);
+  g_slice_free (DetailsRequest, request);
+}
 
-  event = wocky_node_get_first_child (message);
+static void contact_capabilities_changed (YtstStatus *self,
+    gpointer contact,
+    gboolean do_signal);
 
-  if (event == NULL || tp_strdiff (event->name, "event"))
-    return FALSE;
+static void
+details_reply_cb (GObject *source_object,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  DetailsRequest *request = user_data;
+  YtstStatus *self = request->self;
+  YtstStatusPrivate *priv = self->priv;
+  WockyStanza *reply;
+  WockyNode *query, *x = NULL;
+  WockyDataForm *form = NULL;
+  GError *error = NULL;
 
-  items = wocky_node_get_first_child (event);
-  if (items == NULL || tp_strdiff (items->name, "items"))
-    return TRUE;
+  reply = wocky_porter_send_iq_finish (WOCKY_PORTER (source_object),
+      result, &error);
 
-  item = wocky_node_get_first_child (items);
-  if (item == NULL || tp_strdiff (item->name, "item"))
-    return FALSE;
+  if (priv->dispose_has_run)
+    goto out;
 
-  status = wocky_node_get_first_child (item);
-  if (status == NULL || tp_strdiff (status->name, "status"))
-    return FALSE;
+  if (reply == NULL)
+    {
+      DEBUG ("couldn't get details of %s: %s", request->uid, error->message);
+      g_clear_error (&error);
+    }
+  else if (wocky_stanza_extract_errors (reply, NULL, &error, NULL, NULL))
+    {
+      DEBUG ("couldn't get details of %s: %s", request->uid, error->message);
+      g_clear_error (&error);
+    }
+  else
+    {
+      query = wocky_node_get_child_ns (wocky_stanza_get_top_node (reply),
+          "query", WOCKY_XMPP_NS_DISCO_INFO);
+      if (query != NULL)
+        x = wocky_node_get_child_ns (query, "x", WOCKY_XMPP_NS_DATA);
+    }
 
-  /* looks good */
+  if (x != NULL)
+    form = wocky_data_form_new_from_node (x, NULL);
 
-  from = wocky_stanza_get_from (stanza);
-  capability = wocky_node_get_attribute (items, "node");
-  service_name = wocky_node_get_attribute (status, "from-service");
+  /* now they'll be found */
+  if (ytst_status_store_add_details (priv->store, request->uid,
+          request->digest, form))
+    contact_capabilities_changed (self, request->contact, TRUE);
 
-  if (wocky_node_get_attribute (status, "activity") != NULL)
-    status_str = get_node_body (status);
+out:
+  g_clear_error (&error);
+  tp_clear_object (&form);
+  tp_clear_object (&reply);
+  details_request_free (request);
+}
 
-  update_contact_status (self, from, capability, service_name, status_str);
+/* Asks @contact for the details of @uid, which it advertised
+ * compactly, and looks at it again once they come back */
+static gboolean
+fetch_details_cb (YtstStatusStore *store,
+    GObject *contact,
+    const gchar *jid,
+    const gchar *uid,
+    const gchar *digest,
+    YtstStatus *self)
+{
+  YtstStatusPrivate *priv = self->priv;
+  WockyStanza *stanza;
+  DetailsRequest *request;
+  gchar *node;
 
-  g_free (status_str);
+  node = g_strdup_printf ("%s%s", INDEX_PREFIX, uid);
 
-  return TRUE;
-}
+  stanza = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+      WOCKY_STANZA_SUB_TYPE_GET, NULL, jid,
+      '(', "query",
+        ':', WOCKY_XMPP_NS_DISCO_INFO,
+        '@', "node", node,
+      ')', NULL);
 
-static GHashTable *
-get_name_map_from_strv (const gchar **strv)
-{
-  GHashTable *out = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, g_free);
-  const gchar **s;
+  request = g_slice_new0 (DetailsRequest);
+  request->self = g_object_ref (self);
+  request->contact = g_object_ref (contact);
+  request->jid = g_strdup (jid);
+  request->uid = g_strdup (uid);
+  request->digest = g_strdup (digest);
 
-  for (s = strv; s != NULL && *s != NULL; s++)
-    {
-      gchar **parts = g_strsplit (*s, "/", 2);
+  DEBUG ("asking %s for the details of %s", jid, uid);
 
-      g_hash_table_insert (out,
-          g_strdup (parts[0]), g_strdup(parts[1]));
+  wocky_porter_send_iq_async (wocky_session_get_porter (priv->session),
+      stanza, NULL, details_reply_cb, request);
 
-      g_strfreev (parts);
-    }
+  g_object_unref (stanza);
+  g_free (node);
 
-  return out;
+  return TRUE;
 }
 
 static void
@@ -308,10 +630,6 @@ contact_capabilities_changed (YtstStatus *self,
 {
   YtstStatusPrivate *priv = self->priv;
   const GPtrArray *data_forms;
-  guint i;
-  GHashTable *old, *new;
-  GHashTableIter iter;
-  gpointer key, value;
   const gchar *jid;
 
   data_forms = wocky_xep_0115_capabilities_get_data_forms (
@@ -323,197 +641,301 @@ contact_capabilities_changed (YtstStatus *self,
   if (jid == NULL)
     return;
 
-  old = g_hash_table_lookup (priv->discovered_services, jid);
+  ytst_status_store_update_services (priv->store, contact, jid,
+      data_forms, do_signal);
+}
 
-  new = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) g_value_array_free);
+static gboolean
+capabilities_changed_cb (GSignalInvocationHint *ihint,
+    guint n_param_values,
+    const GValue *param_values,
+    gpointer user_data)
+{
+  YtstStatus *self = YTST_STATUS (user_data);
+
+  contact_capabilities_changed (self,
+      g_value_get_object (param_values), TRUE);
 
-  for (i = 0; i < data_forms->len; i++)
+  return TRUE;
+}
+
+static void
+scan_finished (YtstStatus *self)
+{
+  YtstStatusPrivate *priv = self->priv;
+
+  DEBUG ("initial scan complete");
+
+  priv->scan_complete = TRUE;
+  ytst_svc_status_future_emit_scan_complete (self);
+}
+
+static void
+scan_clear (YtstStatus *self)
+{
+  YtstStatusPrivate *priv = self->priv;
+
+  if (priv->scan_id != 0)
     {
-      WockyDataForm *form = g_ptr_array_index (data_forms, i);
-      WockyDataFormField *type, *tmp;
-      const gchar *form_type;
-      const gchar *service;
-      GValueArray *details;
+      g_source_remove (priv->scan_id);
+      priv->scan_id = 0;
+    }
 
-      gchar *yts_service_name;
-      GHashTable *yts_name_map;
-      gchar **yts_caps;
+  tp_clear_pointer (&priv->scan_handles, g_array_unref);
+  tp_clear_pointer (&priv->scan_contacts, tp_handle_set_destroy);
+  priv->scan_next = 0;
+}
 
-      type = g_hash_table_lookup (form->fields, "FORM_TYPE");
+/* Looks at the next few contacts on the roster, and returns whether
+ * there are any left */
+static gboolean
+scan_slice_cb (gpointer data)
+{
+  YtstStatus *self = YTST_STATUS (data);
+  YtstStatusPrivate *priv = self->priv;
+  guint n;
 
-      if (type == NULL
-          || type->type != WOCKY_DATA_FORM_FIELD_TYPE_HIDDEN)
-        continue;
+  for (n = 0; n < SCAN_SLICE_SIZE
+       && priv->scan_next < priv->scan_handles->len; n++)
+    {
+      TpHandle handle = g_array_index (priv->scan_handles, TpHandle,
+          priv->scan_next++);
+      WockyXep0115Capabilities *caps;
 
-      form_type = g_value_get_string (type->default_value);
+      caps = gabble_plugin_connection_get_caps (priv->connection,
+          handle);
 
-      if (!g_str_has_prefix (form_type, SERVICE_PREFIX))
-        continue;
+      if (caps != NULL)
+        contact_capabilities_changed (self, caps, FALSE);
+    }
 
-      service = form_type + strlen (SERVICE_PREFIX);
+  if (priv->scan_next < priv->scan_handles->len)
+    return TRUE;
 
-      /* service type */
-      tmp = g_hash_table_lookup (form->fields, "type");
-      if (tmp == NULL || tmp->type != WOCKY_DATA_FORM_FIELD_TYPE_TEXT_SINGLE)
-        continue;
-      yts_service_name = g_value_dup_string (tmp->default_value);
+  /* the idle is done with, one way or the other */
+  priv->scan_id = 0;
+  scan_clear (self);
+  scan_finished (self);
+  return FALSE;
+}
 
-      /* name map */
-      tmp = g_hash_table_lookup (form->fields, "name");
-      if (tmp != NULL && tmp->default_value != NULL &&
-          tmp->type == WOCKY_DATA_FORM_FIELD_TYPE_TEXT_MULTI)
-        {
-          yts_name_map = get_name_map_from_strv (
-              g_value_get_boxed (tmp->default_value));
-        }
-      else
-        {
-          yts_name_map = g_hash_table_new (g_str_hash, g_str_equal);
-        }
+static void
+contact_list_state_changed_cb (GabblePluginConnection *connection,
+    TpContactListState state,
+    YtstStatus *self)
+{
+  YtstStatusPrivate *priv = self->priv;
+  TpBaseContactList *contact_list;
 
-      /* caps */
-      tmp = g_hash_table_lookup (form->fields, "capabilities");
-      if (tmp != NULL && tmp->default_value != NULL &&
-          tmp->type == WOCKY_DATA_FORM_FIELD_TYPE_TEXT_MULTI)
-        {
-          yts_caps = g_strdupv (tmp->raw_value_contents);
-        }
-      else
-        {
-          gchar *caps_tmp[] = { NULL };
-          yts_caps = g_strdupv (caps_tmp);
-        }
+  if (state != TP_CONTACT_LIST_STATE_SUCCESS)
+    return;
 
-      /* now build the value array and add it to the new hash table */
-      details = tp_value_array_build (3,
-          G_TYPE_STRING, yts_service_name,
-          TP_HASH_TYPE_STRING_STRING_MAP, yts_name_map,
-          G_TYPE_STRV, yts_caps,
-          G_TYPE_INVALID);
+  scan_clear (self);
 
-      g_hash_table_insert (new, g_strdup (service), details);
+  /* look through the roster a few contacts at a time, so a big one
+   * doesn't hold up everything else; the set keeps the handles
+   * around until we're done */
+  contact_list = gabble_plugin_connection_get_contact_list (connection);
+  priv->scan_contacts = tp_base_contact_list_dup_contacts (contact_list);
+  priv->scan_handles = tp_intset_to_array (
+      tp_handle_set_peek (priv->scan_contacts));
 
-      g_free (yts_service_name);
-      g_hash_table_unref (yts_name_map);
-      g_strfreev (yts_caps);
-    }
+  DEBUG ("%u contacts to scan", priv->scan_handles->len);
 
-  if (do_signal)
-    {
-      /* first check for services in old but not in new; they've been
-       * removed. old can be NULL. */
-      if (old != NULL)
-        {
-          g_hash_table_iter_init (&iter, old);
-          while (g_hash_table_iter_next (&iter, &key, NULL))
-            {
-              if (g_hash_table_lookup (new, key) == NULL)
-                tp_yts_svc_status_emit_service_removed (self, jid, key);
-            }
-        }
+  if (scan_slice_cb (self))
+    priv->scan_id = g_idle_add (scan_slice_cb, self);
+}
 
-      /* next check for services in new but not in old; they've been
-       * added */
-      g_hash_table_iter_init (&iter, new);
-      while (g_hash_table_iter_next (&iter, &key, &value))
-        {
-          if (old == NULL || g_hash_table_lookup (old, key) == NULL)
-            tp_yts_svc_status_emit_service_added (self, jid, key, value);
-        }
-    }
+static gboolean
+capabilities_idle_cb (gpointer data)
+{
+  YtstStatus *self = YTST_STATUS (data);
+  YtstStatusPrivate *priv = self->priv;
+  TpBaseContactList *contact_list;
+  TpContactListState contact_list_state;
+
+  /* connect to all capabilities-changed signals */
+  priv->capabilities_changed_id = g_signal_add_emission_hook (
+      g_signal_lookup ("capabilities-changed", WOCKY_TYPE_XEP_0115_CAPABILITIES),
+      0, capabilities_changed_cb, self, NULL);
+
+  /* and now look through all the contacts that had caps before this
+   * sidecar was ensured */
+  contact_list = gabble_plugin_connection_get_contact_list (priv->connection);
+  contact_list_state = tp_base_contact_list_get_state (contact_list, NULL);
 
-  if (g_hash_table_size (new) > 0)
+  if (contact_list_state == TP_CONTACT_LIST_STATE_SUCCESS)
     {
-      g_hash_table_replace (priv->discovered_services,
-          g_strdup (jid), new);
+      contact_list_state_changed_cb (priv->connection, contact_list_state, self);
     }
   else
     {
-      g_hash_table_remove (priv->discovered_services, jid);
-      g_hash_table_unref (new);
+      tp_g_signal_connect_object (priv->connection, "contact-list-state-changed",
+          G_CALLBACK (contact_list_state_changed_cb), self, 0);
     }
+
+  return FALSE;
 }
 
-static gboolean
-capabilities_changed_cb (GSignalInvocationHint *ihint,
-    guint n_param_values,
-    const GValue *param_values,
-    gpointer user_data)
+static void
+backlog_changed_cb (YtstChannelManager *manager,
+    const gchar *service,
+    guint pending,
+    guint limit,
+    YtstStatus *self)
 {
-  YtstStatus *self = YTST_STATUS (user_data);
+  ytst_svc_status_future_emit_backlog_changed (self, service, pending,
+      limit);
+}
 
-  contact_capabilities_changed (self,
-      g_value_get_object (param_values), TRUE);
+static void
+service_added_cb (YtstStatusStore *store,
+    const gchar *jid,
+    const gchar *service,
+    GValueArray *details,
+    YtstStatus *self)
+{
+  tp_yts_svc_status_emit_service_added (self, jid, service, details);
+}
 
-  return TRUE;
+static void
+service_removed_cb (YtstStatusStore *store,
+    const gchar *jid,
+    const gchar *service,
+    YtstStatus *self)
+{
+  tp_yts_svc_status_emit_service_removed (self, jid, service);
+}
+
+static void
+status_changed_cb (YtstStatusStore *store,
+    const gchar *jid,
+    const gchar *capability,
+    const gchar *service,
+    const gchar *status,
+    YtstStatus *self)
+{
+  tp_yts_svc_status_emit_status_changed (self, jid, capability, service,
+      status);
+}
+
+static void
+services_changed_cb (YtstStatusStore *store,
+    GHashTable *added,
+    GHashTable *removed,
+    YtstStatus *self)
+{
+  ytst_svc_status_future_emit_services_changed (self, added, removed);
+}
+
+static void
+statuses_changed_cb (YtstStatusStore *store,
+    GHashTable *statuses,
+    YtstStatus *self)
+{
+  ytst_svc_status_future_emit_statuses_changed (self, statuses);
+}
+
+static void
+dropped_requests_changed_cb (YtstStatusStore *store,
+    guint dropped_requests,
+    YtstStatus *self)
+{
+  ytst_svc_status_future_emit_dropped_requests_changed (self,
+      dropped_requests);
+}
+
+/* -----------------------------------------------------------------------------
+ * OBJECT
+ */
+
+static void
+ytst_status_init (YtstStatus *self)
+{
+  YtstStatusPrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      YTST_TYPE_STATUS, YtstStatusPrivate);
+  self->priv = priv;
 }
 
 static void
-check_contact_capabilities (TpHandleSet *set,
-    TpHandle handle,
-    gpointer user_data)
+ytst_status_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
 {
-  YtstStatus *self = user_data;
+  YtstStatus *self = YTST_STATUS (object);
   YtstStatusPrivate *priv = self->priv;
-  WockyXep0115Capabilities *caps;
 
-  caps = gabble_plugin_connection_get_caps (priv->connection,
-      handle);
-
-  if (caps != NULL)
-    contact_capabilities_changed (self, caps, FALSE);
+  switch (property_id)
+    {
+      case PROP_SESSION:
+        g_value_set_object (value, priv->session);
+        break;
+      case PROP_CONNECTION:
+        g_value_set_object (value, priv->connection);
+        break;
+      case PROP_DISCOVERED_STATUSES:
+        g_value_take_boxed (value,
+            ytst_status_store_dup_statuses (priv->store));
+        break;
+      case PROP_DISCOVERED_SERVICES:
+        g_value_take_boxed (value,
+            ytst_status_store_dup_services (priv->store));
+        break;
+      case PROP_SCAN_COMPLETE:
+        g_value_set_boolean (value, priv->scan_complete);
+        break;
+      case PROP_DROPPED_REQUESTS:
+        g_value_set_uint (value,
+            ytst_status_store_get_dropped_requests (priv->store));
+        break;
+      case PROP_DIRECT_BUS_ADDRESS:
+        g_value_set_string (value, priv->direct_bus == NULL ? "" :
+            ytst_direct_bus_get_address (priv->direct_bus));
+        break;
+      case PROP_DIRECT_BUS_PATH:
+        g_value_set_boxed (value, priv->direct_bus_path == NULL ? "/" :
+            priv->direct_bus_path);
+        break;
+      case PROP_PUBLISH_WINDOW:
+        g_value_set_uint (value, priv->publish_window);
+        break;
+      case PROP_WAIT_FOR_ACK:
+        g_value_set_boolean (value, priv->wait_for_ack);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
 }
 
 static void
-contact_list_state_changed_cb (GabblePluginConnection *connection,
-    TpContactListState state,
-    YtstStatus *self)
-{
-  TpBaseContactList *contact_list;
-  TpHandleSet *contacts;
-
-  if (state != TP_CONTACT_LIST_STATE_SUCCESS)
-    return;
-
-  contact_list = gabble_plugin_connection_get_contact_list (connection);
-  contacts = tp_base_contact_list_dup_contacts (contact_list);
-
-  tp_handle_set_foreach (contacts,
-      check_contact_capabilities, self);
-
-  tp_handle_set_destroy (contacts);
-}
-
-static gboolean
-capabilities_idle_cb (gpointer data)
+ytst_status_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
 {
-  YtstStatus *self = YTST_STATUS (data);
+  YtstStatus *self = YTST_STATUS (object);
   YtstStatusPrivate *priv = self->priv;
-  TpBaseContactList *contact_list;
-  TpContactListState contact_list_state;
-
-  /* connect to all capabilities-changed signals */
-  priv->capabilities_changed_id = g_signal_add_emission_hook (
-      g_signal_lookup ("capabilities-changed", WOCKY_TYPE_XEP_0115_CAPABILITIES),
-      0, capabilities_changed_cb, self, NULL);
-
-  /* and now look through all the contacts that had caps before this
-   * sidecar was ensured */
-  contact_list = gabble_plugin_connection_get_contact_list (priv->connection);
-  contact_list_state = tp_base_contact_list_get_state (contact_list, NULL);
 
-  if (contact_list_state == TP_CONTACT_LIST_STATE_SUCCESS)
-    {
-      contact_list_state_changed_cb (priv->connection, contact_list_state, self);
-    }
-  else
+  switch (property_id)
     {
-      tp_g_signal_connect_object (priv->connection, "contact-list-state-changed",
-          G_CALLBACK (contact_list_state_changed_cb), self, 0);
+      case PROP_SESSION:
+        priv->session = g_value_dup_object (value);
+        break;
+      case PROP_CONNECTION:
+        priv->connection = g_value_dup_object (value);
+        break;
+      case PROP_PUBLISH_WINDOW:
+        priv->publish_window = g_value_get_uint (value);
+        break;
+      case PROP_WAIT_FOR_ACK:
+        priv->wait_for_ack = g_value_get_boolean (value);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
     }
-
-  return FALSE;
 }
 
 static void
@@ -522,12 +944,34 @@ ytst_status_constructed (GObject *object)
   YtstStatus *self = YTST_STATUS (object);
   YtstStatusPrivate *priv = self->priv;
   WockyPorter *porter;
-
-  priv->discovered_statuses = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) g_hash_table_unref);
-
-  priv->discovered_services = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) g_hash_table_unref);
+  TpChannelManagerIter iter;
+  TpChannelManager *manager;
+
+  priv->store = ytst_status_store_new (TP_BASE_CONNECTION (priv->connection));
+
+  g_signal_connect (priv->store, "service-added",
+      G_CALLBACK (service_added_cb), self);
+  g_signal_connect (priv->store, "service-removed",
+      G_CALLBACK (service_removed_cb), self);
+  g_signal_connect (priv->store, "status-changed",
+      G_CALLBACK (status_changed_cb), self);
+  g_signal_connect (priv->store, "services-changed",
+      G_CALLBACK (services_changed_cb), self);
+  g_signal_connect (priv->store, "statuses-changed",
+      G_CALLBACK (statuses_changed_cb), self);
+  g_signal_connect (priv->store, "dropped-requests-changed",
+      G_CALLBACK (dropped_requests_changed_cb), self);
+  g_signal_connect (priv->store, "fetch-details",
+      G_CALLBACK (fetch_details_cb), self);
+  g_signal_connect (priv->store, "send-statuses",
+      G_CALLBACK (send_statuses_cb), self);
+
+  priv->held_waiters = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) publish_waiters_cancel);
+  priv->publish_queue = g_queue_new ();
+  priv->queued_publishes = g_hash_table_new (g_str_hash, g_str_equal);
+
+  ytst_config_apply (object, "Status");
 
   porter = wocky_session_get_porter (priv->session);
   priv->handler_id = wocky_porter_register_handler_from_anyone (
@@ -537,6 +981,18 @@ ytst_status_constructed (GObject *object)
         ':', "http://jabber.org/protocol/pubsub#event",
       ')', NULL);
 
+  /* Pass on backlog pressure to handlers */
+  tp_base_connection_channel_manager_iter_init (&iter,
+      TP_BASE_CONNECTION (priv->connection));
+  while (tp_base_connection_channel_manager_iter_next (&iter, &manager))
+    {
+      if (!YTST_IS_CHANNEL_MANAGER (manager))
+        continue;
+
+      tp_g_signal_connect_object (manager, "backlog-changed",
+          G_CALLBACK (backlog_changed_cb), self, 0);
+    }
+
   /* we need an idle for this otherwise the g_signal_lookup fails
    * giving this (not entirely sure why):
    *
@@ -570,8 +1026,24 @@ ytst_status_dispose (GObject *object)
         g_signal_lookup ("capabilities-changed", WOCKY_TYPE_XEP_0115_CAPABILITIES),
         priv->capabilities_changed_id);
 
-  tp_clear_pointer (&priv->discovered_statuses, g_hash_table_unref);
-  tp_clear_pointer (&priv->discovered_services, g_hash_table_unref);
+  scan_clear (self);
+
+  tp_clear_object (&priv->store);
+  tp_clear_pointer (&priv->held_waiters, g_hash_table_unref);
+  tp_clear_pointer (&priv->queued_publishes, g_hash_table_unref);
+
+  if (priv->publish_queue != NULL)
+    {
+      g_queue_foreach (priv->publish_queue, (GFunc) queued_publish_free,
+          NULL);
+      g_queue_free (priv->publish_queue);
+      priv->publish_queue = NULL;
+    }
+
+  if (priv->direct_bus != NULL)
+    ytst_direct_bus_unexport (priv->direct_bus, priv->direct_bus_path);
+  tp_clear_object (&priv->direct_bus);
+  tp_clear_pointer (&priv->direct_bus_path, g_free);
 
   tp_clear_object (&priv->session);
   tp_clear_object (&priv->connection);
@@ -605,6 +1077,13 @@ ytst_status_class_init (YtstStatusClass *klass)
       { "DiscoveredServices", "discovered-services", NULL },
       { NULL }
   };
+  static TpDBusPropertiesMixinPropImpl future_props[] = {
+      { "ScanComplete", "scan-complete", NULL },
+      { "DroppedRequests", "dropped-requests", NULL },
+      { "DirectBusAddress", "direct-bus-address", NULL },
+      { "DirectBusPath", "direct-bus-path", NULL },
+      { NULL }
+  };
 
   g_type_class_add_private (klass, sizeof (YtstStatusPrivate));
 
@@ -650,6 +1129,66 @@ ytst_status_class_init (YtstStatusClass *klass)
   g_object_class_install_property (object_class, PROP_DISCOVERED_SERVICES,
       param_spec);
 
+  param_spec = g_param_spec_boolean (
+      "scan-complete",
+      "Scan complete",
+      "Whether everyone who was around when the sidecar was created has "
+      "been looked at, so DiscoveredServices is fully populated",
+      FALSE,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_SCAN_COMPLETE,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "dropped-requests",
+      "Dropped requests",
+      "Number of incoming requests the connection has refused because "
+      "their sender was sending them too fast",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DROPPED_REQUESTS,
+      param_spec);
+
+  param_spec = g_param_spec_string (
+      "direct-bus-address",
+      "Direct bus address",
+      "Where clients can connect to us without going through the bus "
+      "daemon, or empty until EnableDirectBus is called",
+      "",
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DIRECT_BUS_ADDRESS,
+      param_spec);
+
+  param_spec = g_param_spec_boxed (
+      "direct-bus-path",
+      "Direct bus path",
+      "Where this object is on the direct bus, or / until EnableDirectBus "
+      "is called",
+      DBUS_TYPE_G_OBJECT_PATH,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DIRECT_BUS_PATH,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "publish-window",
+      "Publish window",
+      "How many statuses can be waiting for the server to acknowledge "
+      "them at once; the rest queue up behind them",
+      1, G_MAXUINT, DEFAULT_PUBLISH_WINDOW,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_PUBLISH_WINDOW,
+      param_spec);
+
+  param_spec = g_param_spec_boolean (
+      "wait-for-ack",
+      "Wait for acknowledgement",
+      "Whether AdvertiseStatus and AdvertiseStatuses only return once the "
+      "server has acknowledged the statuses, and fail if it refuses them",
+      FALSE,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_WAIT_FOR_ACK,
+      param_spec);
+
   tp_dbus_properties_mixin_class_init (object_class,
       G_STRUCT_OFFSET (YtstStatusClass, dbus_props_class));
 
@@ -657,100 +1196,307 @@ ytst_status_class_init (YtstStatusClass *klass)
       TP_YTS_IFACE_QUARK_STATUS,
       tp_dbus_properties_mixin_getter_gobject_properties, NULL,
       ytstenut_props);
+
+  tp_dbus_properties_mixin_implement_interface (object_class,
+      YTST_IFACE_QUARK_STATUS_FUTURE,
+      tp_dbus_properties_mixin_getter_gobject_properties, NULL,
+      future_props);
+}
+
+static void
+ytst_status_advertise_status (TpYtsSvcStatus *svc,
+    const gchar *capability,
+    const gchar *service_name,
+    const gchar *status,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  WockyNodeTree *status_tree;
+  GError *error = NULL;
+
+  status_tree = ytst_status_tree_new (capability, service_name, status,
+      &error);
+
+  if (status_tree == NULL)
+    {
+      dbus_g_method_return_error (context, error);
+      g_clear_error (&error);
+      return;
+    }
+
+  if (self->priv->wait_for_ack)
+    {
+      PublishWaiter *waiter = publish_waiter_new (context, FALSE);
+
+      /* this returns once the server's acknowledged it, or fails if the
+       * server refuses it */
+      hold_waiter (self, capability, service_name, waiter);
+      ytst_status_store_publish (self->priv->store, capability,
+          service_name, status_tree);
+      publish_waiter_unref (waiter, NULL);
+      return;
+    }
+
+  ytst_status_store_publish (self->priv->store, capability, service_name,
+      status_tree);
+
+  tp_yts_svc_status_return_from_advertise_status (context);
 }
 
-static WockyNodeTree *
-parse_status_body (const gchar *body,
-    GError **error)
+static void
+ytst_status_advertise_statuses (YtstSvcStatusFuture *svc,
+    const GPtrArray *statuses,
+    DBusGMethodInvocation *context)
 {
-  WockyXmppReader *reader;
-  WockyNodeTree *tree;
-  GError *err = NULL;
+  YtstStatus *self = YTST_STATUS (svc);
+  YtstStatusPrivate *priv = self->priv;
+  GPtrArray *status_trees;
+  PublishWaiter *waiter = NULL;
+  GError *error = NULL;
+  guint i;
+
+  status_trees = g_ptr_array_new_with_free_func (g_object_unref);
+
+  /* check them all before sending any, so it's all or nothing */
+  for (i = 0; i < statuses->len; i++)
+    {
+      GValueArray *va = g_ptr_array_index (statuses, i);
+      const gchar *capability, *service_name, *status;
+      WockyNodeTree *status_tree;
+
+      capability = g_value_get_string (g_value_array_get_nth (va, 0));
+      service_name = g_value_get_string (g_value_array_get_nth (va, 1));
+      status = g_value_get_string (g_value_array_get_nth (va, 2));
+
+      status_tree = ytst_status_tree_new (capability, service_name, status,
+          &error);
+
+      if (status_tree == NULL)
+        {
+          dbus_g_method_return_error (context, error);
+          g_clear_error (&error);
+          g_ptr_array_unref (status_trees);
+          return;
+        }
 
-  reader = wocky_xmpp_reader_new_no_stream ();
-  wocky_xmpp_reader_push (reader, (guint8 *) body, strlen (body));
-  tree = WOCKY_NODE_TREE (wocky_xmpp_reader_pop_stanza (reader));
-  g_object_unref (reader);
+      g_ptr_array_add (status_trees, status_tree);
+    }
+
+  if (priv->wait_for_ack)
+    waiter = publish_waiter_new (context, TRUE);
 
-  if (tree == NULL)
+  /* so if a service is in there twice only the last one counts */
+  ytst_status_store_freeze_publishing (priv->store);
+
+  for (i = 0; i < status_trees->len; i++)
     {
-      err = wocky_xmpp_reader_get_error (reader);
-      g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
-          "Invalid XML%s%s",
-          err != NULL && err->message != NULL ? ": " : ".",
-          err != NULL && err->message != NULL ? err->message : "");
-      g_clear_error (&err);
+      WockyNodeTree *status_tree = g_ptr_array_index (status_trees, i);
+      WockyNode *status_node = wocky_node_tree_get_top_node (status_tree);
+      const gchar *capability, *service_name;
+
+      capability = wocky_node_get_attribute (status_node, "capability");
+      service_name = wocky_node_get_attribute (status_node, "from-service");
+
+      if (waiter != NULL)
+        hold_waiter (self, capability, service_name, waiter);
+
+      ytst_status_store_publish (priv->store, capability, service_name,
+          g_object_ref (status_tree));
     }
 
-  return tree;
+  ytst_status_store_thaw_publishing (priv->store);
+
+  g_ptr_array_unref (status_trees);
+
+  /* this returns once the server's acknowledged all of them, or fails
+   * if it refuses any */
+  if (waiter != NULL)
+    publish_waiter_unref (waiter, NULL);
+  else
+    ytst_svc_status_future_return_from_advertise_statuses (context);
 }
 
 static void
-ytst_status_advertise_status (TpYtsSvcStatus *svc,
+ytst_status_find_services_by_capability (YtstSvcStatusFuture *svc,
     const gchar *capability,
-    const gchar *service_name,
-    const gchar *status,
     DBusGMethodInvocation *context)
 {
   YtstStatus *self = YTST_STATUS (svc);
-  YtstStatusPrivate *priv = self->priv;
-  WockyNodeTree *status_tree = NULL;
+  GHashTable *services;
   GError *error = NULL;
-  WockyStanza *stanza;
-  WockyNode *item, *status_node;
 
   if (tp_str_empty (capability))
     {
       g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
           "Capability argument must be set");
-      goto out;
+      dbus_g_method_return_error (context, error);
+      g_clear_error (&error);
+      return;
     }
 
-  if (tp_str_empty (service_name))
+  services = ytst_status_store_find_services_by_capability (
+      self->priv->store, capability);
+  ytst_svc_status_future_return_from_find_services_by_capability (context,
+      services);
+  g_hash_table_unref (services);
+}
+
+static void
+ytst_status_find_services_by_type (YtstSvcStatusFuture *svc,
+    const gchar *type,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *services;
+  GError *error = NULL;
+
+  if (tp_str_empty (type))
     {
       g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
-          "Service name argument must be set");
-      goto out;
+          "Type argument must be set");
+      dbus_g_method_return_error (context, error);
+      g_clear_error (&error);
+      return;
     }
 
-  if (!tp_str_empty (status))
-    {
-      status_tree = parse_status_body (status, &error);
-      if (status_tree == NULL)
-        goto out;
-    }
-  else
-    {
-      status_tree = wocky_node_tree_new ("status", YTST_STATUS_NS, NULL);
-    }
+  services = ytst_status_store_find_services_by_type (self->priv->store,
+      type);
+  ytst_svc_status_future_return_from_find_services_by_type (context, services);
+  g_hash_table_unref (services);
+}
 
-  status_node = wocky_node_tree_get_top_node (status_tree);
+static void
+ytst_status_get_services_for_contact (YtstSvcStatusFuture *svc,
+    const gchar *contact,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *services;
 
-  wocky_node_set_attribute (status_node, "from-service",
-      service_name);
-  wocky_node_set_attribute (status_node, "capability",
-      capability);
+  services = ytst_status_store_dup_contact_services (self->priv->store,
+      contact);
+  ytst_svc_status_future_return_from_get_services_for_contact (context,
+      services);
+  g_hash_table_unref (services);
+}
 
-  stanza = wocky_pubsub_make_publish_stanza (NULL, capability,
-      NULL, NULL, &item);
+static void
+ytst_status_get_statuses_for_contact (YtstSvcStatusFuture *svc,
+    const gchar *contact,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *statuses;
 
-  wocky_node_add_node_tree (item, status_tree);
-  g_object_unref (status_tree);
+  statuses = ytst_status_store_dup_contact_statuses (self->priv->store,
+      contact);
+  ytst_svc_status_future_return_from_get_statuses_for_contact (context,
+      statuses);
+  g_hash_table_unref (statuses);
+}
 
-  wocky_porter_send_iq_async (wocky_session_get_porter (priv->session),
-      stanza, NULL, NULL, NULL);
-  g_object_unref (stanza);
+static void
+ytst_status_get_services_page (YtstSvcStatusFuture *svc,
+    const gchar *cursor,
+    guint limit,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *services;
+  const gchar *next;
 
-out:
-  if (error == NULL)
-    {
-      tp_yts_svc_status_return_from_advertise_status (context);
-    }
-  else
+  services = ytst_status_store_dup_services_page (self->priv->store,
+      cursor, limit, &next);
+
+  ytst_svc_status_future_return_from_get_services_page (context, services,
+      next);
+
+  g_hash_table_unref (services);
+}
+
+static void
+ytst_status_get_statuses_page (YtstSvcStatusFuture *svc,
+    const gchar *cursor,
+    guint limit,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *statuses;
+  const gchar *next;
+
+  statuses = ytst_status_store_dup_statuses_page (self->priv->store,
+      cursor, limit, &next);
+
+  ytst_svc_status_future_return_from_get_statuses_page (context, statuses,
+      next);
+
+  g_hash_table_unref (statuses);
+}
+
+static void
+ytst_status_get_changes_since (YtstSvcStatusFuture *svc,
+    guint64 since,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *added, *removed, *statuses;
+  gboolean complete;
+  guint64 version;
+
+  version = ytst_status_store_get_changes_since (self->priv->store, since,
+      &complete, &added, &removed, &statuses);
+
+  ytst_svc_status_future_return_from_get_changes_since (context,
+      version, complete, added, removed, statuses);
+
+  g_hash_table_unref (added);
+  g_hash_table_unref (removed);
+  g_hash_table_unref (statuses);
+}
+
+static void
+ytst_status_enable_direct_bus (YtstSvcStatusFuture *svc,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  YtstStatusPrivate *priv = self->priv;
+  TpBaseConnection *base = TP_BASE_CONNECTION (priv->connection);
+  TpChannelManagerIter iter;
+  TpChannelManager *manager;
+  GError *error = NULL;
+
+  if (priv->direct_bus != NULL)
+    goto out;
+
+  priv->direct_bus = ytst_direct_bus_dup_for_connection (base, TRUE);
+
+  if (priv->direct_bus == NULL)
     {
+      g_set_error (&error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "Couldn't listen for direct connections");
       dbus_g_method_return_error (context, error);
       g_clear_error (&error);
+      return;
+    }
+
+  /* under the connection, so it's different for each one */
+  priv->direct_bus_path = g_strdup_printf ("%s/ytstenut/Status",
+      tp_base_connection_get_object_path (base));
+  ytst_direct_bus_export (priv->direct_bus, priv->direct_bus_path,
+      G_OBJECT (self));
+
+  /* and the channels which are open already */
+  tp_base_connection_channel_manager_iter_init (&iter, base);
+  while (tp_base_connection_channel_manager_iter_next (&iter, &manager))
+    {
+      if (YTST_IS_CHANNEL_MANAGER (manager))
+        ytst_channel_manager_export_channels (YTST_CHANNEL_MANAGER (manager),
+            priv->direct_bus);
     }
+
+out:
+  ytst_svc_status_future_return_from_enable_direct_bus (context,
+      ytst_direct_bus_get_address (priv->direct_bus), priv->direct_bus_path);
 }
 
 static void
@@ -762,6 +1508,23 @@ ytst_status_iface_init (TpYtsSvcStatusClass *iface)
 #undef IMPLEMENT
 }
 
+static void
+ytst_status_future_iface_init (YtstSvcStatusFutureClass *iface)
+{
+#define IMPLEMENT(x) ytst_svc_status_future_implement_##x (\
+    iface, ytst_status_##x)
+  IMPLEMENT(find_services_by_capability);
+  IMPLEMENT(find_services_by_type);
+  IMPLEMENT(get_services_for_contact);
+  IMPLEMENT(get_statuses_for_contact);
+  IMPLEMENT(get_services_page);
+  IMPLEMENT(get_statuses_page);
+  IMPLEMENT(get_changes_since);
+  IMPLEMENT(advertise_statuses);
+  IMPLEMENT(enable_direct_bus);
+#undef IMPLEMENT
+}
+
 static void
 sidecar_iface_init (GabbleSidecarInterface *iface)
 {
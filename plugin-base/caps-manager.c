@@ -24,6 +24,7 @@
 
 #include <string.h>
 
+#include <telepathy-glib/base-connection.h>
 #include <telepathy-glib/channel-manager.h>
 #include <telepathy-glib/util.h>
 #include <telepathy-glib/dbus.h>
@@ -35,8 +36,10 @@
 
 #ifdef SALUT
 #include <salut/caps-channel-manager.h>
+#include <salut/plugin-connection.h>
 #else
 #include <gabble/caps-channel-manager.h>
+#include <gabble/plugin-connection.h>
 #endif
 
 #include "utils.h"
@@ -59,13 +62,230 @@ G_DEFINE_TYPE_WITH_CODE (YtstCapsManager, ytst_caps_manager, G_TYPE_OBJECT,
     G_IMPLEMENT_INTERFACE (GABBLE_TYPE_CAPS_CHANNEL_MANAGER, caps_channel_manager_iface_init);
     )
 
+/* properties */
+enum
+{
+  PROP_CONNECTION = 1,
+  PROP_COMPACT,
+  PROP_DEBOUNCE_WINDOW,
+  LAST_PROPERTY
+};
+
 /* private structure */
 struct _YtstCapsManagerPrivate
 {
+  TpBaseConnection *connection;
+
   GHashTable *cap_sets;
   GHashTable *services;
+
+#ifdef SALUT
+  /* union of everything in cap_sets, which is the +notify features
+   * clients are interested in, and how many clients want each one:
+   * gchar *feature -> GUINT_TO_POINTER (refs) */
+  GabbleCapabilitySet *aggregate_caps;
+  GHashTable *feature_refs;
+  /* every form in services, each holding a reference */
+  GPtrArray *aggregate_forms;
+#endif
+
+  /* gchar *client_name -> ClientRecord* */
+  GHashTable *clients;
+  /* gchar *service -> GUINT_TO_POINTER (number of clients handling it) */
+  GHashTable *handled_services;
+  /* number of clients handling ytstenut channels for any service */
+  guint wildcard_clients;
+
+  /* gchar *client_name -> ParsedClient* */
+  GHashTable *parsed_clients;
+
+  /* advertise a summary of our services instead of all of them */
+  gboolean compact;
+  /* gchar *uid -> ServiceDetail* */
+  GHashTable *service_details;
+#ifdef SALUT
+  /* summary form of service_details, or NULL if it needs rebuilding */
+  WockyDataForm *index_form;
+#endif
+  WockyPorter *porter;
+  guint detail_handler_id;
+
+  /* milliseconds to hold changes back for once one has gone out */
+  guint debounce_window;
+  /* TRUE while changes are being held back */
+  gboolean holding;
+  /* TRUE if a change has been held back since the last one went out */
+  gboolean held_back;
+  /* starts holding once the change that opened the window is out */
+  guint hold_id;
+  /* stops holding again */
+  guint window_id;
+  /* gchar *client_name -> AdvertisedClient*, what each client was last
+   * represented by outside a window */
+  GHashTable *advertised;
 };
 
+typedef struct
+{
+  GabbleCapabilitySet *caps;
+  GPtrArray *forms;
+} AdvertisedClient;
+
+typedef struct
+{
+  /* client it came from */
+  gchar *client_name;
+  WockyDataForm *form;
+  gchar *digest;
+} ServiceDetail;
+
+typedef struct
+{
+  /* services this client handles requests for */
+  gchar **services;
+  /* TRUE if the client handles requests whatever their TargetService */
+  gboolean wildcard;
+} ClientRecord;
+
+typedef struct
+{
+  guint fingerprint;
+  /* what the fingerprint was taken of, in case of collisions */
+  gchar **tokens;
+  gchar **filter_services;
+  /* the service this client is, if any */
+  gchar *uid;
+#ifdef GABBLE
+  /* what this client adds to the caps; salut keeps these in cap_sets
+   * and services instead */
+  GabbleCapabilitySet *features;
+  WockyDataForm *form;
+  /* what it adds in compact mode instead of form */
+  WockyDataForm *stub_form;
+#endif
+} ParsedClient;
+
+static void
+client_record_free (ClientRecord *record)
+{
+  g_strfreev (record->services);
+  g_slice_free (ClientRecord, record);
+}
+
+static void
+service_detail_free (ServiceDetail *detail)
+{
+  g_free (detail->client_name);
+  g_object_unref (detail->form);
+  g_free (detail->digest);
+  g_slice_free (ServiceDetail, detail);
+}
+
+static void
+advertised_client_free (AdvertisedClient *advertised)
+{
+  gabble_capability_set_free (advertised->caps);
+  g_ptr_array_unref (advertised->forms);
+  g_slice_free (AdvertisedClient, advertised);
+}
+
+static void
+parsed_client_free (ParsedClient *parsed)
+{
+  g_strfreev (parsed->tokens);
+  g_strfreev (parsed->filter_services);
+  g_free (parsed->uid);
+#ifdef GABBLE
+  gabble_capability_set_free (parsed->features);
+  tp_clear_object (&parsed->form);
+  tp_clear_object (&parsed->stub_form);
+#endif
+  g_slice_free (ParsedClient, parsed);
+}
+
+/* Returns the TargetService a client filter asks for, "" if it wants
+ * ytstenut channels for any service, or NULL if it's not about them */
+static const gchar *
+get_filter_service (GHashTable *channel_class)
+{
+  const gchar *service_name;
+
+  if (tp_strdiff (tp_asv_get_string (channel_class,
+              TP_IFACE_CHANNEL ".ChannelType"),
+          TP_YTS_IFACE_CHANNEL))
+    return NULL;
+
+  service_name = tp_asv_get_string (channel_class,
+      TP_YTS_IFACE_CHANNEL ".TargetService");
+
+  return service_name != NULL ? service_name : "";
+}
+
+static guint
+client_fingerprint (const GPtrArray *filters,
+    const gchar * const *cap_tokens)
+{
+  const gchar * const *t;
+  const gchar *service_name;
+  guint hash = 5381;
+  guint i;
+
+  for (i = 0; filters != NULL && i < filters->len; i++)
+    {
+      service_name = get_filter_service (g_ptr_array_index (filters, i));
+      if (service_name != NULL)
+        hash = hash * 33 + g_str_hash (service_name);
+    }
+
+  /* keep filters and tokens apart */
+  hash = hash * 33 + 1;
+
+  for (t = cap_tokens; t != NULL && *t != NULL; t++)
+    hash = hash * 33 + g_str_hash (*t);
+
+  return hash;
+}
+
+static gboolean
+parsed_client_matches (ParsedClient *parsed,
+    guint fingerprint,
+    const GPtrArray *filters,
+    const gchar * const *cap_tokens)
+{
+  const gchar * const *t;
+  gchar **p;
+  const gchar *service_name;
+  guint i;
+
+  if (parsed->fingerprint != fingerprint)
+    return FALSE;
+
+  p = parsed->filter_services;
+  for (i = 0; filters != NULL && i < filters->len; i++)
+    {
+      service_name = get_filter_service (g_ptr_array_index (filters, i));
+      if (service_name == NULL)
+        continue;
+
+      if (*p == NULL || tp_strdiff (*p, service_name))
+        return FALSE;
+      p++;
+    }
+
+  if (*p != NULL)
+    return FALSE;
+
+  p = parsed->tokens;
+  for (t = cap_tokens; t != NULL && *t != NULL; t++)
+    {
+      if (p == NULL || *p == NULL || tp_strdiff (*p, *t))
+        return FALSE;
+      p++;
+    }
+
+  return p == NULL || *p == NULL;
+}
+
 static void
 ytst_caps_manager_init (YtstCapsManager *self)
 {
@@ -77,6 +297,116 @@ ytst_caps_manager_init (YtstCapsManager *self)
       g_free, (GDestroyNotify) gabble_capability_set_free);
   priv->services = g_hash_table_new_full (g_str_hash, g_str_equal,
       g_free, g_object_unref);
+  priv->clients = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) client_record_free);
+  priv->handled_services = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
+  priv->parsed_clients = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) parsed_client_free);
+  priv->service_details = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) service_detail_free);
+  priv->advertised = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) advertised_client_free);
+
+#ifdef SALUT
+  priv->aggregate_caps = gabble_capability_set_new ();
+  priv->feature_refs = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
+  priv->aggregate_forms = g_ptr_array_new_with_free_func (g_object_unref);
+#endif
+}
+
+static gboolean
+detail_query_cb (WockyPorter *porter,
+    WockyStanza *stanza,
+    gpointer user_data)
+{
+  YtstCapsManager *self = YTST_CAPS_MANAGER (user_data);
+  YtstCapsManagerPrivate *priv = self->priv;
+  WockyNode *query, *reply_query;
+  WockyStanza *reply;
+  ServiceDetail *detail;
+  const gchar *node;
+
+  query = wocky_node_get_child_ns (wocky_stanza_get_top_node (stanza),
+      "query", WOCKY_XMPP_NS_DISCO_INFO);
+  node = wocky_node_get_attribute (query, "node");
+
+  /* anything else is the connection's business */
+  if (node == NULL || !g_str_has_prefix (node, INDEX_PREFIX))
+    return FALSE;
+
+  detail = g_hash_table_lookup (priv->service_details,
+      node + strlen (INDEX_PREFIX));
+
+  if (detail == NULL)
+    {
+      wocky_porter_send_iq_error (porter, stanza,
+          WOCKY_XMPP_ERROR_ITEM_NOT_FOUND, "no such service");
+      return TRUE;
+    }
+
+  reply = wocky_stanza_build_iq_result (stanza,
+      '(', "query",
+        ':', WOCKY_XMPP_NS_DISCO_INFO,
+        '@', "node", node,
+        '*', &reply_query,
+      ')', NULL);
+
+  wocky_data_form_add_to_node (detail->form, reply_query);
+
+  wocky_porter_send (porter, reply);
+  g_object_unref (reply);
+
+  return TRUE;
+}
+
+static void
+porter_available_cb (gpointer connection,
+    WockyPorter *porter,
+    YtstCapsManager *self)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+
+  if (priv->porter != NULL)
+    return;
+
+  priv->porter = g_object_ref (porter);
+  priv->detail_handler_id = wocky_porter_register_handler_from_anyone (
+      porter, WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_GET,
+      WOCKY_PORTER_HANDLER_PRIORITY_MAX, detail_query_cb, self,
+      '(', "query",
+        ':', WOCKY_XMPP_NS_DISCO_INFO,
+      ')', NULL);
+}
+
+static void
+ytst_caps_manager_constructed (GObject *object)
+{
+  YtstCapsManager *self = YTST_CAPS_MANAGER (object);
+  YtstCapsManagerPrivate *priv = self->priv;
+#ifdef SALUT
+  WockySession *session;
+#endif
+
+  if (G_OBJECT_CLASS (ytst_caps_manager_parent_class)->constructed)
+    G_OBJECT_CLASS (ytst_caps_manager_parent_class)->constructed (object);
+
+  ytst_config_apply (object, "Advertisement");
+
+  if (priv->connection == NULL)
+    return;
+
+#ifdef SALUT
+  session = salut_plugin_connection_get_session (
+      SALUT_PLUGIN_CONNECTION (priv->connection));
+
+  porter_available_cb (priv->connection,
+      wocky_session_get_porter (session), self);
+#else
+  tp_g_signal_connect_object (priv->connection, "porter-available",
+      G_CALLBACK (porter_available_cb), self, 0);
+#endif
 }
 
 static void
@@ -86,19 +416,143 @@ ytst_caps_manager_dispose (GObject *object)
 
   tp_clear_pointer (&(self->priv->cap_sets), g_hash_table_unref);
   tp_clear_pointer (&(self->priv->services), g_hash_table_unref);
+  tp_clear_pointer (&(self->priv->clients), g_hash_table_unref);
+  tp_clear_pointer (&(self->priv->handled_services), g_hash_table_unref);
+  tp_clear_pointer (&(self->priv->parsed_clients), g_hash_table_unref);
+  tp_clear_pointer (&(self->priv->service_details), g_hash_table_unref);
+  tp_clear_pointer (&(self->priv->advertised), g_hash_table_unref);
+#ifdef SALUT
+  tp_clear_object (&(self->priv->index_form));
+#endif
+
+  if (self->priv->hold_id != 0)
+    {
+      g_source_remove (self->priv->hold_id);
+      self->priv->hold_id = 0;
+    }
+
+  if (self->priv->window_id != 0)
+    {
+      g_source_remove (self->priv->window_id);
+      self->priv->window_id = 0;
+    }
+
+  if (self->priv->porter != NULL)
+    {
+      wocky_porter_unregister_handler (self->priv->porter,
+          self->priv->detail_handler_id);
+      self->priv->detail_handler_id = 0;
+      tp_clear_object (&(self->priv->porter));
+    }
+
+#ifdef SALUT
+  tp_clear_pointer (&(self->priv->aggregate_caps), gabble_capability_set_free);
+  tp_clear_pointer (&(self->priv->feature_refs), g_hash_table_unref);
+  tp_clear_pointer (&(self->priv->aggregate_forms), g_ptr_array_unref);
+#endif
 
   if (G_OBJECT_CLASS (ytst_caps_manager_parent_class)->dispose)
     G_OBJECT_CLASS (ytst_caps_manager_parent_class)->dispose (object);
 }
 
+static void
+ytst_caps_manager_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  YtstCapsManager *self = YTST_CAPS_MANAGER (object);
+  YtstCapsManagerPrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+      case PROP_CONNECTION:
+        g_value_set_object (value, priv->connection);
+        break;
+      case PROP_COMPACT:
+        g_value_set_boolean (value, priv->compact);
+        break;
+      case PROP_DEBOUNCE_WINDOW:
+        g_value_set_uint (value, priv->debounce_window);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+ytst_caps_manager_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  YtstCapsManager *self = YTST_CAPS_MANAGER (object);
+  YtstCapsManagerPrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+      case PROP_CONNECTION:
+        /* not a ref: the connection owns us */
+        priv->connection = g_value_get_object (value);
+        break;
+      case PROP_COMPACT:
+        priv->compact = g_value_get_boolean (value);
+        break;
+      case PROP_DEBOUNCE_WINDOW:
+        priv->debounce_window = g_value_get_uint (value);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
 static void
 ytst_caps_manager_class_init (YtstCapsManagerClass *klass)
 {
   GObjectClass *oclass = G_OBJECT_CLASS (klass);
+  GParamSpec *param_spec;
 
+  oclass->constructed = ytst_caps_manager_constructed;
   oclass->dispose = ytst_caps_manager_dispose;
+  oclass->get_property = ytst_caps_manager_get_property;
+  oclass->set_property = ytst_caps_manager_set_property;
 
   g_type_class_add_private (klass, sizeof (YtstCapsManagerPrivate));
+
+  param_spec = g_param_spec_object (
+      "connection",
+      "TpBaseConnection object",
+      "Connection whose clients' capabilities we represent.",
+      TP_TYPE_BASE_CONNECTION,
+      G_PARAM_CONSTRUCT_ONLY |
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (oclass, PROP_CONNECTION, param_spec);
+
+  param_spec = g_param_spec_boolean (
+      "compact-advertisement",
+      "Compact advertisement",
+      "Advertise one summary form listing our services, which peers "
+      "fetch the details of on demand, instead of a full form for each "
+      "service. Only peers advertising " YTST_INDEX_NS " understand it. "
+      "Takes effect the next time clients' capabilities are updated.",
+      FALSE,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (oclass, PROP_COMPACT, param_spec);
+
+  param_spec = g_param_spec_uint (
+      "debounce-window",
+      "Debounce window",
+      "Milliseconds after a change to our capabilities goes out during "
+      "which further changes are held back, so that a burst of clients "
+      "registering only changes our caps hash once or twice. What is "
+      "held back goes out with the first update after the window "
+      "closes. 0 lets every change out straight away.",
+      0, G_MAXUINT, 500,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (oclass, PROP_DEBOUNCE_WINDOW,
+      param_spec);
 }
 
 static void
@@ -176,22 +630,479 @@ make_new_data_form (const gchar *uid,
 
 #ifdef SALUT
 static void
-add_to_set (gpointer key,
+add_index_entry (gpointer key,
     gpointer value,
     gpointer user_data)
 {
-  gabble_capability_set_update (user_data, value);
+  WockyNode *field = user_data;
+  ServiceDetail *detail = value;
+  gchar *entry = g_strdup_printf ("%s/%s", (const gchar *) key,
+      detail->digest);
+
+  add_value_to_field (entry, field);
+  g_free (entry);
+}
+
+/* One form listing every service as "<uid>/<digest>" */
+static WockyDataForm *
+make_index_form (GHashTable *service_details)
+{
+  WockyNode *node, *field;
+  WockyDataForm *out;
+
+  node = wocky_node_new ("x", WOCKY_XMPP_NS_DATA);
+  wocky_node_add_build (node,
+      '@', "type", "result",
+
+      '(', "field",
+        '@', "var", "FORM_TYPE",
+        '@', "type", "hidden",
+        '(', "value",
+          '$', YTST_INDEX_NS,
+        ')',
+      ')',
+
+      '(', "field",
+        '@', "var", "services",
+        '@', "type", "text-multi",
+        '*', &field,
+      ')',
+
+      NULL);
+
+  g_hash_table_foreach (service_details, add_index_entry, field);
+
+  out = wocky_data_form_new_from_node (node, NULL);
+
+  wocky_node_free (node);
+
+  return out;
+}
+
+static WockyDataForm *
+manager_get_index_form (YtstCapsManager *self)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+
+  if (priv->index_form == NULL)
+    priv->index_form = make_index_form (priv->service_details);
+
+  return priv->index_form;
+}
+#else
+/* What one service looks like in compact mode. gabble keeps each
+ * client's forms apart, so there can't be one summary form for all of
+ * them there. */
+static WockyDataForm *
+make_index_stub_form (const gchar *uid,
+    const gchar *digest)
+{
+  WockyNode *node;
+  WockyDataForm *out;
+  gchar *form_type = g_strdup_printf ("%s%s", INDEX_PREFIX, uid);
+
+  node = wocky_node_new ("x", WOCKY_XMPP_NS_DATA);
+  wocky_node_add_build (node,
+      '@', "type", "result",
+
+      '(', "field",
+        '@', "var", "FORM_TYPE",
+        '@', "type", "hidden",
+        '(', "value",
+          '$', form_type,
+        ')',
+      ')',
+
+      '(', "field",
+        '@', "var", "digest",
+        '@', "type", "text-single",
+        '(', "value",
+          '$', digest,
+        ')',
+      ')',
+
+      NULL);
+
+  g_free (form_type);
+
+  out = wocky_data_form_new_from_node (node, NULL);
+
+  wocky_node_free (node);
+
+  return out;
+}
+#endif
+
+/* Remembers @form as the details of @uid, for peers asking for them */
+static const gchar *
+set_service_detail (YtstCapsManager *self,
+    const gchar *client_name,
+    const gchar *uid,
+    const gchar *type,
+    GPtrArray *names,
+    GPtrArray *caps,
+    WockyDataForm *form)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+  ServiceDetail *detail = g_slice_new0 (ServiceDetail);
+
+  /* make them strvs for the digest */
+  g_ptr_array_add (names, NULL);
+  g_ptr_array_add (caps, NULL);
+
+  detail->client_name = g_strdup (client_name);
+  detail->form = g_object_ref (form);
+  detail->digest = ytst_service_digest (uid,
+      type != NULL ? type : "application",
+      (const gchar * const *) names->pdata,
+      (const gchar * const *) caps->pdata);
+
+  g_hash_table_insert (priv->service_details, g_strdup (uid), detail);
+
+#ifdef SALUT
+  tp_clear_object (&priv->index_form);
+#endif
+
+  return detail->digest;
 }
 
 static void
-add_to_array (gpointer key,
-    gpointer value,
+remove_service_detail (YtstCapsManager *self,
+    const gchar *client_name,
+    const gchar *uid)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+  ServiceDetail *detail = g_hash_table_lookup (priv->service_details, uid);
+
+  /* someone else might have taken the uid over since */
+  if (detail == NULL || tp_strdiff (detail->client_name, client_name))
+    return;
+
+  g_hash_table_remove (priv->service_details, uid);
+
+#ifdef SALUT
+  tp_clear_object (&priv->index_form);
+#endif
+}
+
+static void
+unref_handled_service (YtstCapsManager *self,
+    const gchar *service)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+  guint refs;
+
+  refs = GPOINTER_TO_UINT (g_hash_table_lookup (priv->handled_services,
+          service));
+
+  if (refs <= 1)
+    g_hash_table_remove (priv->handled_services, service);
+  else
+    g_hash_table_insert (priv->handled_services, g_strdup (service),
+        GUINT_TO_POINTER (refs - 1));
+}
+
+static void
+ref_handled_service (YtstCapsManager *self,
+    const gchar *service)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+  guint refs;
+
+  refs = GPOINTER_TO_UINT (g_hash_table_lookup (priv->handled_services,
+          service));
+
+  g_hash_table_insert (priv->handled_services, g_strdup (service),
+      GUINT_TO_POINTER (refs + 1));
+}
+
+static void
+update_client_services (YtstCapsManager *self,
+    const gchar *client_name,
+    GPtrArray *services,
+    gboolean wildcard)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+  ClientRecord *record;
+  gchar **s;
+  guint i;
+
+  record = g_hash_table_lookup (priv->clients, client_name);
+
+  if (record != NULL)
+    {
+      for (s = record->services; *s != NULL; s++)
+        unref_handled_service (self, *s);
+
+      if (record->wildcard)
+        priv->wildcard_clients--;
+
+      g_hash_table_remove (priv->clients, client_name);
+    }
+
+  if (services->len == 0 && !wildcard)
+    return;
+
+  record = g_slice_new (ClientRecord);
+  record->services = g_new0 (gchar *, services->len + 1);
+  for (i = 0; i < services->len; i++)
+    record->services[i] = g_strdup (g_ptr_array_index (services, i));
+  record->wildcard = wildcard;
+
+  for (s = record->services; *s != NULL; s++)
+    ref_handled_service (self, *s);
+
+  if (record->wildcard)
+    priv->wildcard_clients++;
+
+  g_hash_table_insert (priv->clients, g_strdup (client_name), record);
+}
+
+#ifdef SALUT
+static void
+ref_feature (gpointer data,
+    gpointer user_data)
+{
+  YtstCapsManager *self = user_data;
+  YtstCapsManagerPrivate *priv = self->priv;
+  const gchar *feature = data;
+  guint refs;
+
+  refs = GPOINTER_TO_UINT (g_hash_table_lookup (priv->feature_refs,
+          feature));
+
+  if (refs == 0)
+    {
+      DEBUG ("advertising %s", feature);
+      gabble_capability_set_add (priv->aggregate_caps, feature);
+    }
+
+  g_hash_table_insert (priv->feature_refs, g_strdup (feature),
+      GUINT_TO_POINTER (refs + 1));
+}
+
+static void
+unref_feature (gpointer data,
     gpointer user_data)
 {
-  g_ptr_array_add (user_data, g_object_ref (value));
+  YtstCapsManager *self = user_data;
+  YtstCapsManagerPrivate *priv = self->priv;
+  const gchar *feature = data;
+  GabbleCapabilitySet *removed;
+  guint refs;
+
+  refs = GPOINTER_TO_UINT (g_hash_table_lookup (priv->feature_refs,
+          feature));
+
+  if (refs > 1)
+    {
+      g_hash_table_insert (priv->feature_refs, g_strdup (feature),
+          GUINT_TO_POINTER (refs - 1));
+      return;
+    }
+
+  /* so peers stop sending us events nobody will look at */
+  DEBUG ("no clients want %s any more; withdrawing it", feature);
+  g_hash_table_remove (priv->feature_refs, feature);
+
+  removed = gabble_capability_set_new ();
+  gabble_capability_set_add (removed, feature);
+  gabble_capability_set_exclude (priv->aggregate_caps, removed);
+  gabble_capability_set_free (removed);
+}
+
+/* Swaps @client_name's contribution to the aggregate caps and forms
+ * for @client_set and @form, both of which are taken and may be NULL,
+ * without touching any other client's. */
+static void
+update_client_aggregate (YtstCapsManager *self,
+    const gchar *client_name,
+    GabbleCapabilitySet *client_set,
+    WockyDataForm *form)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+  GabbleCapabilitySet *old_set;
+  WockyDataForm *old_form;
+
+  old_set = g_hash_table_lookup (priv->cap_sets, client_name);
+  if (old_set != NULL)
+    gabble_capability_set_foreach (old_set, unref_feature, self);
+
+  old_form = g_hash_table_lookup (priv->services, client_name);
+  if (old_form != NULL)
+    g_ptr_array_remove (priv->aggregate_forms, old_form);
+
+  if (client_set != NULL)
+    {
+      gabble_capability_set_foreach (client_set, ref_feature, self);
+      g_hash_table_insert (priv->cap_sets, g_strdup (client_name),
+          client_set);
+    }
+  else
+    {
+      g_hash_table_remove (priv->cap_sets, client_name);
+    }
+
+  if (form != NULL)
+    {
+      g_ptr_array_add (priv->aggregate_forms, g_object_ref (form));
+      g_hash_table_insert (priv->services, g_strdup (client_name), form);
+    }
+  else
+    {
+      g_hash_table_remove (priv->services, client_name);
+    }
 }
 #endif
 
+static void
+output_client_caps (YtstCapsManager *self,
+    ParsedClient *parsed,
+    GabbleCapabilitySet *cap_set,
+    GPtrArray *data_forms)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+#ifdef SALUT
+  guint i;
+#else
+  WockyDataForm *form;
+#endif
+
+  /* we can always fetch details from peers advertising compactly */
+  gabble_capability_set_add (cap_set, YTST_INDEX_NS);
+
+#ifdef SALUT
+  /* salut wants everything every time; see below */
+  gabble_capability_set_update (cap_set, priv->aggregate_caps);
+
+  if (priv->compact)
+    {
+      if (g_hash_table_size (priv->service_details) > 0)
+        g_ptr_array_add (data_forms,
+            g_object_ref (manager_get_index_form (self)));
+    }
+  else
+    {
+      for (i = 0; i < priv->aggregate_forms->len; i++)
+        g_ptr_array_add (data_forms,
+            g_object_ref (g_ptr_array_index (priv->aggregate_forms, i)));
+    }
+#else
+  gabble_capability_set_update (cap_set, parsed->features);
+
+  form = priv->compact ? parsed->stub_form : parsed->form;
+  if (form != NULL)
+    g_ptr_array_add (data_forms, g_object_ref (form));
+#endif
+}
+
+static gboolean
+hold_start_cb (gpointer user_data)
+{
+  YtstCapsManager *self = YTST_CAPS_MANAGER (user_data);
+  YtstCapsManagerPrivate *priv = self->priv;
+
+  priv->hold_id = 0;
+  priv->holding = TRUE;
+  priv->held_back = FALSE;
+
+  return FALSE;
+}
+
+static gboolean
+hold_end_cb (gpointer user_data)
+{
+  YtstCapsManager *self = YTST_CAPS_MANAGER (user_data);
+  YtstCapsManagerPrivate *priv = self->priv;
+
+  priv->window_id = 0;
+  priv->holding = FALSE;
+
+  if (priv->hold_id != 0)
+    {
+      g_source_remove (priv->hold_id);
+      priv->hold_id = 0;
+    }
+
+  if (priv->held_back)
+    DEBUG ("window closed; held back changes go out with the next update");
+
+  return FALSE;
+}
+
+/* Something new is going out, so hold back whatever comes after it until
+ * the window closes. Holding only starts once we're back in the main
+ * loop, so that the rest of the clients in the same UpdateCapabilities
+ * call go out with it. */
+static void
+manager_open_window (YtstCapsManager *self)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+
+  if (priv->window_id != 0)
+    return;
+
+  priv->hold_id = g_idle_add (hold_start_cb, self);
+  priv->window_id = g_timeout_add (priv->debounce_window, hold_end_cb,
+      self);
+}
+
+/* Adds what @client_name should be represented by right now to @cap_set
+ * and @data_forms. While holding, that's whatever it was represented by
+ * last time, so our caps and their hash stay as they were; otherwise
+ * it's @parsed, which @changed says is new. */
+static void
+manager_output_client (YtstCapsManager *self,
+    const gchar *client_name,
+    ParsedClient *parsed,
+    gboolean changed,
+    GabbleCapabilitySet *cap_set,
+    GPtrArray *data_forms)
+{
+  YtstCapsManagerPrivate *priv = self->priv;
+  AdvertisedClient *advertised;
+  guint i;
+
+  if (priv->debounce_window == 0)
+    {
+      output_client_caps (self, parsed, cap_set, data_forms);
+      return;
+    }
+
+  if (priv->holding)
+    {
+      if (changed)
+        {
+          DEBUG ("holding back %s's change for now", client_name);
+          priv->held_back = TRUE;
+        }
+    }
+  else
+    {
+      if (changed || priv->held_back)
+        manager_open_window (self);
+
+      advertised = g_slice_new (AdvertisedClient);
+      advertised->caps = gabble_capability_set_new ();
+      advertised->forms = g_ptr_array_new_with_free_func (g_object_unref);
+      output_client_caps (self, parsed, advertised->caps, advertised->forms);
+
+      g_hash_table_insert (priv->advertised, g_strdup (client_name),
+          advertised);
+    }
+
+  /* a client we haven't let out yet isn't represented at all */
+  advertised = g_hash_table_lookup (priv->advertised, client_name);
+  if (advertised == NULL)
+    return;
+
+  gabble_capability_set_update (cap_set, advertised->caps);
+
+  for (i = 0; i < advertised->forms->len; i++)
+    g_ptr_array_add (data_forms,
+        g_object_ref (g_ptr_array_index (advertised->forms, i)));
+}
+
 static void
 ytst_caps_manager_represent_client (GabbleCapsChannelManager *manager,
     const gchar *client_name,
@@ -200,48 +1111,79 @@ ytst_caps_manager_represent_client (GabbleCapsChannelManager *manager,
     GabbleCapabilitySet *cap_set,
     GPtrArray *data_forms)
 {
-#ifdef SALUT
   YtstCapsManager *self = YTST_CAPS_MANAGER (manager);
   YtstCapsManagerPrivate *priv = self->priv;
-#endif
   const gchar * const *t;
 
   const gchar *uid = NULL;
   const gchar *yts_type = NULL;
-  GPtrArray *names = g_ptr_array_new ();
-  GPtrArray *caps = g_ptr_array_new ();
+  GPtrArray *names;
+  GPtrArray *caps;
   GabbleCapabilitySet *client_set;
-
-#ifdef GABBLE
+  /* services this client will handle requests for; borrowed strings */
+  GPtrArray *handled;
+  /* what each filter said about TargetService; borrowed strings */
+  GPtrArray *filter_services;
+  gboolean wildcard = FALSE;
+  ParsedClient *parsed, *old_parsed;
+  WockyDataForm *form = NULL;
+  guint fingerprint;
   guint i;
-#endif
 
+  /* Mission Control tells us about every client again each time any of
+   * them changes, so don't redo the work for the ones that haven't. */
+  fingerprint = client_fingerprint (filters, cap_tokens);
+  parsed = g_hash_table_lookup (priv->parsed_clients, client_name);
+
+  if (parsed != NULL
+      && parsed_client_matches (parsed, fingerprint, filters, cap_tokens))
+    {
+      manager_output_client (self, client_name, parsed, FALSE, cap_set,
+          data_forms);
+      return;
+    }
+
+  names = g_ptr_array_new ();
+  caps = g_ptr_array_new ();
+  handled = g_ptr_array_new ();
+  filter_services = g_ptr_array_new ();
   client_set = gabble_capability_set_new ();
 
+  parsed = g_slice_new0 (ParsedClient);
+  parsed->fingerprint = fingerprint;
+  parsed->tokens = g_strdupv ((gchar **) cap_tokens);
 #ifdef GABBLE
-  for (i = 0; i < filters->len; i++)
+  parsed->features = gabble_capability_set_new ();
+#endif
+
+  for (i = 0; filters != NULL && i < filters->len; i++)
     {
-      GHashTable *channel_class = g_ptr_array_index (filters, i);
-      const gchar *service_name;
+      const gchar *service_name = get_filter_service (
+          g_ptr_array_index (filters, i));
+#ifdef GABBLE
       gchar *cap;
+#endif
 
-      if (tp_strdiff (tp_asv_get_string (channel_class,
-                  TP_IFACE_CHANNEL ".ChannelType"),
-              TP_YTS_IFACE_CHANNEL))
+      if (service_name == NULL)
         continue;
 
-      service_name = tp_asv_get_string (channel_class,
-          TP_YTS_IFACE_CHANNEL ".TargetService");
+      g_ptr_array_add (filter_services, (gpointer) service_name);
 
-      if (service_name == NULL)
-        continue;
+      if (*service_name == '\0')
+        {
+          wildcard = TRUE;
+          continue;
+        }
+
+      g_ptr_array_add (handled, (gpointer) service_name);
 
+#ifdef GABBLE
       cap = g_strdup_printf ("%s#%s",
           YTST_SERVICE_NS, service_name);
-      gabble_capability_set_add (cap_set, cap);
+      gabble_capability_set_add (parsed->features, cap);
       g_free (cap);
-    }
 #endif
+    }
 
   for (t = cap_tokens; t != NULL && *t != NULL; t++)
     {
@@ -258,6 +1200,7 @@ ytst_caps_manager_represent_client (GabbleCapsChannelManager *manager,
       else if (g_str_has_prefix (*t, UID))
         {
           uid = *t + strlen (UID);
+          g_ptr_array_add (handled, (gpointer) uid);
         }
       else if (g_str_has_prefix (*t, TYPE))
         {
@@ -273,6 +1216,11 @@ ytst_caps_manager_represent_client (GabbleCapsChannelManager *manager,
         }
     }
 
+  parsed->filter_services = g_new0 (gchar *, filter_services->len + 1);
+  for (i = 0; i < filter_services->len; i++)
+    parsed->filter_services[i] = g_strdup (
+        g_ptr_array_index (filter_services, i));
+
   /* So, gabble and salut have different ideas of how to save caps for
    * clients. salut is arguably wrong here as it relies on the caps
    * channel manager keeping a record of what clients can do. gabble
@@ -280,37 +1228,102 @@ ytst_caps_manager_represent_client (GabbleCapsChannelManager *manager,
    * priv->cap_sets and priv->services hash tables at all.
    * We should fix salut. */
 
+  /* the client isn't that service any more */
+  old_parsed = g_hash_table_lookup (priv->parsed_clients, client_name);
+  if (old_parsed != NULL && old_parsed->uid != NULL
+      && tp_strdiff (old_parsed->uid, uid))
+    remove_service_detail (self, client_name, old_parsed->uid);
+
   if (uid != NULL)
     {
+      form = make_new_data_form (uid, yts_type, names, caps);
+      parsed->uid = g_strdup (uid);
+
 #ifdef SALUT
-      g_hash_table_insert (priv->services,
-          g_strdup (client_name),
-          make_new_data_form (uid, yts_type, names, caps));
-      g_hash_table_insert (priv->cap_sets,
-          g_strdup (client_name), client_set);
+      set_service_detail (self, client_name, uid, yts_type, names, caps,
+          form);
 #else
-      g_ptr_array_add (data_forms,
-          make_new_data_form (uid, yts_type, names, caps));
-      gabble_capability_set_update (cap_set, client_set);
-      gabble_capability_set_free (client_set);
-#endif
-    }
-  else
-    {
-#ifdef SALUT
-      g_hash_table_remove (priv->services, client_name);
-      g_hash_table_remove (priv->cap_sets, client_name);
-      gabble_capability_set_free (client_set);
+      parsed->form = form;
+      parsed->stub_form = make_index_stub_form (uid,
+          set_service_detail (self, client_name, uid, yts_type, names, caps,
+              form));
 #endif
     }
 
+  /* Clients which only want to hear about statuses don't have a uid,
+   * but their +notify features still need advertising. Each feature
+   * goes again once the last client interested in it does: salut
+   * refcounts them in update_client_aggregate(), and gabble keeps
+   * them with the client's caps, which it drops itself. */
 #ifdef SALUT
-  g_hash_table_foreach (priv->cap_sets, add_to_set, cap_set);
-  g_hash_table_foreach (priv->services, add_to_array, data_forms);
+  update_client_aggregate (self, client_name, client_set, form);
+#else
+  gabble_capability_set_update (parsed->features, client_set);
+  gabble_capability_set_free (client_set);
 #endif
 
+  g_hash_table_insert (priv->parsed_clients, g_strdup (client_name), parsed);
+
+  manager_output_client (self, client_name, parsed, TRUE, cap_set,
+      data_forms);
+
+  /* Note that gabble does not tell us when a client goes away
+   * completely, so a stale entry can stay behind there. That just
+   * means we let requests for it through to the channel dispatcher
+   * like we used to. */
+  update_client_services (self, client_name, handled, wildcard);
+
   g_ptr_array_unref (names);
   g_ptr_array_unref (caps);
+  g_ptr_array_unref (handled);
+  g_ptr_array_unref (filter_services);
+}
+
+/* -----------------------------------------------------------------------------
+ * PUBLIC METHODS
+ */
+
+/*
+ * Returns the full form of one of our own services, or %NULL if we
+ * don't have it. If @digest isn't %NULL it has to match too, in which
+ * case the form is the same as any other service with that digest.
+ */
+WockyDataForm *
+ytst_caps_manager_get_service_form (YtstCapsManager *self,
+    const gchar *uid,
+    const gchar *digest)
+{
+  ServiceDetail *detail;
+
+  g_return_val_if_fail (YTST_IS_CAPS_MANAGER (self), NULL);
+  g_return_val_if_fail (uid != NULL, NULL);
+
+  detail = g_hash_table_lookup (self->priv->service_details, uid);
+
+  if (detail == NULL
+      || (digest != NULL && tp_strdiff (digest, detail->digest)))
+    return NULL;
+
+  return detail->form;
+}
+
+gboolean
+ytst_caps_manager_handles_service (YtstCapsManager *self,
+    const gchar *service)
+{
+  YtstCapsManagerPrivate *priv;
+
+  g_return_val_if_fail (YTST_IS_CAPS_MANAGER (self), TRUE);
+
+  priv = self->priv;
+
+  if (priv->wildcard_clients > 0)
+    return TRUE;
+
+  if (service == NULL)
+    return FALSE;
+
+  return g_hash_table_lookup (priv->handled_services, service) != NULL;
 }
 
 static void
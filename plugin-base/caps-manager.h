@@ -20,6 +20,8 @@
 
 #include <glib-object.h>
 
+#include <wocky/wocky.h>
+
 #ifndef YTST_CAPS_MANAGER_H
 #define YTST_CAPS_MANAGER_H
 
@@ -58,6 +60,13 @@ GType ytst_caps_manager_get_type (void);
   (G_TYPE_INSTANCE_GET_CLASS ((obj), YTST_TYPE_CAPS_MANAGER, \
                               YtstCapsManagerClass))
 
+gboolean ytst_caps_manager_handles_service (YtstCapsManager *self,
+    const gchar *service);
+
+WockyDataForm * ytst_caps_manager_get_service_form (YtstCapsManager *self,
+    const gchar *uid,
+    const gchar *digest);
+
 G_END_DECLS
 
 #endif /* ifndef YTST_CAPS_MANAGER_H */
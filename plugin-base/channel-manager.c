@@ -23,13 +23,16 @@
 #include <string.h>
 
 #include "message-channel.h"
+#include "caps-manager.h"
 #include "channel-manager.h"
+#include "direct-bus.h"
 #include "utils.h"
 
 #include <telepathy-glib/channel-manager.h>
 #include <telepathy-glib/dbus.h>
 #include <telepathy-glib/gtypes.h>
 #include <telepathy-glib/interfaces.h>
+#include <telepathy-glib/svc-connection.h>
 #include <telepathy-glib/util.h>
 
 #include <wocky/wocky.h>
@@ -49,6 +52,28 @@ typedef GabblePluginConnection FooConnection;
 #define DEBUG(msg, ...) \
   g_debug ("%s: " msg, G_STRFUNC, ##__VA_ARGS__)
 
+/* Incoming requests each contact may send in one go, and how many per
+ * second they get back afterwards */
+#define DEFAULT_RATE_LIMIT_BURST 50
+#define DEFAULT_RATE_LIMIT_RATE 10
+
+/* How often, in seconds, to forget contacts whose buckets have filled
+ * up again */
+#define BUCKET_SWEEP_INTERVAL 30
+
+/* Most incoming channels announced in one NewChannels signal when
+ * batching is turned on */
+#define DEFAULT_BATCH_SIZE 32
+
+/* Unreplied incoming requests held at once, across all services and
+ * for any one of them */
+#define DEFAULT_BACKLOG_LIMIT 1000
+#define DEFAULT_SERVICE_BACKLOG_LIMIT 100
+
+/* How long, in microseconds, each main loop iteration may spend closing
+ * channels after a disconnection */
+#define TEARDOWN_BUDGET 5000
+
 static void ytst_channel_manager_iface_init (gpointer g_iface,
     gpointer iface_data);
 static void ytst_caps_channel_manager_iface_init (gpointer g_iface,
@@ -65,38 +90,720 @@ G_DEFINE_TYPE_WITH_CODE (YtstChannelManager, ytst_channel_manager, G_TYPE_OBJECT
 enum
 {
   PROP_CONNECTION = 1,
+  PROP_CAPS_MANAGER,
+  PROP_RATE_LIMIT_BURST,
+  PROP_RATE_LIMIT_RATE,
+  PROP_DROPPED_REQUESTS,
+  PROP_BATCH_WINDOW,
+  PROP_BATCH_SIZE,
+  PROP_BACKLOG_LIMIT,
+  PROP_SERVICE_BACKLOG_LIMIT,
+  PROP_BACKLOG,
   LAST_PROPERTY
 };
 
+/* signals */
+enum
+{
+  BACKLOG_CHANGED,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = {0};
+
+typedef struct
+{
+  guint pending;
+  /* TRUE from the time pending hits the limit until it drains back to
+   * half of it */
+  gboolean saturated;
+} Backlog;
+
 /* private structure */
 struct _YtstChannelManagerPrivate
 {
   FooConnection *connection;
+  YtstCapsManager *caps_manager;
   GQueue *channels;
+  /* channels still to be closed after a disconnection */
+  GQueue *closing;
+  guint teardown_id;
   gulong status_changed_id;
   guint message_handler_id;
+
+  /* TpHandle -> TokenBucket* */
+  GHashTable *buckets;
+  guint bucket_sweep_id;
+  guint rate_limit_burst;
+  guint rate_limit_rate;
+  guint dropped_requests;
+
+  /* incoming channels not announced yet, batched by who they're from
+   * and which service they're for:
+   * gchar *"<handle>/<service>" -> PendingBatch* */
+  GHashTable *pending_batches;
+  /* YtstMessageChannel* -> PendingBatch*, borrowing both */
+  GHashTable *batched_channels;
+  guint batch_window;
+  guint batch_size;
+
+  /* unreplied incoming channels */
+  Backlog backlog;
+  guint backlog_limit;
+  /* gchar *service -> Backlog* */
+  GHashTable *service_backlogs;
+  guint service_backlog_limit;
+  /* YtstMessageChannel* -> gchar *service, or "" if it had none */
+  GHashTable *backlog_channels;
+
+#ifdef SALUT
+  /* WockyLLContact* -> ContactCacheEntry* */
+  GHashTable *contact_cache;
+  /* TpHandle -> WockyLLContact* */
+  GHashTable *handle_cache;
+#else
+  /* gchar *bare_jid -> GHashTable<gchar *service, gchar *resource> */
+  GHashTable *resource_cache;
+  gulong capabilities_changed_id;
+#endif
   gboolean dispose_has_run;
 };
 
+typedef struct
+{
+  gdouble tokens;
+  gint64 last_refill;
+} TokenBucket;
+
+typedef struct
+{
+  YtstChannelManager *self;
+  gchar *key;
+  /* borrowed from channels, oldest first */
+  GQueue channels;
+  guint timeout_id;
+} PendingBatch;
+
+#ifdef SALUT
+typedef struct
+{
+  gchar *jid;
+  TpHandle handle;
+} ContactCacheEntry;
+#endif
+
 /* -----------------------------------------------------------------------------
  * INTERNAL
  */
 
+static void
+token_bucket_free (TokenBucket *bucket)
+{
+  g_slice_free (TokenBucket, bucket);
+}
+
+/* Tops @bucket up with whatever it's earned since it was last used */
+static void
+token_bucket_refill (YtstChannelManager *self,
+    TokenBucket *bucket,
+    gint64 now)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+
+  bucket->tokens += (gdouble) (now - bucket->last_refill)
+      * priv->rate_limit_rate / G_USEC_PER_SEC;
+  bucket->tokens = MIN (bucket->tokens, priv->rate_limit_burst);
+  bucket->last_refill = now;
+}
+
+/* A full bucket is no different from not having one, so there's no
+ * need to remember everyone who ever sent us a request */
+static gboolean
+bucket_sweep_cb (gpointer user_data)
+{
+  YtstChannelManager *self = YTST_CHANNEL_MANAGER (user_data);
+  YtstChannelManagerPrivate *priv = self->priv;
+  GHashTableIter iter;
+  gpointer bucket;
+  gint64 now = g_get_monotonic_time ();
+
+  g_hash_table_iter_init (&iter, priv->buckets);
+  while (g_hash_table_iter_next (&iter, NULL, &bucket))
+    {
+      token_bucket_refill (self, bucket, now);
+
+      if (((TokenBucket *) bucket)->tokens >= priv->rate_limit_burst)
+        g_hash_table_iter_remove (&iter);
+    }
+
+  if (g_hash_table_size (priv->buckets) > 0)
+    return TRUE;
+
+  priv->bucket_sweep_id = 0;
+  return FALSE;
+}
+
+static gboolean
+manager_admit_request (YtstChannelManager *self,
+    TpHandle handle)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  TokenBucket *bucket;
+  gint64 now;
+
+  if (priv->rate_limit_burst == 0)
+    return TRUE;
+
+  now = g_get_monotonic_time ();
+  bucket = g_hash_table_lookup (priv->buckets, GUINT_TO_POINTER (handle));
+
+  if (bucket == NULL)
+    {
+      bucket = g_slice_new (TokenBucket);
+      bucket->tokens = priv->rate_limit_burst;
+      bucket->last_refill = now;
+      g_hash_table_insert (priv->buckets, GUINT_TO_POINTER (handle), bucket);
+
+      if (priv->bucket_sweep_id == 0)
+        priv->bucket_sweep_id = g_timeout_add_seconds (
+            BUCKET_SWEEP_INTERVAL, bucket_sweep_cb, self);
+    }
+  else
+    {
+      token_bucket_refill (self, bucket, now);
+    }
+
+  if (bucket->tokens < 1.0)
+    {
+      priv->dropped_requests++;
+      g_object_notify (G_OBJECT (self), "dropped-requests");
+      return FALSE;
+    }
+
+  bucket->tokens -= 1.0;
+  return TRUE;
+}
+
+#ifdef SALUT
+static void
+contact_cache_entry_free (ContactCacheEntry *entry)
+{
+  g_free (entry->jid);
+  g_slice_free (ContactCacheEntry, entry);
+}
+
+static void
+contact_cache_weak_notify (gpointer data,
+    GObject *where_the_object_was)
+{
+  YtstChannelManager *self = YTST_CHANNEL_MANAGER (data);
+  YtstChannelManagerPrivate *priv = self->priv;
+  ContactCacheEntry *entry;
+  gpointer handle;
+
+  entry = g_hash_table_lookup (priv->contact_cache, where_the_object_was);
+  if (entry == NULL)
+    return;
+
+  DEBUG ("Forgetting contact %s", entry->jid);
+
+  /* The handle might already have been taken over by a newer contact
+   * object for the same jid */
+  handle = GUINT_TO_POINTER (entry->handle);
+  if (g_hash_table_lookup (priv->handle_cache, handle) == where_the_object_was)
+    g_hash_table_remove (priv->handle_cache, handle);
+
+  g_hash_table_remove (priv->contact_cache, where_the_object_was);
+}
+
+static void
+contact_cache_add (YtstChannelManager *self,
+    WockyLLContact *contact,
+    gchar *jid,
+    TpHandle handle)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  ContactCacheEntry *entry;
+
+  /* Takes ownership of jid */
+  entry = g_slice_new (ContactCacheEntry);
+  entry->jid = jid;
+  entry->handle = handle;
+
+  g_hash_table_insert (priv->contact_cache, contact, entry);
+  g_hash_table_insert (priv->handle_cache, GUINT_TO_POINTER (handle), contact);
+
+  /* The contact factory drops contacts when they are finalized, so
+   * that is when our entry becomes stale too */
+  g_object_weak_ref (G_OBJECT (contact), contact_cache_weak_notify, self);
+}
+
+static void
+contact_cache_clear (YtstChannelManager *self)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  GHashTableIter iter;
+  gpointer contact;
+
+  g_hash_table_iter_init (&iter, priv->contact_cache);
+  while (g_hash_table_iter_next (&iter, &contact, NULL))
+    g_object_weak_unref (contact, contact_cache_weak_notify, self);
+
+  g_hash_table_remove_all (priv->contact_cache);
+  g_hash_table_remove_all (priv->handle_cache);
+}
+
+static TpHandle
+manager_lookup_contact_handle (YtstChannelManager *self,
+    WockyLLContact *contact)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION (priv->connection);
+  TpHandleRepoIface *handle_repo = tp_base_connection_get_handles (base_conn,
+       TP_HANDLE_TYPE_CONTACT);
+  ContactCacheEntry *entry;
+  TpHandle handle;
+  gchar *jid;
+
+  entry = g_hash_table_lookup (priv->contact_cache, contact);
+  if (entry != NULL)
+    return entry->handle;
+
+  jid = wocky_contact_dup_jid (WOCKY_CONTACT (contact));
+  handle = tp_handle_lookup (handle_repo, jid, NULL, NULL);
+  if (handle == 0)
+    {
+      g_free (jid);
+      return 0;
+    }
+
+  contact_cache_add (self, contact, jid, handle);
+  return handle;
+}
+
+static WockyLLContact *
+manager_lookup_handle_contact (YtstChannelManager *self,
+    TpHandle handle)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION (priv->connection);
+  TpHandleRepoIface *handle_repo = tp_base_connection_get_handles (base_conn,
+       TP_HANDLE_TYPE_CONTACT);
+  WockySession *session;
+  WockyContactFactory *factory;
+  WockyLLContact *contact;
+  const gchar *name;
+
+  contact = g_hash_table_lookup (priv->handle_cache, GUINT_TO_POINTER (handle));
+  if (contact != NULL)
+    return contact;
+
+  name = tp_handle_inspect (handle_repo, handle);
+  session = salut_plugin_connection_get_session (priv->connection);
+  factory = wocky_session_get_contact_factory (session);
+  contact = wocky_contact_factory_lookup_ll_contact (factory, name);
+
+  if (contact != NULL
+      && g_hash_table_lookup (priv->contact_cache, contact) == NULL)
+    contact_cache_add (self, contact, g_strdup (name), handle);
+
+  return contact;
+}
+#else
+static gboolean
+capabilities_changed_cb (GSignalInvocationHint *ihint,
+    guint n_param_values,
+    const GValue *param_values,
+    gpointer user_data)
+{
+  YtstChannelManager *self = YTST_CHANNEL_MANAGER (user_data);
+  YtstChannelManagerPrivate *priv = self->priv;
+  const gchar *jid;
+
+  jid = gabble_plugin_connection_get_jid_for_caps (priv->connection,
+      WOCKY_XEP_0115_CAPABILITIES (g_value_get_object (param_values)));
+
+  if (jid != NULL)
+    g_hash_table_remove (priv->resource_cache, jid);
+
+  return TRUE;
+}
+
+/* The best resource also depends on which ones are online and their
+ * priorities, which can change without their caps changing */
+static void
+presences_changed_cb (GObject *connection,
+    GHashTable *presences,
+    YtstChannelManager *self)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  TpHandleRepoIface *handle_repo = tp_base_connection_get_handles (
+      TP_BASE_CONNECTION (priv->connection), TP_HANDLE_TYPE_CONTACT);
+  GHashTableIter iter;
+  gpointer key;
+
+  if (g_hash_table_size (priv->resource_cache) == 0)
+    return;
+
+  g_hash_table_iter_init (&iter, presences);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      TpHandle handle = GPOINTER_TO_UINT (key);
+
+      if (tp_handle_is_valid (handle_repo, handle, NULL))
+        g_hash_table_remove (priv->resource_cache,
+            tp_handle_inspect (handle_repo, handle));
+    }
+}
+
+static const gchar *
+manager_pick_resource (YtstChannelManager *self,
+    const gchar *bare_jid,
+    const gchar *target_service)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  GHashTable *services;
+  const gchar *resource;
+  gchar *resource_copy;
+  gchar *feature;
+
+  services = g_hash_table_lookup (priv->resource_cache, bare_jid);
+  if (services != NULL)
+    {
+      resource = g_hash_table_lookup (services, target_service);
+      if (resource != NULL)
+        return resource;
+    }
+
+  feature = g_strdup_printf ("%s#%s", YTST_SERVICE_NS, target_service);
+  resource = gabble_plugin_connection_pick_best_resource_for_caps (
+      priv->connection, bare_jid, gabble_capability_set_predicate_has,
+      feature);
+  g_free (feature);
+
+  if (resource == NULL)
+    return NULL;
+
+  /* By now some contact has caps, so the capabilities-changed signal
+   * can be looked up; see the same dance in YtstStatus. */
+  if (priv->capabilities_changed_id == 0)
+    {
+      priv->capabilities_changed_id = g_signal_add_emission_hook (
+          g_signal_lookup ("capabilities-changed",
+              WOCKY_TYPE_XEP_0115_CAPABILITIES),
+          0, capabilities_changed_cb, self, NULL);
+    }
+
+  if (services == NULL)
+    {
+      services = g_hash_table_new_full (g_str_hash, g_str_equal,
+          g_free, g_free);
+      g_hash_table_insert (priv->resource_cache, g_strdup (bare_jid),
+          services);
+    }
+
+  resource_copy = g_strdup (resource);
+  g_hash_table_insert (services, g_strdup (target_service), resource_copy);
+
+  return resource_copy;
+}
+#endif
+
+static void
+backlog_free (Backlog *backlog)
+{
+  g_slice_free (Backlog, backlog);
+}
+
+static void
+manager_backlog_check_pressure (YtstChannelManager *self,
+    Backlog *backlog,
+    const gchar *service,
+    guint limit)
+{
+  if (limit == 0)
+    return;
+
+  /* Only tell handlers when things get tight and when they've eased
+   * off again, not about every single request. */
+  if (!backlog->saturated && backlog->pending >= limit)
+    backlog->saturated = TRUE;
+  else if (backlog->saturated && backlog->pending <= limit / 2)
+    backlog->saturated = FALSE;
+  else
+    return;
+
+  DEBUG ("backlog for '%s' %s: %u/%u", service,
+      backlog->saturated ? "full" : "draining", backlog->pending, limit);
+
+  g_signal_emit (self, signals[BACKLOG_CHANGED], 0, service,
+      backlog->pending, limit);
+}
+
+static gboolean
+manager_backlog_is_full (YtstChannelManager *self,
+    const gchar *service)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  Backlog *backlog;
+
+  if (priv->backlog_limit > 0 && priv->backlog.pending >= priv->backlog_limit)
+    return TRUE;
+
+  if (priv->service_backlog_limit == 0 || service == NULL)
+    return FALSE;
+
+  backlog = g_hash_table_lookup (priv->service_backlogs, service);
+
+  return backlog != NULL && backlog->pending >= priv->service_backlog_limit;
+}
+
+static void
+manager_backlog_release (YtstChannelManager *self,
+    YtstMessageChannel *channel)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  const gchar *service;
+  Backlog *backlog;
+
+  if (priv->backlog_channels == NULL)
+    return;
+
+  service = g_hash_table_lookup (priv->backlog_channels, channel);
+  if (service == NULL)
+    return;
+
+  priv->backlog.pending--;
+  manager_backlog_check_pressure (self, &priv->backlog, "",
+      priv->backlog_limit);
+
+  backlog = g_hash_table_lookup (priv->service_backlogs, service);
+  if (backlog != NULL)
+    {
+      backlog->pending--;
+      manager_backlog_check_pressure (self, backlog, service,
+          priv->service_backlog_limit);
+
+      if (backlog->pending == 0)
+        g_hash_table_remove (priv->service_backlogs, service);
+    }
+
+  /* frees service */
+  g_hash_table_remove (priv->backlog_channels, channel);
+
+  g_object_notify (G_OBJECT (self), "backlog");
+}
+
+static void
+on_channel_replied (YtstMessageChannel *channel,
+    GParamSpec *pspec,
+    gpointer user_data)
+{
+  manager_backlog_release (YTST_CHANNEL_MANAGER (user_data), channel);
+}
+
+static void
+manager_backlog_add (YtstChannelManager *self,
+    YtstMessageChannel *channel,
+    const gchar *service)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  Backlog *backlog;
+
+  if (service == NULL)
+    service = "";
+
+  g_hash_table_insert (priv->backlog_channels, channel, g_strdup (service));
+  tp_g_signal_connect_object (channel, "notify::replied",
+      G_CALLBACK (on_channel_replied), self, 0);
+
+  priv->backlog.pending++;
+  manager_backlog_check_pressure (self, &priv->backlog, "",
+      priv->backlog_limit);
+
+  if (*service != '\0')
+    {
+      backlog = g_hash_table_lookup (priv->service_backlogs, service);
+      if (backlog == NULL)
+        {
+          backlog = g_slice_new0 (Backlog);
+          g_hash_table_insert (priv->service_backlogs, g_strdup (service),
+              backlog);
+        }
+
+      backlog->pending++;
+      manager_backlog_check_pressure (self, backlog, service,
+          priv->service_backlog_limit);
+    }
+
+  g_object_notify (G_OBJECT (self), "backlog");
+}
+
+static void
+pending_batch_free (PendingBatch *batch)
+{
+  if (batch->timeout_id != 0)
+    g_source_remove (batch->timeout_id);
+
+  g_queue_clear (&batch->channels);
+  g_free (batch->key);
+  g_slice_free (PendingBatch, batch);
+}
+
+/* Announces the channels in @batch, and frees it */
+static void
+manager_flush_batch (YtstChannelManager *self,
+    PendingBatch *batch)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  GHashTable *channels;
+  YtstMessageChannel *channel;
+
+  /* TpExportableChannel -> GSList of request tokens, none for these */
+  channels = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  while ((channel = g_queue_pop_head (&batch->channels)) != NULL)
+    {
+      g_hash_table_remove (priv->batched_channels, channel);
+      g_hash_table_insert (channels, channel, NULL);
+    }
+
+  DEBUG ("announcing %u incoming channels for %s",
+      g_hash_table_size (channels), batch->key);
+  tp_channel_manager_emit_new_channels (self, channels);
+
+  g_hash_table_unref (channels);
+
+  /* frees batch */
+  g_hash_table_remove (priv->pending_batches, batch->key);
+}
+
+static void
+manager_flush_pending_channels (YtstChannelManager *self)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  GHashTableIter iter;
+  gpointer value;
+
+  if (priv->pending_batches == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, priv->pending_batches);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      manager_flush_batch (self, value);
+      g_hash_table_iter_init (&iter, priv->pending_batches);
+    }
+}
+
+static gboolean
+batch_timeout_cb (gpointer user_data)
+{
+  PendingBatch *batch = user_data;
+
+  batch->timeout_id = 0;
+  manager_flush_batch (batch->self, batch);
+
+  return FALSE;
+}
+
+/* Announces @channel, from @handle for @service, straight away, or
+ * holds it back to go with others from them for the same service
+ * if we're batching */
+static void
+manager_announce_incoming_channel (YtstChannelManager *self,
+    YtstMessageChannel *channel,
+    TpHandle handle,
+    const gchar *service)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  PendingBatch *batch;
+  gchar *key;
+
+  if (priv->batch_window == 0)
+    {
+      tp_channel_manager_emit_new_channel (self,
+          TP_EXPORTABLE_CHANNEL (channel), NULL);
+      return;
+    }
+
+  /* Handlers pick up a whole NewChannels at once, so only put
+   * channels in the same one which one handler would want together */
+  key = g_strdup_printf ("%u/%s", handle, service != NULL ? service : "");
+  batch = g_hash_table_lookup (priv->pending_batches, key);
+
+  if (batch == NULL)
+    {
+      batch = g_slice_new0 (PendingBatch);
+      batch->self = self;
+      batch->key = key;
+      g_queue_init (&batch->channels);
+      g_hash_table_insert (priv->pending_batches, key, batch);
+
+      /* The timer isn't pushed back by later channels, so nothing waits
+       * longer than the window before being announced. */
+      batch->timeout_id = g_timeout_add (priv->batch_window,
+          batch_timeout_cb, batch);
+    }
+  else
+    {
+      g_free (key);
+    }
+
+  g_queue_push_tail (&batch->channels, channel);
+  g_hash_table_insert (priv->batched_channels, channel, batch);
+
+  if (g_queue_get_length (&batch->channels) >= priv->batch_size)
+    manager_flush_batch (self, batch);
+}
+
 static void
 on_channel_closed (YtstMessageChannel *channel,
     gpointer user_data)
 {
   YtstChannelManager *self = YTST_CHANNEL_MANAGER (user_data);
   YtstChannelManagerPrivate *priv = self->priv;
+  YtstDirectBus *direct_bus;
+  PendingBatch *batch = NULL;
+
+  manager_backlog_release (self, channel);
 
-  tp_channel_manager_emit_channel_closed_for_object (self,
-    TP_EXPORTABLE_CHANNEL (channel));
+  if (priv->batched_channels != NULL)
+    batch = g_hash_table_lookup (priv->batched_channels, channel);
+
+  if (batch != NULL)
+    {
+      /* never announced, so nobody needs to hear that it's gone */
+      g_queue_remove (&batch->channels, channel);
+      g_hash_table_remove (priv->batched_channels, channel);
+
+      if (g_queue_is_empty (&batch->channels))
+        g_hash_table_remove (priv->pending_batches, batch->key);
+    }
+  else
+    {
+      tp_channel_manager_emit_channel_closed_for_object (self,
+        TP_EXPORTABLE_CHANNEL (channel));
+    }
+
+  direct_bus = ytst_direct_bus_dup_for_connection (
+      TP_BASE_CONNECTION (priv->connection), FALSE);
+  if (direct_bus != NULL)
+    {
+      ytst_direct_bus_unexport (direct_bus,
+          tp_base_channel_get_object_path (TP_BASE_CHANNEL (channel)));
+      g_object_unref (direct_bus);
+    }
 
   if (priv->channels != NULL)
     {
       DEBUG ("Removing channel %p", channel);
       g_queue_remove (priv->channels, channel);
     }
+
+  /* closed by its handler while waiting for its turn to be torn down */
+  if (priv->closing != NULL && g_queue_remove (priv->closing, channel))
+    g_object_unref (channel);
 }
 
 static void
@@ -104,12 +811,23 @@ manager_take_ownership_of_channel (YtstChannelManager *self,
     YtstMessageChannel *channel)
 {
   YtstChannelManagerPrivate *priv = self->priv;
+  YtstDirectBus *direct_bus;
 
   /* Takes ownership of channel */
   g_assert (g_queue_index (priv->channels, channel) == -1);
   g_queue_push_tail (priv->channels, channel);
 
   g_signal_connect (channel, "closed", G_CALLBACK (on_channel_closed), self);
+
+  direct_bus = ytst_direct_bus_dup_for_connection (
+      TP_BASE_CONNECTION (priv->connection), FALSE);
+  if (direct_bus != NULL)
+    {
+      ytst_direct_bus_export (direct_bus,
+          tp_base_channel_get_object_path (TP_BASE_CHANNEL (channel)),
+          G_OBJECT (channel));
+      g_object_unref (direct_bus);
+    }
 }
 
 static gboolean
@@ -120,18 +838,19 @@ message_stanza_callback (WockyPorter *porter,
   YtstChannelManager *self = YTST_CHANNEL_MANAGER (user_data);
   YtstChannelManagerPrivate *priv = self->priv;
 
-  WockyNode *top;
+  WockyNode *top, *message;
   WockyStanzaSubType sub_type = WOCKY_STANZA_SUB_TYPE_NONE;
 
-  TpBaseConnection *base_conn = TP_BASE_CONNECTION (priv->connection);
-  TpHandleRepoIface *handle_repo = tp_base_connection_get_handles (base_conn,
-       TP_HANDLE_TYPE_CONTACT);
   YtstMessageChannel *channel;
   TpHandle handle;
 #ifdef SALUT
   WockyContact *contact = wocky_stanza_get_from_contact (stanza);
+#else
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION (priv->connection);
+  TpHandleRepoIface *handle_repo = tp_base_connection_get_handles (base_conn,
+       TP_HANDLE_TYPE_CONTACT);
+  const gchar *jid;
 #endif
-  gchar *jid;
 
   /* needs to be type get or set */
   wocky_stanza_get_type_info (stanza, NULL, &sub_type);
@@ -145,15 +864,50 @@ message_stanza_callback (WockyPorter *porter,
     return FALSE;
 
 #ifdef SALUT
-  jid = wocky_contact_dup_jid (WOCKY_CONTACT (contact));
+  if (!WOCKY_IS_LL_CONTACT (contact))
+    return FALSE;
+
+  handle = manager_lookup_contact_handle (self, WOCKY_LL_CONTACT (contact));
 #else
-  jid = g_strdup (wocky_stanza_get_from (stanza));
-#endif
+  jid = wocky_stanza_get_from (stanza);
   handle = tp_handle_lookup (handle_repo, jid, NULL, NULL);
+#endif
   if (handle == 0)
+    return FALSE;
+
+  if (!manager_admit_request (self, handle))
     {
-      g_free (jid);
-      return FALSE;
+      DEBUG ("Too many requests from handle %u, refusing", handle);
+      /* resource-constraint is a wait type error */
+      wocky_porter_send_iq_error (porter, stanza,
+          WOCKY_XMPP_ERROR_RESOURCE_CONSTRAINT,
+          "too many requests; try again later");
+      return TRUE;
+    }
+
+  /* Don't bother the channel dispatcher with requests nobody is going
+   * to pick up; this is what the channel would reply when closed. */
+  message = wocky_node_get_first_child (top);
+  if (!ytst_caps_manager_handles_service (priv->caps_manager,
+          wocky_node_get_attribute (message, "to-service")))
+    {
+      DEBUG ("No handler for service %s, refusing",
+          wocky_node_get_attribute (message, "to-service"));
+      wocky_porter_send_iq_error (porter, stanza,
+          WOCKY_XMPP_ERROR_ITEM_NOT_FOUND,
+          "no handler found for the target service");
+      return TRUE;
+    }
+
+  if (manager_backlog_is_full (self,
+          wocky_node_get_attribute (message, "to-service")))
+    {
+      DEBUG ("Too many unreplied requests for service %s, refusing",
+          wocky_node_get_attribute (message, "to-service"));
+      wocky_porter_send_iq_error (porter, stanza,
+          WOCKY_XMPP_ERROR_RESOURCE_CONSTRAINT,
+          "too many requests waiting for a reply; try again later");
+      return TRUE;
     }
 
   channel = ytst_message_channel_new (priv->connection,
@@ -164,28 +918,94 @@ message_stanza_callback (WockyPorter *porter,
 #endif
       stanza, handle, handle, FALSE);
   manager_take_ownership_of_channel (self, channel);
-  tp_channel_manager_emit_new_channel (self, TP_EXPORTABLE_CHANNEL (channel),
-      NULL);
-
-  g_free (jid);
+  manager_backlog_add (self, channel,
+      wocky_node_get_attribute (message, "to-service"));
+  manager_announce_incoming_channel (self, channel, handle,
+      wocky_node_get_attribute (message, "to-service"));
 
   return TRUE;
 }
 
+/* Closes channels queued for teardown until @budget microseconds have
+ * passed, or all of them if @budget is negative. Returns %TRUE if there
+ * are any left. */
+static gboolean
+manager_close_some (YtstChannelManager *self,
+    gint64 budget)
+{
+  YtstChannelManagerPrivate *priv = self->priv;
+  YtstMessageChannel *channel;
+  gint64 deadline = g_get_monotonic_time () + budget;
+
+  while ((channel = g_queue_pop_head (priv->closing)) != NULL)
+    {
+      tp_base_channel_close (TP_BASE_CHANNEL (channel));
+      g_object_unref (channel);
+
+      if (budget >= 0 && g_get_monotonic_time () >= deadline)
+        break;
+    }
+
+  return !g_queue_is_empty (priv->closing);
+}
+
+static gboolean
+teardown_idle_cb (gpointer user_data)
+{
+  YtstChannelManager *self = YTST_CHANNEL_MANAGER (user_data);
+  YtstChannelManagerPrivate *priv = self->priv;
+
+  if (manager_close_some (self, TEARDOWN_BUDGET))
+    return TRUE;
+
+  DEBUG ("all channels closed");
+  priv->teardown_id = 0;
+  return FALSE;
+}
+
 static void
 manager_close_all (YtstChannelManager *self)
 {
   YtstChannelManagerPrivate *priv = self->priv;
 
+  /* Make sure handlers have heard of every channel before it closes */
+  manager_flush_pending_channels (self);
+
+  /* There can be thousands of these, so close them a few at a time
+   * rather than blocking everything else until they're all done. */
   if (priv->channels != NULL)
     {
-      DEBUG ("closing channels");
-      g_queue_foreach (priv->channels, (GFunc) tp_base_channel_close, NULL);
-      g_queue_foreach (priv->channels, (GFunc) g_object_unref, NULL);
+      DEBUG ("closing %u channels", g_queue_get_length (priv->channels));
+
+      while (!g_queue_is_empty (priv->channels))
+        g_queue_push_tail (priv->closing, g_queue_pop_head (priv->channels));
+
       g_queue_free (priv->channels);
       priv->channels = NULL;
+
+      if (priv->teardown_id == 0 && !g_queue_is_empty (priv->closing))
+        priv->teardown_id = g_idle_add (teardown_idle_cb, self);
+    }
+
+  g_hash_table_remove_all (priv->buckets);
+
+  if (priv->bucket_sweep_id != 0)
+    {
+      g_source_remove (priv->bucket_sweep_id);
+      priv->bucket_sweep_id = 0;
     }
 
+  g_hash_table_remove_all (priv->backlog_channels);
+  g_hash_table_remove_all (priv->service_backlogs);
+  priv->backlog.pending = 0;
+  priv->backlog.saturated = FALSE;
+
+#ifdef SALUT
+  contact_cache_clear (self);
+#else
+  g_hash_table_remove_all (priv->resource_cache);
+#endif
+
   if (priv->status_changed_id != 0UL)
     {
       g_signal_handler_disconnect (priv->connection, priv->status_changed_id);
@@ -213,6 +1033,27 @@ ytst_channel_manager_init (YtstChannelManager *self)
   YtstChannelManagerPrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
       YTST_TYPE_CHANNEL_MANAGER, YtstChannelManagerPrivate);
   self->priv = priv;
+
+  priv->buckets = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) token_bucket_free);
+
+  priv->pending_batches = g_hash_table_new_full (g_str_hash, g_str_equal,
+      NULL, (GDestroyNotify) pending_batch_free);
+  priv->batched_channels = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  priv->service_backlogs = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) backlog_free);
+  priv->backlog_channels = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, g_free);
+
+#ifdef SALUT
+  priv->contact_cache = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) contact_cache_entry_free);
+  priv->handle_cache = g_hash_table_new (g_direct_hash, g_direct_equal);
+#else
+  priv->resource_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+#endif
 }
 
 static void
@@ -229,6 +1070,33 @@ ytst_channel_manager_get_property (GObject *object,
       case PROP_CONNECTION:
         g_value_set_object (value, priv->connection);
         break;
+      case PROP_CAPS_MANAGER:
+        g_value_set_object (value, priv->caps_manager);
+        break;
+      case PROP_RATE_LIMIT_BURST:
+        g_value_set_uint (value, priv->rate_limit_burst);
+        break;
+      case PROP_RATE_LIMIT_RATE:
+        g_value_set_uint (value, priv->rate_limit_rate);
+        break;
+      case PROP_DROPPED_REQUESTS:
+        g_value_set_uint (value, priv->dropped_requests);
+        break;
+      case PROP_BATCH_WINDOW:
+        g_value_set_uint (value, priv->batch_window);
+        break;
+      case PROP_BATCH_SIZE:
+        g_value_set_uint (value, priv->batch_size);
+        break;
+      case PROP_BACKLOG_LIMIT:
+        g_value_set_uint (value, priv->backlog_limit);
+        break;
+      case PROP_SERVICE_BACKLOG_LIMIT:
+        g_value_set_uint (value, priv->service_backlog_limit);
+        break;
+      case PROP_BACKLOG:
+        g_value_set_uint (value, priv->backlog.pending);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -249,6 +1117,30 @@ ytst_channel_manager_set_property (GObject *object,
       case PROP_CONNECTION:
         priv->connection = g_value_get_object (value);
         break;
+      case PROP_CAPS_MANAGER:
+        priv->caps_manager = g_value_dup_object (value);
+        break;
+      case PROP_RATE_LIMIT_BURST:
+        priv->rate_limit_burst = g_value_get_uint (value);
+        break;
+      case PROP_RATE_LIMIT_RATE:
+        priv->rate_limit_rate = g_value_get_uint (value);
+        break;
+      case PROP_BATCH_WINDOW:
+        priv->batch_window = g_value_get_uint (value);
+        /* don't sit on channels we've stopped batching */
+        if (priv->batch_window == 0)
+          manager_flush_pending_channels (self);
+        break;
+      case PROP_BATCH_SIZE:
+        priv->batch_size = g_value_get_uint (value);
+        break;
+      case PROP_BACKLOG_LIMIT:
+        priv->backlog_limit = g_value_get_uint (value);
+        break;
+      case PROP_SERVICE_BACKLOG_LIMIT:
+        priv->service_backlog_limit = g_value_get_uint (value);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -286,6 +1178,7 @@ ytst_channel_manager_constructed (GObject *object)
 #endif
 
   priv->channels = g_queue_new ();
+  priv->closing = g_queue_new ();
 
 #ifdef SALUT
   session = salut_plugin_connection_get_session (priv->connection);
@@ -296,11 +1189,17 @@ ytst_channel_manager_constructed (GObject *object)
   tp_g_signal_connect_object (priv->connection, "porter-available",
       G_CALLBACK (ytst_channel_manager_porter_available_cb),
       self, 0);
+
+  if (TP_IS_SVC_CONNECTION_INTERFACE_SIMPLE_PRESENCE (priv->connection))
+    tp_g_signal_connect_object (priv->connection, "presences-changed",
+        G_CALLBACK (presences_changed_cb), self, 0);
 #endif
 
   priv->status_changed_id = g_signal_connect (priv->connection,
       "status-changed", (GCallback) on_connection_status_changed, self);
 
+  ytst_config_apply (object, "Requests");
+
   if (G_OBJECT_CLASS (ytst_channel_manager_parent_class)->constructed)
     G_OBJECT_CLASS (ytst_channel_manager_parent_class)->constructed (object);
 }
@@ -329,6 +1228,40 @@ ytst_channel_manager_dispose (GObject *object)
 
   manager_close_all (self);
 
+  /* Whatever is left has to be closed before we go away */
+  if (priv->teardown_id != 0)
+    {
+      g_source_remove (priv->teardown_id);
+      priv->teardown_id = 0;
+    }
+
+  manager_close_some (self, -1);
+  tp_clear_pointer (&priv->closing, g_queue_free);
+
+  tp_clear_pointer (&priv->pending_batches, g_hash_table_unref);
+  tp_clear_pointer (&priv->batched_channels, g_hash_table_unref);
+  tp_clear_pointer (&priv->backlog_channels, g_hash_table_unref);
+  tp_clear_pointer (&priv->service_backlogs, g_hash_table_unref);
+
+  tp_clear_object (&priv->caps_manager);
+  tp_clear_pointer (&priv->buckets, g_hash_table_unref);
+
+#ifdef SALUT
+  tp_clear_pointer (&priv->contact_cache, g_hash_table_unref);
+  tp_clear_pointer (&priv->handle_cache, g_hash_table_unref);
+#else
+  if (priv->capabilities_changed_id != 0)
+    {
+      g_signal_remove_emission_hook (
+          g_signal_lookup ("capabilities-changed",
+              WOCKY_TYPE_XEP_0115_CAPABILITIES),
+          priv->capabilities_changed_id);
+      priv->capabilities_changed_id = 0;
+    }
+
+  tp_clear_pointer (&priv->resource_cache, g_hash_table_unref);
+#endif
+
   if (G_OBJECT_CLASS (ytst_channel_manager_parent_class)->dispose)
     G_OBJECT_CLASS (ytst_channel_manager_parent_class)->dispose (object);
 }
@@ -354,6 +1287,111 @@ ytst_channel_manager_class_init (YtstChannelManagerClass *klass)
       G_PARAM_CONSTRUCT_ONLY |
       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_CONNECTION, param_spec);
+
+  param_spec = g_param_spec_object (
+      "caps-manager",
+      "YtstCapsManager object",
+      "Caps manager knowing which services have local handlers.",
+      YTST_TYPE_CAPS_MANAGER,
+      G_PARAM_CONSTRUCT_ONLY |
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_CAPS_MANAGER,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "rate-limit-burst",
+      "Rate limit burst",
+      "Number of incoming requests a contact may send back to back, "
+      "or 0 to disable rate limiting",
+      0, G_MAXUINT, DEFAULT_RATE_LIMIT_BURST,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_RATE_LIMIT_BURST,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "rate-limit-rate",
+      "Rate limit rate",
+      "Number of incoming requests per second a contact is allowed once "
+      "its burst is used up",
+      0, G_MAXUINT, DEFAULT_RATE_LIMIT_RATE,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_RATE_LIMIT_RATE,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "dropped-requests",
+      "Dropped requests",
+      "Number of incoming requests refused by the rate limiter; the Status "
+      "sidecar tells handlers when it goes up",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DROPPED_REQUESTS,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "batch-window",
+      "Batch window",
+      "Milliseconds to hold incoming channels so they can be announced "
+      "together in one NewChannels signal, or 0 to announce each one "
+      "straight away",
+      0, G_MAXUINT, 0,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_BATCH_WINDOW,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "batch-size",
+      "Batch size",
+      "Most incoming channels from one contact for one service "
+      "announced in one NewChannels signal",
+      1, G_MAXUINT, DEFAULT_BATCH_SIZE,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_BATCH_SIZE,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "backlog-limit",
+      "Backlog limit",
+      "Most unreplied incoming requests held at once before new ones are "
+      "refused, or 0 for no limit",
+      0, G_MAXUINT, DEFAULT_BACKLOG_LIMIT,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_BACKLOG_LIMIT,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "service-backlog-limit",
+      "Per-service backlog limit",
+      "Most unreplied incoming requests held at once for any one "
+      "TargetService, or 0 for no limit",
+      0, G_MAXUINT, DEFAULT_SERVICE_BACKLOG_LIMIT,
+      G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_SERVICE_BACKLOG_LIMIT,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "backlog",
+      "Backlog",
+      "Number of incoming requests not replied to yet",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_BACKLOG,
+      param_spec);
+
+  /**
+   * YtstChannelManager::backlog-changed:
+   * @service: the TargetService concerned, or "" for all of them
+   * @pending: number of unreplied requests for @service
+   * @limit: the limit that applies to @service
+   *
+   * Emitted when a backlog fills up, and again once it has drained to
+   * half of its limit.
+   */
+  signals[BACKLOG_CHANGED] = g_signal_new ("backlog-changed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL, NULL,
+      G_TYPE_NONE, 3, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_UINT);
 }
 
 typedef struct
@@ -380,7 +1418,12 @@ ytst_channel_manager_foreach_channel (TpChannelManager *iface,
   YtstChannelManagerPrivate *priv = self->priv;
   foreach_closure f = { func, user_data };
 
-  g_queue_foreach (priv->channels, run_foreach_one, &f);
+  if (priv->channels != NULL)
+    g_queue_foreach (priv->channels, run_foreach_one, &f);
+
+  /* still open until the teardown gets round to them */
+  if (priv->closing != NULL)
+    g_queue_foreach (priv->closing, run_foreach_one, &f);
 }
 
 static const gchar * const channel_fixed_properties[] = {
@@ -440,12 +1483,10 @@ ytst_channel_manager_create_channel (TpChannelManager *manager,
   GError *error = NULL;
   const gchar *name;
 #ifdef SALUT
-  WockySession *session;
-  WockyContactFactory *factory;
   WockyLLContact *contact;
 #else
   gchar *jid, *full_jid;
-  gchar *service;
+  const gchar *target_service;
   const gchar *resource;
 #endif
   WockyStanza *request;
@@ -476,9 +1517,7 @@ ytst_channel_manager_create_channel (TpChannelManager *manager,
   DEBUG ("Requested channel for handle: %u (%s)", handle, name);
 
 #ifdef SALUT
-  session = salut_plugin_connection_get_session (priv->connection);
-  factory = wocky_session_get_contact_factory (session);
-  contact = wocky_contact_factory_lookup_ll_contact (factory, name);
+  contact = manager_lookup_handle_contact (self, handle);
   if (contact == NULL)
     {
       g_set_error (&error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
@@ -486,21 +1525,16 @@ ytst_channel_manager_create_channel (TpChannelManager *manager,
       goto error;
     }
 #else
-  if (tp_asv_get_string (request_properties,
-          TP_YTS_IFACE_CHANNEL ".TargetService") == NULL)
+  target_service = tp_asv_get_string (request_properties,
+      TP_YTS_IFACE_CHANNEL ".TargetService");
+  if (target_service == NULL)
     {
       g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
           "The TargetService property must be set.");
       goto error;
     }
 
-  service = g_strdup_printf ("%s#%s", YTST_SERVICE_NS,
-      tp_asv_get_string (request_properties,
-          TP_YTS_IFACE_CHANNEL ".TargetService"));
-
-  resource = gabble_plugin_connection_pick_best_resource_for_caps (priv->connection,
-      name, gabble_capability_set_predicate_has, service);
-  g_free (service);
+  resource = manager_pick_resource (self, name, target_service);
 
   if (resource == NULL)
     {
@@ -594,9 +1628,31 @@ ytst_caps_channel_manager_iface_init (gpointer g_iface,
 
 /* public functions */
 YtstChannelManager *
-ytst_channel_manager_new (TpBaseConnection *connection)
+ytst_channel_manager_new (TpBaseConnection *connection,
+    YtstCapsManager *caps_manager)
 {
   return g_object_new (YTST_TYPE_CHANNEL_MANAGER,
       "connection", connection,
+      "caps-manager", caps_manager,
       NULL);
 }
+
+/* Makes the channels which are already open reachable on @direct_bus
+ * too; the ones opened after it was set up are added as they come */
+void
+ytst_channel_manager_export_channels (YtstChannelManager *self,
+    YtstDirectBus *direct_bus)
+{
+  GList *l;
+
+  g_return_if_fail (YTST_IS_CHANNEL_MANAGER (self));
+  g_return_if_fail (YTST_IS_DIRECT_BUS (direct_bus));
+
+  if (self->priv->channels == NULL)
+    return;
+
+  for (l = self->priv->channels->head; l != NULL; l = l->next)
+    ytst_direct_bus_export (direct_bus,
+        tp_base_channel_get_object_path (TP_BASE_CHANNEL (l->data)),
+        G_OBJECT (l->data));
+}
@@ -25,6 +25,9 @@
 
 #include <telepathy-glib/base-connection.h>
 
+#include "caps-manager.h"
+#include "direct-bus.h"
+
 G_BEGIN_DECLS
 
 typedef struct _YtstChannelManager YtstChannelManager;
@@ -59,6 +62,10 @@ GType ytst_channel_manager_get_type (void);
   (G_TYPE_INSTANCE_GET_CLASS ((obj), YTST_TYPE_CHANNEL_MANAGER, \
                               YtstChannelManagerClass))
 
-YtstChannelManager * ytst_channel_manager_new (TpBaseConnection *connection);
+YtstChannelManager * ytst_channel_manager_new (TpBaseConnection *connection,
+    YtstCapsManager *caps_manager);
+
+void ytst_channel_manager_export_channels (YtstChannelManager *self,
+    YtstDirectBus *direct_bus);
 
 #endif /* #ifndef __YTST_CHANNEL_MANAGER_H__*/
@@ -0,0 +1,385 @@
+/*
+ * direct-bus.c - Source for YtstDirectBus
+ * Copyright (C) 2011 Intel, Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include "direct-bus.h"
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include <telepathy-glib/enums.h>
+#include <telepathy-glib/util.h>
+
+#define DEBUG(msg, ...) \
+  g_debug ("%s: " msg, G_STRFUNC, ##__VA_ARGS__)
+
+G_DEFINE_TYPE (YtstDirectBus, ytst_direct_bus, G_TYPE_OBJECT);
+
+/* private structure */
+struct _YtstDirectBusPrivate
+{
+  DBusServer *server;
+  gchar *address;
+
+  /* DBusConnection* */
+  GSList *peers;
+
+  /* gchar *object_path -> DirectExport* */
+  GHashTable *exports;
+
+  gboolean dispose_has_run;
+};
+
+typedef struct
+{
+  YtstDirectBus *self;
+  gchar *object_path;
+  GObject *object;
+} DirectExport;
+
+static GQuark
+direct_bus_quark (void)
+{
+  static GQuark quark = 0;
+
+  if (G_UNLIKELY (quark == 0))
+    quark = g_quark_from_static_string ("ytst-direct-bus");
+
+  return quark;
+}
+
+/* -----------------------------------------------------------------------------
+ * INTERNAL
+ */
+
+static void
+direct_export_object_gone (gpointer data,
+    GObject *where_the_object_was)
+{
+  DirectExport *export = data;
+
+  /* dbus-glib drops its own registrations when the object goes away */
+  export->object = NULL;
+  g_hash_table_remove (export->self->priv->exports, export->object_path);
+}
+
+static void
+direct_export_free (DirectExport *export)
+{
+  YtstDirectBusPrivate *priv = export->self->priv;
+  GSList *l;
+
+  if (export->object != NULL)
+    {
+      for (l = priv->peers; l != NULL; l = l->next)
+        dbus_g_connection_unregister_g_object (
+            dbus_connection_get_g_connection (l->data), export->object);
+
+      g_object_weak_unref (export->object, direct_export_object_gone,
+          export);
+    }
+
+  g_free (export->object_path);
+  g_slice_free (DirectExport, export);
+}
+
+static void
+register_exports_on_peer (YtstDirectBus *self,
+    DBusConnection *peer)
+{
+  YtstDirectBusPrivate *priv = self->priv;
+  DBusGConnection *connection = dbus_connection_get_g_connection (peer);
+  GHashTableIter iter;
+  DirectExport *export;
+
+  g_hash_table_iter_init (&iter, priv->exports);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &export))
+    dbus_g_connection_register_g_object (connection, export->object_path,
+        export->object);
+}
+
+static DBusHandlerResult
+peer_filter_cb (DBusConnection *peer,
+    DBusMessage *message,
+    void *user_data)
+{
+  YtstDirectBus *self = YTST_DIRECT_BUS (user_data);
+  YtstDirectBusPrivate *priv = self->priv;
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  DEBUG ("direct peer %p went away", peer);
+
+  priv->peers = g_slist_remove (priv->peers, peer);
+  dbus_connection_remove_filter (peer, peer_filter_cb, self);
+  dbus_connection_unref (peer);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+new_connection_cb (DBusServer *server,
+    DBusConnection *peer,
+    void *user_data)
+{
+  YtstDirectBus *self = YTST_DIRECT_BUS (user_data);
+  YtstDirectBusPrivate *priv = self->priv;
+
+  /* libdbus only lets peers running as the same user this far */
+  DEBUG ("new direct peer %p", peer);
+
+  dbus_connection_ref (peer);
+  dbus_connection_set_exit_on_disconnect (peer, FALSE);
+  dbus_connection_setup_with_g_main (peer, NULL);
+  dbus_connection_add_filter (peer, peer_filter_cb, self, NULL);
+
+  priv->peers = g_slist_prepend (priv->peers, peer);
+
+  register_exports_on_peer (self, peer);
+}
+
+static void
+close_peers (YtstDirectBus *self)
+{
+  YtstDirectBusPrivate *priv = self->priv;
+  GSList *peers, *l;
+
+  peers = priv->peers;
+  priv->peers = NULL;
+
+  for (l = peers; l != NULL; l = l->next)
+    {
+      dbus_connection_remove_filter (l->data, peer_filter_cb, self);
+      dbus_connection_close (l->data);
+      dbus_connection_unref (l->data);
+    }
+
+  g_slist_free (peers);
+}
+
+static void
+shut_down (YtstDirectBus *self)
+{
+  YtstDirectBusPrivate *priv = self->priv;
+
+  if (priv->server == NULL)
+    return;
+
+  DEBUG ("shutting down direct bus at %s", priv->address);
+
+  g_hash_table_remove_all (priv->exports);
+  close_peers (self);
+
+  dbus_server_disconnect (priv->server);
+  dbus_server_unref (priv->server);
+  priv->server = NULL;
+}
+
+static void
+connection_status_changed_cb (TpBaseConnection *connection,
+    guint status,
+    guint reason,
+    YtstDirectBus *self)
+{
+  if (status == TP_CONNECTION_STATUS_DISCONNECTED)
+    shut_down (self);
+}
+
+static gboolean
+direct_bus_listen (YtstDirectBus *self)
+{
+  YtstDirectBusPrivate *priv = self->priv;
+  DBusError error;
+  gchar *listen_address;
+
+  dbus_error_init (&error);
+
+  listen_address = g_strdup_printf ("unix:tmpdir=%s", g_get_tmp_dir ());
+  priv->server = dbus_server_listen (listen_address, &error);
+  g_free (listen_address);
+
+  if (priv->server == NULL)
+    {
+      DEBUG ("couldn't listen for direct peers: %s", error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  dbus_server_setup_with_g_main (priv->server, NULL);
+  dbus_server_set_new_connection_function (priv->server,
+      new_connection_cb, self, NULL);
+
+  priv->address = dbus_server_get_address (priv->server);
+
+  DEBUG ("listening for direct peers at %s", priv->address);
+
+  return TRUE;
+}
+
+/* -----------------------------------------------------------------------------
+ * OBJECT
+ */
+
+static void
+ytst_direct_bus_init (YtstDirectBus *self)
+{
+  YtstDirectBusPrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      YTST_TYPE_DIRECT_BUS, YtstDirectBusPrivate);
+  self->priv = priv;
+
+  priv->exports = g_hash_table_new_full (g_str_hash, g_str_equal,
+      NULL, (GDestroyNotify) direct_export_free);
+}
+
+static void
+ytst_direct_bus_dispose (GObject *object)
+{
+  YtstDirectBus *self = YTST_DIRECT_BUS (object);
+  YtstDirectBusPrivate *priv = self->priv;
+
+  if (priv->dispose_has_run)
+    return;
+
+  priv->dispose_has_run = TRUE;
+
+  shut_down (self);
+
+  if (G_OBJECT_CLASS (ytst_direct_bus_parent_class)->dispose)
+    G_OBJECT_CLASS (ytst_direct_bus_parent_class)->dispose (object);
+}
+
+static void
+ytst_direct_bus_finalize (GObject *object)
+{
+  YtstDirectBus *self = YTST_DIRECT_BUS (object);
+  YtstDirectBusPrivate *priv = self->priv;
+
+  tp_clear_pointer (&priv->exports, g_hash_table_unref);
+
+  /* allocated by libdbus */
+  if (priv->address != NULL)
+    dbus_free (priv->address);
+
+  G_OBJECT_CLASS (ytst_direct_bus_parent_class)->finalize (object);
+}
+
+static void
+ytst_direct_bus_class_init (YtstDirectBusClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  g_type_class_add_private (klass, sizeof (YtstDirectBusPrivate));
+
+  object_class->dispose = ytst_direct_bus_dispose;
+  object_class->finalize = ytst_direct_bus_finalize;
+}
+
+/* -----------------------------------------------------------------------------
+ * PUBLIC METHODS
+ */
+
+/*
+ * Returns the direct bus shared by everything on @connection. If there
+ * isn't one yet, it's set up if @create is %TRUE; otherwise, or if it
+ * can't be set up, this returns %NULL.
+ */
+YtstDirectBus *
+ytst_direct_bus_dup_for_connection (TpBaseConnection *connection,
+    gboolean create)
+{
+  YtstDirectBus *self;
+
+  g_return_val_if_fail (TP_IS_BASE_CONNECTION (connection), NULL);
+
+  self = g_object_get_qdata (G_OBJECT (connection), direct_bus_quark ());
+  if (self != NULL)
+    return g_object_ref (self);
+
+  if (!create)
+    return NULL;
+
+  self = g_object_new (YTST_TYPE_DIRECT_BUS, NULL);
+  if (!direct_bus_listen (self))
+    {
+      g_object_unref (self);
+      return NULL;
+    }
+
+  g_signal_connect_object (connection, "status-changed",
+      G_CALLBACK (connection_status_changed_cb), self, 0);
+
+  /* the connection keeps it alive for as long as it's around */
+  g_object_set_qdata_full (G_OBJECT (connection), direct_bus_quark (),
+      self, g_object_unref);
+
+  return g_object_ref (self);
+}
+
+const gchar *
+ytst_direct_bus_get_address (YtstDirectBus *self)
+{
+  g_return_val_if_fail (YTST_IS_DIRECT_BUS (self), NULL);
+
+  return self->priv->address;
+}
+
+void
+ytst_direct_bus_export (YtstDirectBus *self,
+    const gchar *object_path,
+    GObject *object)
+{
+  YtstDirectBusPrivate *priv;
+  DirectExport *export;
+  GSList *l;
+
+  g_return_if_fail (YTST_IS_DIRECT_BUS (self));
+  g_return_if_fail (g_variant_is_object_path (object_path));
+  g_return_if_fail (G_IS_OBJECT (object));
+
+  priv = self->priv;
+
+  if (priv->server == NULL)
+    return;
+
+  export = g_slice_new0 (DirectExport);
+  export->self = self;
+  export->object_path = g_strdup (object_path);
+  export->object = object;
+  g_object_weak_ref (object, direct_export_object_gone, export);
+
+  /* replaces (and unregisters) anything already at this path */
+  g_hash_table_replace (priv->exports, export->object_path, export);
+
+  for (l = priv->peers; l != NULL; l = l->next)
+    dbus_g_connection_register_g_object (
+        dbus_connection_get_g_connection (l->data), object_path, object);
+}
+
+void
+ytst_direct_bus_unexport (YtstDirectBus *self,
+    const gchar *object_path)
+{
+  g_return_if_fail (YTST_IS_DIRECT_BUS (self));
+  g_return_if_fail (object_path != NULL);
+
+  g_hash_table_remove (self->priv->exports, object_path);
+}
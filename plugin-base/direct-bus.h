@@ -0,0 +1,75 @@
+/*
+ * direct-bus.h - Header for YtstDirectBus
+ * Copyright (C) 2011 Intel, Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __YTST_DIRECT_BUS_H__
+#define __YTST_DIRECT_BUS_H__
+
+#include <glib-object.h>
+
+#include <telepathy-glib/base-connection.h>
+
+G_BEGIN_DECLS
+
+typedef struct _YtstDirectBus YtstDirectBus;
+typedef struct _YtstDirectBusClass YtstDirectBusClass;
+typedef struct _YtstDirectBusPrivate YtstDirectBusPrivate;
+
+struct _YtstDirectBusClass {
+  GObjectClass parent_class;
+};
+
+struct _YtstDirectBus {
+  GObject parent;
+  YtstDirectBusPrivate *priv;
+};
+
+GType ytst_direct_bus_get_type (void);
+
+/* TYPE MACROS */
+#define YTST_TYPE_DIRECT_BUS \
+  (ytst_direct_bus_get_type ())
+#define YTST_DIRECT_BUS(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), YTST_TYPE_DIRECT_BUS, YtstDirectBus))
+#define YTST_DIRECT_BUS_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass), YTST_TYPE_DIRECT_BUS, \
+                           YtstDirectBusClass))
+#define YTST_IS_DIRECT_BUS(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), YTST_TYPE_DIRECT_BUS))
+#define YTST_IS_DIRECT_BUS_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass), YTST_TYPE_DIRECT_BUS))
+#define YTST_DIRECT_BUS_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), YTST_TYPE_DIRECT_BUS, \
+                              YtstDirectBusClass))
+
+YtstDirectBus * ytst_direct_bus_dup_for_connection (
+    TpBaseConnection *connection,
+    gboolean create);
+
+const gchar * ytst_direct_bus_get_address (YtstDirectBus *self);
+
+void ytst_direct_bus_export (YtstDirectBus *self,
+    const gchar *object_path,
+    GObject *object);
+
+void ytst_direct_bus_unexport (YtstDirectBus *self,
+    const gchar *object_path);
+
+G_END_DECLS
+
+#endif /* #ifndef __YTST_DIRECT_BUS_H__*/
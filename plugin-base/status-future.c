@@ -0,0 +1,495 @@
+/*
+ * status-future.c - Source for YtstSvcStatusFuture
+ * Copyright (C) 2011 Intel, Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include "status-future.h"
+
+#include <dbus/dbus-glib.h>
+
+#include <telepathy-glib/dbus.h>
+#include <telepathy-glib/dbus-properties-mixin.h>
+
+#include <telepathy-ytstenut-glib/telepathy-ytstenut-glib.h>
+
+struct _YtstSvcStatusFutureClass {
+  GTypeInterface parent_class;
+  ytst_svc_status_future_find_services_by_capability_impl
+      find_services_by_capability_cb;
+  ytst_svc_status_future_find_services_by_type_impl
+      find_services_by_type_cb;
+  ytst_svc_status_future_get_services_for_contact_impl
+      get_services_for_contact_cb;
+  ytst_svc_status_future_get_statuses_for_contact_impl
+      get_statuses_for_contact_cb;
+  ytst_svc_status_future_get_services_page_impl
+      get_services_page_cb;
+  ytst_svc_status_future_get_statuses_page_impl
+      get_statuses_page_cb;
+  ytst_svc_status_future_get_changes_since_impl
+      get_changes_since_cb;
+  ytst_svc_status_future_advertise_statuses_impl
+      advertise_statuses_cb;
+  ytst_svc_status_future_enable_direct_bus_impl
+      enable_direct_bus_cb;
+};
+
+enum
+{
+  SIGNAL_SCAN_COMPLETE,
+  SIGNAL_SERVICES_CHANGED,
+  SIGNAL_STATUSES_CHANGED,
+  SIGNAL_BACKLOG_CHANGED,
+  SIGNAL_DROPPED_REQUESTS_CHANGED,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS] = { 0 };
+
+/* the glue needs to see everything it dispatches to first */
+static void ytst_svc_status_future_find_services_by_capability (
+    YtstSvcStatusFuture *self,
+    const gchar *in_capability,
+    DBusGMethodInvocation *context);
+static void ytst_svc_status_future_find_services_by_type (
+    YtstSvcStatusFuture *self,
+    const gchar *in_type,
+    DBusGMethodInvocation *context);
+static void ytst_svc_status_future_get_services_for_contact (
+    YtstSvcStatusFuture *self,
+    const gchar *in_contact,
+    DBusGMethodInvocation *context);
+static void ytst_svc_status_future_get_statuses_for_contact (
+    YtstSvcStatusFuture *self,
+    const gchar *in_contact,
+    DBusGMethodInvocation *context);
+static void ytst_svc_status_future_get_services_page (
+    YtstSvcStatusFuture *self,
+    const gchar *in_cursor,
+    guint in_limit,
+    DBusGMethodInvocation *context);
+static void ytst_svc_status_future_get_statuses_page (
+    YtstSvcStatusFuture *self,
+    const gchar *in_cursor,
+    guint in_limit,
+    DBusGMethodInvocation *context);
+static void ytst_svc_status_future_get_changes_since (
+    YtstSvcStatusFuture *self,
+    guint64 in_since,
+    DBusGMethodInvocation *context);
+static void ytst_svc_status_future_advertise_statuses (
+    YtstSvcStatusFuture *self,
+    const GPtrArray *in_statuses,
+    DBusGMethodInvocation *context);
+static void ytst_svc_status_future_enable_direct_bus (
+    YtstSvcStatusFuture *self,
+    DBusGMethodInvocation *context);
+
+#include "status-future-glue.h"
+
+GQuark
+ytst_iface_quark_status_future (void)
+{
+  static GQuark quark = 0;
+
+  if (G_UNLIKELY (quark == 0))
+    quark = g_quark_from_static_string (YTST_IFACE_STATUS_FUTURE);
+
+  return quark;
+}
+
+static void
+ytst_svc_status_future_base_init (gpointer klass)
+{
+  static gboolean initialized = FALSE;
+  static TpDBusPropertiesMixinPropInfo properties[] = {
+      { 0, TP_DBUS_PROPERTIES_MIXIN_FLAG_READ, "b", 0, NULL, NULL },
+      { 0, TP_DBUS_PROPERTIES_MIXIN_FLAG_READ, "u", 0, NULL, NULL },
+      { 0, TP_DBUS_PROPERTIES_MIXIN_FLAG_READ, "s", 0, NULL, NULL },
+      { 0, TP_DBUS_PROPERTIES_MIXIN_FLAG_READ, "o", 0, NULL, NULL },
+      { 0, 0, NULL, 0, NULL, NULL }
+  };
+  static TpDBusPropertiesMixinIfaceInfo interface =
+      { 0, properties, NULL, NULL };
+  GType removed_map;
+
+  if (initialized)
+    return;
+
+  initialized = TRUE;
+
+  interface.dbus_interface = YTST_IFACE_QUARK_STATUS_FUTURE;
+
+  properties[0].name = g_quark_from_static_string ("ScanComplete");
+  properties[0].type = G_TYPE_BOOLEAN;
+  properties[1].name = g_quark_from_static_string ("DroppedRequests");
+  properties[1].type = G_TYPE_UINT;
+  properties[2].name = g_quark_from_static_string ("DirectBusAddress");
+  properties[2].type = G_TYPE_STRING;
+  properties[3].name = g_quark_from_static_string ("DirectBusPath");
+  properties[3].type = DBUS_TYPE_G_OBJECT_PATH;
+
+  tp_svc_interface_set_dbus_properties_info (YTST_TYPE_SVC_STATUS_FUTURE,
+      &interface);
+
+  signals[SIGNAL_SCAN_COMPLETE] = g_signal_new ("scan-complete",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 0);
+
+  removed_map = dbus_g_type_get_map ("GHashTable", G_TYPE_STRING,
+      G_TYPE_STRV);
+
+  /* Added, Removed */
+  signals[SIGNAL_SERVICES_CHANGED] = g_signal_new ("services-changed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 2,
+      TP_YTS_HASH_TYPE_CONTACT_SERVICE_MAP, removed_map);
+
+  /* Statuses */
+  signals[SIGNAL_STATUSES_CHANGED] = g_signal_new ("statuses-changed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 1,
+      TP_YTS_HASH_TYPE_CONTACT_CAPABILITY_MAP);
+
+  /* Service, Pending, Limit */
+  signals[SIGNAL_BACKLOG_CHANGED] = g_signal_new ("backlog-changed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 3,
+      G_TYPE_STRING, G_TYPE_UINT, G_TYPE_UINT);
+
+  /* Dropped */
+  signals[SIGNAL_DROPPED_REQUESTS_CHANGED] = g_signal_new (
+      "dropped-requests-changed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 1,
+      G_TYPE_UINT);
+
+  dbus_g_object_type_install_info (ytst_svc_status_future_get_type (),
+      &dbus_glib_ytst_svc_status_future_object_info);
+}
+
+GType
+ytst_svc_status_future_get_type (void)
+{
+  static GType type = 0;
+
+  if (G_UNLIKELY (type == 0))
+    {
+      static const GTypeInfo info = {
+          sizeof (YtstSvcStatusFutureClass),
+          ytst_svc_status_future_base_init, /* base_init */
+          NULL, /* base_finalize */
+          NULL, /* class_init */
+          NULL, /* class_finalize */
+          NULL, /* class_data */
+          0,
+          0, /* n_preallocs */
+          NULL /* instance_init */
+      };
+
+      type = g_type_register_static (G_TYPE_INTERFACE,
+          "YtstSvcStatusFuture", &info, 0);
+    }
+
+  return type;
+}
+
+/* -----------------------------------------------------------------------------
+ * METHODS
+ */
+
+static void
+ytst_svc_status_future_find_services_by_capability (
+    YtstSvcStatusFuture *self,
+    const gchar *in_capability,
+    DBusGMethodInvocation *context)
+{
+  ytst_svc_status_future_find_services_by_capability_impl impl =
+      YTST_SVC_STATUS_FUTURE_GET_CLASS (self)->find_services_by_capability_cb;
+
+  if (impl != NULL)
+    (impl) (self, in_capability, context);
+  else
+    tp_dbus_g_method_return_not_implemented (context);
+}
+
+void
+ytst_svc_status_future_implement_find_services_by_capability (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_find_services_by_capability_impl impl)
+{
+  klass->find_services_by_capability_cb = impl;
+}
+
+static void
+ytst_svc_status_future_find_services_by_type (YtstSvcStatusFuture *self,
+    const gchar *in_type,
+    DBusGMethodInvocation *context)
+{
+  ytst_svc_status_future_find_services_by_type_impl impl =
+      YTST_SVC_STATUS_FUTURE_GET_CLASS (self)->find_services_by_type_cb;
+
+  if (impl != NULL)
+    (impl) (self, in_type, context);
+  else
+    tp_dbus_g_method_return_not_implemented (context);
+}
+
+void
+ytst_svc_status_future_implement_find_services_by_type (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_find_services_by_type_impl impl)
+{
+  klass->find_services_by_type_cb = impl;
+}
+
+static void
+ytst_svc_status_future_get_services_for_contact (YtstSvcStatusFuture *self,
+    const gchar *in_contact,
+    DBusGMethodInvocation *context)
+{
+  ytst_svc_status_future_get_services_for_contact_impl impl =
+      YTST_SVC_STATUS_FUTURE_GET_CLASS (self)->get_services_for_contact_cb;
+
+  if (impl != NULL)
+    (impl) (self, in_contact, context);
+  else
+    tp_dbus_g_method_return_not_implemented (context);
+}
+
+void
+ytst_svc_status_future_implement_get_services_for_contact (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_services_for_contact_impl impl)
+{
+  klass->get_services_for_contact_cb = impl;
+}
+
+static void
+ytst_svc_status_future_get_statuses_for_contact (YtstSvcStatusFuture *self,
+    const gchar *in_contact,
+    DBusGMethodInvocation *context)
+{
+  ytst_svc_status_future_get_statuses_for_contact_impl impl =
+      YTST_SVC_STATUS_FUTURE_GET_CLASS (self)->get_statuses_for_contact_cb;
+
+  if (impl != NULL)
+    (impl) (self, in_contact, context);
+  else
+    tp_dbus_g_method_return_not_implemented (context);
+}
+
+void
+ytst_svc_status_future_implement_get_statuses_for_contact (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_statuses_for_contact_impl impl)
+{
+  klass->get_statuses_for_contact_cb = impl;
+}
+
+static void
+ytst_svc_status_future_get_services_page (YtstSvcStatusFuture *self,
+    const gchar *in_cursor,
+    guint in_limit,
+    DBusGMethodInvocation *context)
+{
+  ytst_svc_status_future_get_services_page_impl impl =
+      YTST_SVC_STATUS_FUTURE_GET_CLASS (self)->get_services_page_cb;
+
+  if (impl != NULL)
+    (impl) (self, in_cursor, in_limit, context);
+  else
+    tp_dbus_g_method_return_not_implemented (context);
+}
+
+void
+ytst_svc_status_future_implement_get_services_page (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_services_page_impl impl)
+{
+  klass->get_services_page_cb = impl;
+}
+
+static void
+ytst_svc_status_future_get_statuses_page (YtstSvcStatusFuture *self,
+    const gchar *in_cursor,
+    guint in_limit,
+    DBusGMethodInvocation *context)
+{
+  ytst_svc_status_future_get_statuses_page_impl impl =
+      YTST_SVC_STATUS_FUTURE_GET_CLASS (self)->get_statuses_page_cb;
+
+  if (impl != NULL)
+    (impl) (self, in_cursor, in_limit, context);
+  else
+    tp_dbus_g_method_return_not_implemented (context);
+}
+
+void
+ytst_svc_status_future_implement_get_statuses_page (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_statuses_page_impl impl)
+{
+  klass->get_statuses_page_cb = impl;
+}
+
+static void
+ytst_svc_status_future_get_changes_since (YtstSvcStatusFuture *self,
+    guint64 in_since,
+    DBusGMethodInvocation *context)
+{
+  ytst_svc_status_future_get_changes_since_impl impl =
+      YTST_SVC_STATUS_FUTURE_GET_CLASS (self)->get_changes_since_cb;
+
+  if (impl != NULL)
+    (impl) (self, in_since, context);
+  else
+    tp_dbus_g_method_return_not_implemented (context);
+}
+
+void
+ytst_svc_status_future_implement_get_changes_since (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_changes_since_impl impl)
+{
+  klass->get_changes_since_cb = impl;
+}
+
+static void
+ytst_svc_status_future_advertise_statuses (YtstSvcStatusFuture *self,
+    const GPtrArray *in_statuses,
+    DBusGMethodInvocation *context)
+{
+  ytst_svc_status_future_advertise_statuses_impl impl =
+      YTST_SVC_STATUS_FUTURE_GET_CLASS (self)->advertise_statuses_cb;
+
+  if (impl != NULL)
+    (impl) (self, in_statuses, context);
+  else
+    tp_dbus_g_method_return_not_implemented (context);
+}
+
+void
+ytst_svc_status_future_implement_advertise_statuses (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_advertise_statuses_impl impl)
+{
+  klass->advertise_statuses_cb = impl;
+}
+
+static void
+ytst_svc_status_future_enable_direct_bus (YtstSvcStatusFuture *self,
+    DBusGMethodInvocation *context)
+{
+  ytst_svc_status_future_enable_direct_bus_impl impl =
+      YTST_SVC_STATUS_FUTURE_GET_CLASS (self)->enable_direct_bus_cb;
+
+  if (impl != NULL)
+    (impl) (self, context);
+  else
+    tp_dbus_g_method_return_not_implemented (context);
+}
+
+void
+ytst_svc_status_future_implement_enable_direct_bus (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_enable_direct_bus_impl impl)
+{
+  klass->enable_direct_bus_cb = impl;
+}
+
+/* -----------------------------------------------------------------------------
+ * SIGNALS
+ */
+
+void
+ytst_svc_status_future_emit_scan_complete (gpointer instance)
+{
+  g_assert (instance != NULL);
+  g_assert (G_TYPE_CHECK_INSTANCE_TYPE (instance,
+          YTST_TYPE_SVC_STATUS_FUTURE));
+
+  g_signal_emit (instance, signals[SIGNAL_SCAN_COMPLETE], 0);
+}
+
+void
+ytst_svc_status_future_emit_services_changed (gpointer instance,
+    GHashTable *added,
+    GHashTable *removed)
+{
+  g_assert (instance != NULL);
+  g_assert (G_TYPE_CHECK_INSTANCE_TYPE (instance,
+          YTST_TYPE_SVC_STATUS_FUTURE));
+
+  g_signal_emit (instance, signals[SIGNAL_SERVICES_CHANGED], 0,
+      added, removed);
+}
+
+void
+ytst_svc_status_future_emit_statuses_changed (gpointer instance,
+    GHashTable *statuses)
+{
+  g_assert (instance != NULL);
+  g_assert (G_TYPE_CHECK_INSTANCE_TYPE (instance,
+          YTST_TYPE_SVC_STATUS_FUTURE));
+
+  g_signal_emit (instance, signals[SIGNAL_STATUSES_CHANGED], 0,
+      statuses);
+}
+
+void
+ytst_svc_status_future_emit_backlog_changed (gpointer instance,
+    const gchar *service,
+    guint pending,
+    guint limit)
+{
+  g_assert (instance != NULL);
+  g_assert (G_TYPE_CHECK_INSTANCE_TYPE (instance,
+          YTST_TYPE_SVC_STATUS_FUTURE));
+
+  g_signal_emit (instance, signals[SIGNAL_BACKLOG_CHANGED], 0,
+      service, pending, limit);
+}
+
+void
+ytst_svc_status_future_emit_dropped_requests_changed (gpointer instance,
+    guint dropped)
+{
+  g_assert (instance != NULL);
+  g_assert (G_TYPE_CHECK_INSTANCE_TYPE (instance,
+          YTST_TYPE_SVC_STATUS_FUTURE));
+
+  g_signal_emit (instance, signals[SIGNAL_DROPPED_REQUESTS_CHANGED], 0,
+      dropped);
+}
@@ -0,0 +1,240 @@
+/*
+ * status-future.h - Header for YtstSvcStatusFuture
+ * Copyright (C) 2011 Intel, Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __YTST_SVC_STATUS_FUTURE_H__
+#define __YTST_SVC_STATUS_FUTURE_H__
+
+#include <glib-object.h>
+#include <dbus/dbus-glib.h>
+
+G_BEGIN_DECLS
+
+/* The parts of the Status interface which released versions of
+ * telepathy-ytstenut-glib don't have yet; see status-future.xml */
+#define YTST_IFACE_STATUS_FUTURE \
+  "org.freedesktop.ytstenut.xpmn.Status.FUTURE"
+
+#define YTST_IFACE_QUARK_STATUS_FUTURE \
+  (ytst_iface_quark_status_future ())
+
+GQuark ytst_iface_quark_status_future (void);
+
+typedef struct _YtstSvcStatusFuture YtstSvcStatusFuture;
+typedef struct _YtstSvcStatusFutureClass YtstSvcStatusFutureClass;
+
+GType ytst_svc_status_future_get_type (void);
+
+/* TYPE MACROS */
+#define YTST_TYPE_SVC_STATUS_FUTURE \
+  (ytst_svc_status_future_get_type ())
+#define YTST_SVC_STATUS_FUTURE(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), YTST_TYPE_SVC_STATUS_FUTURE, \
+                              YtstSvcStatusFuture))
+#define YTST_IS_SVC_STATUS_FUTURE(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), YTST_TYPE_SVC_STATUS_FUTURE))
+#define YTST_SVC_STATUS_FUTURE_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_INTERFACE((obj), YTST_TYPE_SVC_STATUS_FUTURE, \
+                                 YtstSvcStatusFutureClass))
+
+/* methods */
+
+typedef void (*ytst_svc_status_future_find_services_by_capability_impl) (
+    YtstSvcStatusFuture *self,
+    const gchar *in_capability,
+    DBusGMethodInvocation *context);
+
+void ytst_svc_status_future_implement_find_services_by_capability (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_find_services_by_capability_impl impl);
+
+static inline void
+ytst_svc_status_future_return_from_find_services_by_capability (
+    DBusGMethodInvocation *context,
+    GHashTable *out_services)
+{
+  dbus_g_method_return (context, out_services);
+}
+
+typedef void (*ytst_svc_status_future_find_services_by_type_impl) (
+    YtstSvcStatusFuture *self,
+    const gchar *in_type,
+    DBusGMethodInvocation *context);
+
+void ytst_svc_status_future_implement_find_services_by_type (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_find_services_by_type_impl impl);
+
+static inline void
+ytst_svc_status_future_return_from_find_services_by_type (
+    DBusGMethodInvocation *context,
+    GHashTable *out_services)
+{
+  dbus_g_method_return (context, out_services);
+}
+
+typedef void (*ytst_svc_status_future_get_services_for_contact_impl) (
+    YtstSvcStatusFuture *self,
+    const gchar *in_contact,
+    DBusGMethodInvocation *context);
+
+void ytst_svc_status_future_implement_get_services_for_contact (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_services_for_contact_impl impl);
+
+static inline void
+ytst_svc_status_future_return_from_get_services_for_contact (
+    DBusGMethodInvocation *context,
+    GHashTable *out_services)
+{
+  dbus_g_method_return (context, out_services);
+}
+
+typedef void (*ytst_svc_status_future_get_statuses_for_contact_impl) (
+    YtstSvcStatusFuture *self,
+    const gchar *in_contact,
+    DBusGMethodInvocation *context);
+
+void ytst_svc_status_future_implement_get_statuses_for_contact (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_statuses_for_contact_impl impl);
+
+static inline void
+ytst_svc_status_future_return_from_get_statuses_for_contact (
+    DBusGMethodInvocation *context,
+    GHashTable *out_statuses)
+{
+  dbus_g_method_return (context, out_statuses);
+}
+
+typedef void (*ytst_svc_status_future_get_services_page_impl) (
+    YtstSvcStatusFuture *self,
+    const gchar *in_cursor,
+    guint in_limit,
+    DBusGMethodInvocation *context);
+
+void ytst_svc_status_future_implement_get_services_page (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_services_page_impl impl);
+
+static inline void
+ytst_svc_status_future_return_from_get_services_page (
+    DBusGMethodInvocation *context,
+    GHashTable *out_services,
+    const gchar *out_next)
+{
+  dbus_g_method_return (context, out_services, out_next);
+}
+
+typedef void (*ytst_svc_status_future_get_statuses_page_impl) (
+    YtstSvcStatusFuture *self,
+    const gchar *in_cursor,
+    guint in_limit,
+    DBusGMethodInvocation *context);
+
+void ytst_svc_status_future_implement_get_statuses_page (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_statuses_page_impl impl);
+
+static inline void
+ytst_svc_status_future_return_from_get_statuses_page (
+    DBusGMethodInvocation *context,
+    GHashTable *out_statuses,
+    const gchar *out_next)
+{
+  dbus_g_method_return (context, out_statuses, out_next);
+}
+
+typedef void (*ytst_svc_status_future_get_changes_since_impl) (
+    YtstSvcStatusFuture *self,
+    guint64 in_since,
+    DBusGMethodInvocation *context);
+
+void ytst_svc_status_future_implement_get_changes_since (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_get_changes_since_impl impl);
+
+static inline void
+ytst_svc_status_future_return_from_get_changes_since (
+    DBusGMethodInvocation *context,
+    guint64 out_version,
+    gboolean out_complete,
+    GHashTable *out_added,
+    GHashTable *out_removed,
+    GHashTable *out_statuses)
+{
+  dbus_g_method_return (context, out_version, out_complete, out_added,
+      out_removed, out_statuses);
+}
+
+typedef void (*ytst_svc_status_future_advertise_statuses_impl) (
+    YtstSvcStatusFuture *self,
+    const GPtrArray *in_statuses,
+    DBusGMethodInvocation *context);
+
+void ytst_svc_status_future_implement_advertise_statuses (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_advertise_statuses_impl impl);
+
+static inline void
+ytst_svc_status_future_return_from_advertise_statuses (
+    DBusGMethodInvocation *context)
+{
+  dbus_g_method_return (context);
+}
+
+typedef void (*ytst_svc_status_future_enable_direct_bus_impl) (
+    YtstSvcStatusFuture *self,
+    DBusGMethodInvocation *context);
+
+void ytst_svc_status_future_implement_enable_direct_bus (
+    YtstSvcStatusFutureClass *klass,
+    ytst_svc_status_future_enable_direct_bus_impl impl);
+
+static inline void
+ytst_svc_status_future_return_from_enable_direct_bus (
+    DBusGMethodInvocation *context,
+    const gchar *out_address,
+    const gchar *out_path)
+{
+  dbus_g_method_return (context, out_address, out_path);
+}
+
+/* signals */
+
+void ytst_svc_status_future_emit_scan_complete (gpointer instance);
+
+void ytst_svc_status_future_emit_services_changed (gpointer instance,
+    GHashTable *added,
+    GHashTable *removed);
+
+void ytst_svc_status_future_emit_statuses_changed (gpointer instance,
+    GHashTable *statuses);
+
+void ytst_svc_status_future_emit_backlog_changed (gpointer instance,
+    const gchar *service,
+    guint pending,
+    guint limit);
+
+void ytst_svc_status_future_emit_dropped_requests_changed (
+    gpointer instance,
+    guint dropped);
+
+G_END_DECLS
+
+#endif /* #ifndef __YTST_SVC_STATUS_FUTURE_H__*/
@@ -0,0 +1,2795 @@
+/*
+ * status-store.c - Source for YtstStatusStore
+ * Copyright (C) 2011 Intel, Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include "status-store.h"
+
+#include <string.h>
+
+#include <telepathy-glib/channel-manager.h>
+#include <telepathy-glib/enums.h>
+#include <telepathy-glib/errors.h>
+#include <telepathy-glib/gtypes.h>
+#include <telepathy-glib/svc-connection.h>
+#include <telepathy-glib/util.h>
+
+#include "caps-manager.h"
+#include "channel-manager.h"
+#include "utils.h"
+
+#define DEBUG(msg, ...) \
+  g_debug ("%s: " msg, G_STRFUNC, ##__VA_ARGS__)
+
+/* milliseconds */
+#define DEFAULT_BATCH_WINDOW 100
+#define DEFAULT_MIN_PUBLISH_INTERVAL 500
+
+/* most contacts one page of GetServicesPage or GetStatusesPage has */
+#define MAX_PAGE_SIZE 100
+
+/* how many changes GetChangesSince can go back over */
+#define MAX_CHANGE_LOG 1000
+
+/* details of compactly advertised services we've fetched before, so
+ * we don't need to ask again after a restart: (u version,
+ * a{s(sasas)} of "<uid>/<digest>" to type, names and capabilities) */
+#define DETAILS_CACHE_NAME "service-details"
+#define DETAILS_CACHE_TYPE "(ua{s(sasas)})"
+#define DETAILS_CACHE_VERSION 1
+/* most details we keep, in memory and on disk; the ones which have gone
+ * unused longest go first */
+#define MAX_CACHED_DETAILS 1000
+/* seconds to wait for more details before writing them out */
+#define DETAILS_CACHE_SAVE_DELAY 5
+
+G_DEFINE_TYPE (YtstStatusStore, ytst_status_store, G_TYPE_OBJECT);
+
+/* properties */
+enum
+{
+  PROP_CONNECTION = 1,
+  PROP_BATCH_WINDOW,
+  PROP_MIN_PUBLISH_INTERVAL,
+  LAST_PROPERTY
+};
+
+/* signals */
+enum
+{
+  SERVICE_ADDED,
+  SERVICE_REMOVED,
+  STATUS_CHANGED,
+  SERVICES_CHANGED,
+  STATUSES_CHANGED,
+  DROPPED_REQUESTS_CHANGED,
+  FETCH_DETAILS,
+  SEND_STATUSES,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+/* private structure */
+struct _YtstStatusStorePrivate
+{
+  TpBaseConnection *connection;
+
+  /* every jid, capability, service name and type anything here refers
+   * to: GHashTable<gchar*, PooledString*> without references of its
+   * own */
+  GHashTable *strings;
+
+  /* GHashTable<StatusKey*,gchar*>; the nested form D-Bus wants is only
+   * built when someone asks for it */
+  GHashTable *discovered_statuses;
+
+  /* GHashTable<gchar*,
+   *     GHashTable<gchar*,ServiceRecord*>>
+   */
+  GHashTable *discovered_services;
+
+  /* every distinct service description anyone advertises, shared
+   * between everything using it: GHashTable<gchar *key, ServiceRecord*>
+   * without references of its own */
+  GHashTable *service_records;
+
+  /* GHashTable<pooled gchar *jid, GHashTable<StatusKey*, NULL>>
+   * borrowing the keys of discovered_statuses, to find one contact's
+   * statuses */
+  GHashTable *contact_statuses;
+
+  /* pooled jids of everyone in discovered_services and
+   * discovered_statuses, in order, for paging through them */
+  GSequence *service_jids;
+  GSequence *status_jids;
+
+  /* Where to find services by what they can do and by their type:
+   * GHashTable<pooled gchar *capability or type,
+   *     GHashTable<ServiceKey*, ServiceRecord*>>, borrowing the records
+   * from discovered_services */
+  GHashTable *capability_index;
+  GHashTable *type_index;
+
+  /* details of services we've seen, whether advertised compactly or
+   * in full: GHashTable<gchar *uid_digest, DetailsEntry*>, where
+   * uid_digest is "<uid>/<digest>", and the same keys again, most
+   * recently used first */
+  GHashTable *indexed_details;
+  GQueue *details_lru;
+  /* uid_digests we've asked someone for the details of already */
+  GHashTable *pending_details;
+  /* when indexed_details next gets written out to disk */
+  guint details_cache_id;
+
+  /* GHashTable<gchar *jid, gchar *digest> of the forms we last looked
+   * at for each contact, so we can skip them when they haven't changed */
+  GHashTable *contact_digests;
+
+  /* Changes for the next ServicesChanged and StatusesChanged:
+   * GHashTable<gchar *jid, GHashTable<gchar *service, ServiceRecord*>>,
+   * GHashTable<gchar *jid, GHashTable<gchar *service, NULL>> and
+   * GHashTable<StatusKey*, gchar *status or "" if it's gone> */
+  GHashTable *batched_added;
+  GHashTable *batched_removed;
+  GHashTable *batched_statuses;
+  guint batch_window;
+  guint batch_id;
+
+  /* the channel manager's count of requests it's refused for coming
+   * too fast, and whether it's gone up since the last batch */
+  guint dropped_requests;
+  gboolean dropped_requests_changed;
+
+  /* bumped on every change to discovered_services or
+   * discovered_statuses; change_log has the last few changes, oldest
+   * first, and is complete for anyone who's seen change_log_start */
+  guint64 change_version;
+  guint64 change_log_start;
+  GQueue *change_log;
+
+  /* GHashTable<StatusKey* without a contact, PublishSlot*>: when we
+   * last published each of our statuses and what's waiting to go */
+  GHashTable *publish_slots;
+  guint min_publish_interval;
+
+  /* while publishing is frozen, the statuses which can go straight
+   * away: GHashTable<PublishSlot*, WockyNodeTree*> */
+  GHashTable *ready;
+  guint publish_freeze;
+
+  gboolean dispose_has_run;
+};
+
+/* -----------------------------------------------------------------------------
+ * INTERNAL
+ */
+
+/* A jid, capability, service name or type, shared between everything
+ * here which mentions it so that equal ones are the same pointer. Like
+ * ServiceRecord, it leaves the pool with its last reference; interning
+ * it for good would let peers grow memory for as long as the process
+ * runs just by making up names. */
+typedef struct
+{
+  guint refs;
+  /* where it's shared from */
+  GHashTable *table;
+  gchar str[1];
+} PooledString;
+
+/* Returns @str as it is in the pool, without a reference, or %NULL if
+ * it isn't there, in which case nothing is stored under it */
+static const gchar *
+pool_lookup (YtstStatusStore *self,
+    const gchar *str)
+{
+  PooledString *pooled;
+
+  if (str == NULL)
+    return NULL;
+
+  pooled = g_hash_table_lookup (self->priv->strings, str);
+
+  return pooled != NULL ? pooled->str : NULL;
+}
+
+/* Returns a reference to @str in the pool, adding it if it's new */
+static const gchar *
+pool_ref (YtstStatusStore *self,
+    const gchar *str)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  PooledString *pooled;
+  gsize len;
+
+  if (str == NULL)
+    return NULL;
+
+  pooled = g_hash_table_lookup (priv->strings, str);
+
+  if (pooled != NULL)
+    {
+      pooled->refs++;
+      return pooled->str;
+    }
+
+  len = strlen (str);
+  pooled = g_malloc (G_STRUCT_OFFSET (PooledString, str) + len + 1);
+  pooled->refs = 1;
+  pooled->table = g_hash_table_ref (priv->strings);
+  memcpy (pooled->str, str, len + 1);
+
+  g_hash_table_insert (priv->strings, pooled->str, pooled);
+
+  return pooled->str;
+}
+
+static void
+pool_unref (gpointer str)
+{
+  PooledString *pooled;
+
+  if (str == NULL)
+    return;
+
+  pooled = (PooledString *) ((gchar *) str
+      - G_STRUCT_OFFSET (PooledString, str));
+
+  if (--pooled->refs > 0)
+    return;
+
+  g_hash_table_remove (pooled->table, pooled->str);
+  g_hash_table_unref (pooled->table);
+  g_free (pooled);
+}
+
+/* One status someone has advertised, or one of ours if contact is
+ * NULL. Each key has its own references to the pooled strings, which
+ * are compared by pointer. */
+typedef struct
+{
+  const gchar *contact;
+  const gchar *capability;
+  const gchar *service;
+} StatusKey;
+
+static guint
+status_key_hash (gconstpointer key)
+{
+  const StatusKey *k = key;
+
+  return (g_direct_hash (k->contact) * 31
+      + g_direct_hash (k->capability)) * 31
+      + g_direct_hash (k->service);
+}
+
+static gboolean
+status_key_equal (gconstpointer a,
+    gconstpointer b)
+{
+  const StatusKey *ka = a;
+  const StatusKey *kb = b;
+
+  return ka->contact == kb->contact
+      && ka->capability == kb->capability
+      && ka->service == kb->service;
+}
+
+static void
+status_key_clear (StatusKey *key)
+{
+  pool_unref ((gpointer) key->contact);
+  pool_unref ((gpointer) key->capability);
+  pool_unref ((gpointer) key->service);
+}
+
+static void
+status_key_free (gpointer key)
+{
+  status_key_clear (key);
+  g_slice_free (StatusKey, key);
+}
+
+static StatusKey *
+status_key_new (YtstStatusStore *self,
+    const gchar *contact,
+    const gchar *capability,
+    const gchar *service)
+{
+  StatusKey *key = g_slice_new (StatusKey);
+
+  key->contact = pool_ref (self, contact);
+  key->capability = pool_ref (self, capability);
+  key->service = pool_ref (self, service);
+
+  return key;
+}
+
+/* One service of one contact, with its own references to both
+ * pooled strings. */
+typedef struct
+{
+  const gchar *contact;
+  const gchar *service;
+} ServiceKey;
+
+static guint
+service_key_hash (gconstpointer key)
+{
+  const ServiceKey *k = key;
+
+  return g_direct_hash (k->contact) * 31 + g_direct_hash (k->service);
+}
+
+static gboolean
+service_key_equal (gconstpointer a,
+    gconstpointer b)
+{
+  const ServiceKey *ka = a;
+  const ServiceKey *kb = b;
+
+  return ka->contact == kb->contact && ka->service == kb->service;
+}
+
+static void
+service_key_free (gpointer key)
+{
+  ServiceKey *k = key;
+
+  pool_unref ((gpointer) k->contact);
+  pool_unref ((gpointer) k->service);
+  g_slice_free (ServiceKey, key);
+}
+
+/* What a service says about itself. Lots of contacts tend to advertise
+ * the same services, so these are shared rather than copied for each. */
+typedef struct
+{
+  guint refs;
+  /* where it's shared from */
+  GHashTable *table;
+  gchar *key;
+
+  gchar *type;
+  /* "<lang>/<name>" */
+  gchar **names;
+  gchar **caps;
+
+  /* (sa{ss}as) as on D-Bus, or NULL until someone asks for it */
+  GValueArray *details;
+} ServiceRecord;
+
+static ServiceRecord *
+service_record_ref (ServiceRecord *record)
+{
+  record->refs++;
+  return record;
+}
+
+static void
+service_record_unref (ServiceRecord *record)
+{
+  if (--record->refs > 0)
+    return;
+
+  g_hash_table_remove (record->table, record->key);
+  g_hash_table_unref (record->table);
+
+  g_free (record->key);
+  g_free (record->type);
+  g_strfreev (record->names);
+  g_strfreev (record->caps);
+
+  if (record->details != NULL)
+    g_value_array_free (record->details);
+
+  g_slice_free (ServiceRecord, record);
+}
+
+/* Returns a reference to the record for a service with these details,
+ * shared with anyone else who has the same */
+static ServiceRecord *
+service_record_intern (YtstStatusStore *self,
+    const gchar *type,
+    const gchar * const *names,
+    const gchar * const *caps)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  ServiceRecord *record;
+  gchar *key;
+
+  key = ytst_service_digest ("", type, names, caps);
+  record = g_hash_table_lookup (priv->service_records, key);
+
+  if (record != NULL)
+    {
+      g_free (key);
+      return service_record_ref (record);
+    }
+
+  record = g_slice_new0 (ServiceRecord);
+  record->refs = 1;
+  record->table = g_hash_table_ref (priv->service_records);
+  record->key = key;
+  record->type = g_strdup (type);
+  record->names = g_strdupv ((gchar **) names);
+  record->caps = g_strdupv ((gchar **) caps);
+
+  g_hash_table_insert (priv->service_records, record->key, record);
+
+  return record;
+}
+
+static GHashTable *
+get_name_map_from_strv (const gchar **strv)
+{
+  GHashTable *out = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, g_free);
+  const gchar **s;
+
+  for (s = strv; s != NULL && *s != NULL; s++)
+    {
+      gchar **parts = g_strsplit (*s, "/", 2);
+
+      g_hash_table_insert (out,
+          g_strdup (parts[0]), g_strdup(parts[1]));
+
+      g_strfreev (parts);
+    }
+
+  return out;
+}
+
+static GValueArray *
+service_record_get_details (ServiceRecord *record)
+{
+  GHashTable *name_map;
+
+  if (record->details != NULL)
+    return record->details;
+
+  name_map = get_name_map_from_strv ((const gchar **) record->names);
+
+  record->details = tp_value_array_build (3,
+      G_TYPE_STRING, record->type,
+      TP_HASH_TYPE_STRING_STRING_MAP, name_map,
+      G_TYPE_STRV, record->caps,
+      G_TYPE_INVALID);
+
+  g_hash_table_unref (name_map);
+
+  return record->details;
+}
+
+/* Builds the a{s(sa{ss}as)} of one contact's services out of
+ * GHashTable<gchar*,ServiceRecord*> */
+static GHashTable *
+dup_services_map (GHashTable *records)
+{
+  GHashTable *out;
+  GHashTableIter iter;
+  gpointer service, record;
+
+  out = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_value_array_free);
+
+  if (records == NULL)
+    return out;
+
+  g_hash_table_iter_init (&iter, records);
+  while (g_hash_table_iter_next (&iter, &service, &record))
+    g_hash_table_insert (out, g_strdup (service),
+        g_value_array_copy (service_record_get_details (record)));
+
+  return out;
+}
+
+static void
+index_service (YtstStatusStore *self,
+    GHashTable *index,
+    const gchar *key,
+    const gchar *jid,
+    const gchar *service,
+    ServiceRecord *record)
+{
+  GHashTable *entries;
+  ServiceKey *k;
+
+  entries = g_hash_table_lookup (index, pool_lookup (self, key));
+
+  if (entries == NULL)
+    {
+      entries = g_hash_table_new_full (service_key_hash, service_key_equal,
+          service_key_free, NULL);
+      g_hash_table_insert (index, (gpointer) pool_ref (self, key), entries);
+    }
+
+  k = g_slice_new (ServiceKey);
+  k->contact = pool_ref (self, jid);
+  k->service = pool_ref (self, service);
+
+  g_hash_table_replace (entries, k, record);
+}
+
+static void
+unindex_service (YtstStatusStore *self,
+    GHashTable *index,
+    const gchar *key,
+    const gchar *jid,
+    const gchar *service)
+{
+  const gchar *pooled = pool_lookup (self, key);
+  GHashTable *entries;
+  ServiceKey k;
+
+  entries = g_hash_table_lookup (index, pooled);
+  if (entries == NULL)
+    return;
+
+  k.contact = pool_lookup (self, jid);
+  k.service = pool_lookup (self, service);
+
+  g_hash_table_remove (entries, &k);
+
+  if (g_hash_table_size (entries) == 0)
+    g_hash_table_remove (index, pooled);
+}
+
+/* Moves @service of @jid in the indexes from @old_record to
+ * @new_record, either of which can be %NULL */
+static void
+reindex_service (YtstStatusStore *self,
+    const gchar *jid,
+    const gchar *service,
+    ServiceRecord *old_record,
+    ServiceRecord *new_record)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  gchar **cap;
+
+  if (old_record == new_record)
+    return;
+
+  if (old_record != NULL)
+    {
+      for (cap = old_record->caps; *cap != NULL; cap++)
+        unindex_service (self, priv->capability_index, *cap, jid,
+            service);
+
+      unindex_service (self, priv->type_index, old_record->type, jid,
+          service);
+    }
+
+  if (new_record != NULL)
+    {
+      for (cap = new_record->caps; *cap != NULL; cap++)
+        index_service (self, priv->capability_index, *cap, jid, service,
+            new_record);
+
+      index_service (self, priv->type_index, new_record->type, jid,
+          service, new_record);
+    }
+}
+
+/* Builds the a{sa{s(sa{ss}as)}} of the services in @index under @key */
+static GHashTable *
+dup_indexed_services (YtstStatusStore *self,
+    GHashTable *index,
+    const gchar *key)
+{
+  GHashTable *out, *entries;
+  GHashTableIter iter;
+  gpointer k, record;
+
+  out = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+
+  entries = g_hash_table_lookup (index, pool_lookup (self, key));
+
+  if (entries == NULL)
+    return out;
+
+  g_hash_table_iter_init (&iter, entries);
+  while (g_hash_table_iter_next (&iter, &k, &record))
+    {
+      const ServiceKey *service_key = k;
+      GHashTable *services;
+
+      services = g_hash_table_lookup (out, service_key->contact);
+
+      if (services == NULL)
+        {
+          services = g_hash_table_new_full (g_str_hash, g_str_equal,
+              g_free, (GDestroyNotify) g_value_array_free);
+          g_hash_table_insert (out, g_strdup (service_key->contact),
+              services);
+        }
+
+      g_hash_table_insert (services, g_strdup (service_key->service),
+          g_value_array_copy (service_record_get_details (record)));
+    }
+
+  return out;
+}
+
+/* Adds @status of @k to an a{sa{ss}} of capability, service and
+ * status */
+static void
+add_to_capability_service_map (GHashTable *capability_service_map,
+    const StatusKey *k,
+    const gchar *status)
+{
+  GHashTable *service_status_map;
+
+  service_status_map = g_hash_table_lookup (capability_service_map,
+      k->capability);
+
+  if (service_status_map == NULL)
+    {
+      service_status_map = g_hash_table_new_full (g_str_hash,
+          g_str_equal, g_free, g_free);
+      g_hash_table_insert (capability_service_map,
+          g_strdup (k->capability), service_status_map);
+    }
+
+  g_hash_table_insert (service_status_map, g_strdup (k->service),
+      g_strdup (status));
+}
+
+static GHashTable *
+new_capability_service_map (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+}
+
+/* Builds the a{sa{sa{ss}}} DiscoveredStatuses is on D-Bus out of
+ * GHashTable<StatusKey*,gchar*> */
+static GHashTable *
+dup_status_map (GHashTable *statuses)
+{
+  GHashTable *out;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  out = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+
+  if (statuses == NULL)
+    return out;
+
+  g_hash_table_iter_init (&iter, statuses);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const StatusKey *k = key;
+      GHashTable *capability_service_map;
+
+      capability_service_map = g_hash_table_lookup (out, k->contact);
+
+      if (capability_service_map == NULL)
+        {
+          capability_service_map = new_capability_service_map ();
+          g_hash_table_insert (out, g_strdup (k->contact),
+              capability_service_map);
+        }
+
+      add_to_capability_service_map (capability_service_map, k, value);
+    }
+
+  return out;
+}
+
+static gint
+compare_jids (gconstpointer a,
+    gconstpointer b,
+    gpointer user_data)
+{
+  return strcmp (a, b);
+}
+
+static void
+sorted_jids_add (YtstStatusStore *self,
+    GSequence *jids,
+    const gchar *jid)
+{
+  if (g_sequence_lookup (jids, (gpointer) jid, compare_jids, NULL) == NULL)
+    g_sequence_insert_sorted (jids, (gpointer) pool_ref (self, jid),
+        compare_jids, NULL);
+}
+
+static void
+sorted_jids_remove (GSequence *jids,
+    const gchar *jid)
+{
+  GSequenceIter *iter;
+
+  iter = g_sequence_lookup (jids, (gpointer) jid, compare_jids, NULL);
+
+  if (iter != NULL)
+    g_sequence_remove (iter);
+}
+
+/* Returns up to @limit jids from @jids which come after @cursor, or
+ * from the start if it's empty, and sets @next to where the next page
+ * starts from, or "" if this is the last one */
+static GPtrArray *
+page_jids (GSequence *jids,
+    const gchar *cursor,
+    guint limit,
+    const gchar **next)
+{
+  GPtrArray *page = g_ptr_array_new ();
+  GSequenceIter *iter;
+
+  if (limit == 0 || limit > MAX_PAGE_SIZE)
+    limit = MAX_PAGE_SIZE;
+
+  /* this finds the first one after the cursor, even if the cursor
+   * itself has gone away since */
+  if (tp_str_empty (cursor))
+    iter = g_sequence_get_begin_iter (jids);
+  else
+    iter = g_sequence_search (jids, (gpointer) cursor, compare_jids, NULL);
+
+  for (; !g_sequence_iter_is_end (iter) && page->len < limit;
+       iter = g_sequence_iter_next (iter))
+    g_ptr_array_add (page, g_sequence_get (iter));
+
+  if (g_sequence_iter_is_end (iter) || page->len == 0)
+    *next = "";
+  else
+    *next = g_ptr_array_index (page, page->len - 1);
+
+  return page;
+}
+
+/* One of our own statuses, so we can keep it from going out more than
+ * once every min_publish_interval */
+typedef struct
+{
+  YtstStatusStore *self;
+  /* pooled, with references of its own */
+  const gchar *capability;
+  const gchar *service;
+  /* monotonic time, in microseconds */
+  gint64 last_sent;
+  /* the latest status to go out when timeout_id fires */
+  WockyNodeTree *pending;
+  guint timeout_id;
+} PublishSlot;
+
+static void
+publish_slot_free (gpointer data)
+{
+  PublishSlot *slot = data;
+
+  if (slot->timeout_id != 0)
+    g_source_remove (slot->timeout_id);
+
+  if (slot->pending != NULL)
+    {
+      DEBUG ("dropping status for %s/%s which never went out",
+          slot->capability, slot->service);
+      g_object_unref (slot->pending);
+    }
+
+  pool_unref ((gpointer) slot->capability);
+  pool_unref ((gpointer) slot->service);
+  g_slice_free (PublishSlot, slot);
+}
+
+/* Hands @status_trees, which are all for @capability, to the transport
+ * to send in as few stanzas as it can */
+static void
+send_statuses (YtstStatusStore *self,
+    const gchar *capability,
+    GPtrArray *status_trees)
+{
+  g_signal_emit (self, signals[SEND_STATUSES], 0, capability,
+      status_trees);
+}
+
+static gboolean
+publish_timeout_cb (gpointer user_data)
+{
+  PublishSlot *slot = user_data;
+  GPtrArray *status_trees;
+
+  slot->timeout_id = 0;
+  slot->last_sent = g_get_monotonic_time ();
+
+  status_trees = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (status_trees, slot->pending);
+  slot->pending = NULL;
+
+  send_statuses (slot->self, slot->capability, status_trees);
+  g_ptr_array_unref (status_trees);
+
+  return FALSE;
+}
+
+/* Builds the a{sa{s(sa{ss}as)}} and a{sas} ServicesChanged has out of
+ * tables like batched_added and batched_removed. They borrow everything
+ * from those, so have to go first. */
+static void
+dup_services_changes (GHashTable *added_in,
+    GHashTable *removed_in,
+    GHashTable **added,
+    GHashTable **removed)
+{
+  GHashTableIter iter, services_iter;
+  gpointer jid, services, service, record;
+
+  *added = g_hash_table_new_full (g_str_hash, g_str_equal,
+      NULL, (GDestroyNotify) g_hash_table_unref);
+
+  g_hash_table_iter_init (&iter, added_in);
+  while (g_hash_table_iter_next (&iter, &jid, &services))
+    {
+      GHashTable *details = g_hash_table_new (g_str_hash, g_str_equal);
+
+      g_hash_table_iter_init (&services_iter, services);
+      while (g_hash_table_iter_next (&services_iter, &service, &record))
+        g_hash_table_insert (details, service,
+            service_record_get_details (record));
+
+      g_hash_table_insert (*added, jid, details);
+    }
+
+  *removed = g_hash_table_new_full (g_str_hash, g_str_equal,
+      NULL, g_free);
+
+  g_hash_table_iter_init (&iter, removed_in);
+  while (g_hash_table_iter_next (&iter, &jid, &services))
+    {
+      gchar **strv = g_new0 (gchar *, g_hash_table_size (services) + 1);
+      guint i = 0;
+
+      g_hash_table_iter_init (&services_iter, services);
+      while (g_hash_table_iter_next (&services_iter, &service, NULL))
+        strv[i++] = service;
+
+      g_hash_table_insert (*removed, jid, strv);
+    }
+}
+
+static gboolean
+batch_timeout_cb (gpointer user_data)
+{
+  YtstStatusStore *self = YTST_STATUS_STORE (user_data);
+  YtstStatusStorePrivate *priv = self->priv;
+
+  priv->batch_id = 0;
+
+  if (g_hash_table_size (priv->batched_added) > 0
+      || g_hash_table_size (priv->batched_removed) > 0)
+    {
+      GHashTable *added, *removed;
+
+      dup_services_changes (priv->batched_added, priv->batched_removed,
+          &added, &removed);
+
+      g_signal_emit (self, signals[SERVICES_CHANGED], 0, added, removed);
+
+      g_hash_table_unref (added);
+      g_hash_table_unref (removed);
+      g_hash_table_remove_all (priv->batched_added);
+      g_hash_table_remove_all (priv->batched_removed);
+    }
+
+  if (g_hash_table_size (priv->batched_statuses) > 0)
+    {
+      GHashTable *statuses = dup_status_map (priv->batched_statuses);
+
+      g_signal_emit (self, signals[STATUSES_CHANGED], 0, statuses);
+
+      g_hash_table_unref (statuses);
+      g_hash_table_remove_all (priv->batched_statuses);
+    }
+
+  if (priv->dropped_requests_changed)
+    {
+      g_signal_emit (self, signals[DROPPED_REQUESTS_CHANGED], 0,
+          priv->dropped_requests);
+      priv->dropped_requests_changed = FALSE;
+    }
+
+  return FALSE;
+}
+
+static void
+batch_schedule (YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+
+  if (priv->batch_id != 0)
+    return;
+
+  /* the first change in a batch decides when it goes out, so a steady
+   * trickle can't hold it back for ever */
+  if (priv->batch_window > 0)
+    priv->batch_id = g_timeout_add (priv->batch_window,
+        batch_timeout_cb, self);
+  else
+    priv->batch_id = g_idle_add (batch_timeout_cb, self);
+}
+
+/* Moves @service of @jid from one batched table to the other, and puts
+ * @record in it if that's given */
+static void
+batch_service_change (GHashTable *from,
+    GHashTable *to,
+    const gchar *jid,
+    const gchar *service,
+    ServiceRecord *record)
+{
+  GHashTable *services;
+
+  services = g_hash_table_lookup (from, jid);
+  if (services != NULL)
+    {
+      g_hash_table_remove (services, service);
+      if (g_hash_table_size (services) == 0)
+        g_hash_table_remove (from, jid);
+    }
+
+  services = g_hash_table_lookup (to, jid);
+  if (services == NULL)
+    {
+      /* batched_removed has no records in it */
+      services = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+          record != NULL ? (GDestroyNotify) service_record_unref : NULL);
+      g_hash_table_insert (to, g_strdup (jid), services);
+    }
+
+  g_hash_table_replace (services, g_strdup (service),
+      record != NULL ? service_record_ref (record) : NULL);
+}
+
+typedef enum
+{
+  CHANGE_SERVICE_ADDED,
+  CHANGE_SERVICE_REMOVED,
+  CHANGE_STATUS,
+} ChangeKind;
+
+/* One entry in the change log. The strings are pooled; capability is
+ * only set for status changes, record only for added services and
+ * status is "" if it's gone. */
+typedef struct
+{
+  guint64 version;
+  ChangeKind kind;
+  StatusKey key;
+  ServiceRecord *record;
+  gchar *status;
+} Change;
+
+static void
+change_free (Change *change)
+{
+  if (change->record != NULL)
+    service_record_unref (change->record);
+  status_key_clear (&change->key);
+  g_free (change->status);
+  g_slice_free (Change, change);
+}
+
+static void
+log_change (YtstStatusStore *self,
+    ChangeKind kind,
+    const gchar *jid,
+    const gchar *capability,
+    const gchar *service,
+    ServiceRecord *record,
+    const gchar *status_str)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  Change *change = g_slice_new0 (Change);
+
+  change->version = ++priv->change_version;
+  change->kind = kind;
+  change->key.contact = pool_ref (self, jid);
+  change->key.capability = pool_ref (self, capability);
+  change->key.service = pool_ref (self, service);
+
+  if (record != NULL)
+    change->record = service_record_ref (record);
+
+  if (kind == CHANGE_STATUS)
+    change->status = g_strdup (status_str != NULL ? status_str : "");
+
+  g_queue_push_tail (priv->change_log, change);
+
+  while (g_queue_get_length (priv->change_log) > MAX_CHANGE_LOG)
+    {
+      Change *oldest = g_queue_pop_head (priv->change_log);
+
+      /* anyone who hasn't seen this one can't catch up from the log */
+      priv->change_log_start = oldest->version;
+      change_free (oldest);
+    }
+}
+
+static void
+batch_service_added (YtstStatusStore *self,
+    const gchar *jid,
+    const gchar *service,
+    ServiceRecord *record)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+
+  log_change (self, CHANGE_SERVICE_ADDED, jid, NULL, service, record,
+      NULL);
+  batch_service_change (priv->batched_removed, priv->batched_added, jid,
+      service, record);
+  batch_schedule (self);
+}
+
+static void
+batch_service_removed (YtstStatusStore *self,
+    const gchar *jid,
+    const gchar *service)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+
+  log_change (self, CHANGE_SERVICE_REMOVED, jid, NULL, service, NULL,
+      NULL);
+
+  /* still say it went, even if it came in this batch; removing
+   * something nobody's heard of is harmless */
+  batch_service_change (priv->batched_added, priv->batched_removed, jid,
+      service, NULL);
+  batch_schedule (self);
+}
+
+static void
+batch_status_change (YtstStatusStore *self,
+    const gchar *jid,
+    const gchar *capability,
+    const gchar *service,
+    const gchar *status_str)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+
+  log_change (self, CHANGE_STATUS, jid, capability, service, NULL,
+      status_str);
+
+  /* only the latest one matters */
+  g_hash_table_replace (priv->batched_statuses,
+      status_key_new (self, jid, capability, service),
+      g_strdup (status_str != NULL ? status_str : ""));
+  batch_schedule (self);
+}
+
+static void
+contact_status_added (YtstStatusStore *self,
+    StatusKey *key)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GHashTable *keys;
+
+  keys = g_hash_table_lookup (priv->contact_statuses, key->contact);
+
+  if (keys == NULL)
+    {
+      keys = g_hash_table_new (status_key_hash, status_key_equal);
+      g_hash_table_insert (priv->contact_statuses, (gpointer) key->contact,
+          keys);
+      sorted_jids_add (self, priv->status_jids, key->contact);
+    }
+
+  g_hash_table_insert (keys, key, NULL);
+}
+
+static void
+contact_status_removed (YtstStatusStore *self,
+    StatusKey *key)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GHashTable *keys;
+
+  keys = g_hash_table_lookup (priv->contact_statuses, key->contact);
+  if (keys == NULL)
+    return;
+
+  g_hash_table_remove (keys, key);
+
+  if (g_hash_table_size (keys) == 0)
+    {
+      sorted_jids_remove (priv->status_jids, key->contact);
+      g_hash_table_remove (priv->contact_statuses, key->contact);
+    }
+}
+
+/* Finds what @form says about a service, or returns %FALSE if it
+ * isn't valid */
+static gboolean
+get_service_fields (WockyDataForm *form,
+    const gchar **type,
+    const gchar * const **names,
+    const gchar * const **caps)
+{
+  static const gchar * const no_strings[] = { NULL };
+  WockyDataFormField *field;
+
+  field = g_hash_table_lookup (form->fields, "type");
+  if (field == NULL || field->type != WOCKY_DATA_FORM_FIELD_TYPE_TEXT_SINGLE
+      || field->default_value == NULL)
+    return FALSE;
+
+  *type = g_value_get_string (field->default_value);
+
+  field = g_hash_table_lookup (form->fields, "name");
+  if (field != NULL && field->raw_value_contents != NULL
+      && field->type == WOCKY_DATA_FORM_FIELD_TYPE_TEXT_MULTI)
+    *names = (const gchar * const *) field->raw_value_contents;
+  else
+    *names = no_strings;
+
+  field = g_hash_table_lookup (form->fields, "capabilities");
+  if (field != NULL && field->raw_value_contents != NULL
+      && field->type == WOCKY_DATA_FORM_FIELD_TYPE_TEXT_MULTI)
+    *caps = (const gchar * const *) field->raw_value_contents;
+  else
+    *caps = no_strings;
+
+  return TRUE;
+}
+
+/* Returns a reference to the record for the service described by
+ * @form, or %NULL if it isn't valid */
+static ServiceRecord *
+service_record_from_form (YtstStatusStore *self,
+    WockyDataForm *form)
+{
+  const gchar *type;
+  const gchar * const *names, * const *caps;
+
+  if (!get_service_fields (form, &type, &names, &caps))
+    return NULL;
+
+  return service_record_intern (self, type, names, caps);
+}
+
+static gboolean
+strv_equal (const gchar * const *a,
+    gchar **b)
+{
+  for (; *a != NULL && *b != NULL; a++, b++)
+    {
+      if (tp_strdiff (*a, *b))
+        return FALSE;
+    }
+
+  return *a == NULL && *b == NULL;
+}
+
+/* Whether @form still says exactly what @record does; cheaper than
+ * looking the record up again */
+static gboolean
+service_record_matches_form (ServiceRecord *record,
+    WockyDataForm *form)
+{
+  const gchar *type;
+  const gchar * const *names, * const *caps;
+
+  return get_service_fields (form, &type, &names, &caps)
+      && !tp_strdiff (type, record->type)
+      && strv_equal (names, record->names)
+      && strv_equal (caps, record->caps);
+}
+
+/* The fields of our forms that we look at, in a fixed order */
+static const gchar * const digest_fields[] = { "type", "name",
+    "capabilities", "services", "digest", NULL };
+
+/* Digest of what @data_forms say about ytstenut services, ignoring
+ * every other form, so changes to anything else can be skipped */
+static gchar *
+dup_forms_digest (const GPtrArray *data_forms)
+{
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  gchar *out;
+  guint i;
+
+  for (i = 0; i < data_forms->len; i++)
+    {
+      WockyDataForm *form = g_ptr_array_index (data_forms, i);
+      WockyDataFormField *field;
+      const gchar *form_type;
+      const gchar * const *f;
+      gchar **v;
+
+      field = g_hash_table_lookup (form->fields, "FORM_TYPE");
+
+      if (field == NULL || field->default_value == NULL
+          || field->type != WOCKY_DATA_FORM_FIELD_TYPE_HIDDEN)
+        continue;
+
+      form_type = g_value_get_string (field->default_value);
+
+      if (!g_str_has_prefix (form_type, SERVICE_PREFIX)
+          && !g_str_has_prefix (form_type, YTST_INDEX_NS))
+        continue;
+
+      g_checksum_update (checksum, (const guchar *) form_type,
+          strlen (form_type) + 1);
+
+      for (f = digest_fields; *f != NULL; f++)
+        {
+          field = g_hash_table_lookup (form->fields, *f);
+
+          if (field != NULL)
+            {
+              guchar field_type = field->type;
+
+              g_checksum_update (checksum, (const guchar *) *f,
+                  strlen (*f) + 1);
+              g_checksum_update (checksum, &field_type, 1);
+
+              for (v = field->raw_value_contents; v != NULL && *v != NULL;
+                   v++)
+                {
+                  g_checksum_update (checksum, (const guchar *) *v,
+                      strlen (*v));
+                  g_checksum_update (checksum, (const guchar *) "\n", 1);
+                }
+            }
+
+          g_checksum_update (checksum, (const guchar *) "", 1);
+        }
+    }
+
+  out = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return out;
+}
+
+/* Whether @form is what someone advertised as @uid with @digest */
+static gboolean
+form_matches_digest (WockyDataForm *form,
+    const gchar *uid,
+    const gchar *digest)
+{
+  const gchar *type;
+  const gchar * const *names, * const *caps;
+  gchar *computed;
+  gboolean ret;
+
+  if (!get_service_fields (form, &type, &names, &caps))
+    return FALSE;
+
+  computed = ytst_service_digest (uid, type, names, caps);
+  ret = !tp_strdiff (computed, digest);
+  g_free (computed);
+
+  return ret;
+}
+
+/* One of indexed_details, and where it is in details_lru */
+typedef struct
+{
+  ServiceRecord *record;
+  /* borrows the key from indexed_details */
+  GList *link;
+} DetailsEntry;
+
+static void
+details_entry_free (gpointer data)
+{
+  DetailsEntry *entry = data;
+
+  service_record_unref (entry->record);
+  g_slice_free (DetailsEntry, entry);
+}
+
+/* Returns the details known as @uid_digest, without a reference, and
+ * makes them the most recently used */
+static ServiceRecord *
+lookup_details (YtstStatusStore *self,
+    const gchar *uid_digest)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  DetailsEntry *entry;
+
+  entry = g_hash_table_lookup (priv->indexed_details, uid_digest);
+
+  if (entry == NULL)
+    return NULL;
+
+  g_queue_unlink (priv->details_lru, entry->link);
+  g_queue_push_head_link (priv->details_lru, entry->link);
+
+  return entry->record;
+}
+
+/* Adds @record, taking ownership of it and of @uid_digest, as the most
+ * recently used details, and forgets the least recently used ones if
+ * there are too many */
+static void
+insert_details (YtstStatusStore *self,
+    gchar *uid_digest,
+    ServiceRecord *record)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  DetailsEntry *entry;
+
+  entry = g_hash_table_lookup (priv->indexed_details, uid_digest);
+
+  if (entry != NULL)
+    {
+      service_record_unref (entry->record);
+      entry->record = record;
+      g_free (uid_digest);
+      g_queue_unlink (priv->details_lru, entry->link);
+      g_queue_push_head_link (priv->details_lru, entry->link);
+      return;
+    }
+
+  entry = g_slice_new0 (DetailsEntry);
+  entry->record = record;
+  g_queue_push_head (priv->details_lru, uid_digest);
+  entry->link = g_queue_peek_head_link (priv->details_lru);
+  g_hash_table_insert (priv->indexed_details, uid_digest, entry);
+
+  while (g_queue_get_length (priv->details_lru) > MAX_CACHED_DETAILS)
+    {
+      gchar *oldest = g_queue_pop_tail (priv->details_lru);
+
+      DEBUG ("forgetting details of %s", oldest);
+      g_hash_table_remove (priv->indexed_details, oldest);
+    }
+}
+
+static void
+load_details_cache (YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GVariant *cache, *entries;
+  GError *error = NULL;
+  guint32 version;
+  gsize i;
+  const gchar *uid_digest, *type;
+  const gchar **names, **caps;
+
+  cache = ytst_cache_load (DETAILS_CACHE_NAME,
+      G_VARIANT_TYPE (DETAILS_CACHE_TYPE), &error);
+
+  if (cache == NULL)
+    {
+      DEBUG ("no service details cache: %s", error->message);
+      g_clear_error (&error);
+      return;
+    }
+
+  g_variant_get (cache, "(u@a{s(sasas)})", &version, &entries);
+
+  if (version != DETAILS_CACHE_VERSION)
+    {
+      DEBUG ("ignoring service details cache version %u", version);
+      goto out;
+    }
+
+  /* they're saved most recently used first, so that's how they need
+   * to end up */
+  for (i = g_variant_n_children (entries); i-- > 0;)
+    {
+      const gchar *digest;
+      gchar *uid, *computed = NULL;
+
+      g_variant_get_child (entries, i, "{&s(&s^a&s^a&s)}",
+          &uid_digest, &type, &names, &caps);
+      digest = strrchr (uid_digest, '/');
+
+      if (digest != NULL)
+        {
+          uid = g_strndup (uid_digest, digest - uid_digest);
+          computed = ytst_service_digest (uid, type, names, caps);
+          g_free (uid);
+        }
+
+      /* same check as when they come off the network */
+      if (digest != NULL && !tp_strdiff (computed, digest + 1))
+        insert_details (self, g_strdup (uid_digest),
+            service_record_intern (self, type, names, caps));
+      else
+        DEBUG ("ignoring bad cached details for %s", uid_digest);
+
+      g_free (computed);
+      g_free (names);
+      g_free (caps);
+    }
+
+  DEBUG ("loaded %u cached service details",
+      g_hash_table_size (priv->indexed_details));
+
+out:
+  g_variant_unref (entries);
+  g_variant_unref (cache);
+}
+
+static void
+save_details_cache (YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GVariantBuilder builder;
+  GVariant *cache;
+  GList *l;
+  GError *error = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(sasas)}"));
+
+  /* most recently used first, which is the order they come back in */
+  for (l = g_queue_peek_head_link (priv->details_lru); l != NULL;
+       l = l->next)
+    {
+      DetailsEntry *entry = g_hash_table_lookup (priv->indexed_details,
+          l->data);
+      ServiceRecord *record = entry->record;
+
+      g_variant_builder_add (&builder, "{s(s^as^as)}", l->data,
+          record->type, record->names, record->caps);
+    }
+
+  cache = g_variant_new ("(u@a{s(sasas)})", DETAILS_CACHE_VERSION,
+      g_variant_builder_end (&builder));
+  g_variant_ref_sink (cache);
+
+  if (!ytst_cache_save (DETAILS_CACHE_NAME, cache, &error))
+    {
+      DEBUG ("couldn't save service details cache: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  g_variant_unref (cache);
+}
+
+static gboolean
+save_details_cache_cb (gpointer user_data)
+{
+  YtstStatusStore *self = YTST_STATUS_STORE (user_data);
+
+  self->priv->details_cache_id = 0;
+  save_details_cache (self);
+
+  return FALSE;
+}
+
+/* Writes out a save that's still waiting to happen, if there is one */
+static void
+flush_details_cache (YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+
+  if (priv->details_cache_id != 0)
+    {
+      g_source_remove (priv->details_cache_id);
+      priv->details_cache_id = 0;
+      save_details_cache (self);
+    }
+}
+
+static void
+connection_status_changed_cb (TpBaseConnection *conn,
+    guint status,
+    guint reason,
+    YtstStatusStore *self)
+{
+  /* the next connection might be made before this one is gone */
+  if (status == TP_CONNECTION_STATUS_DISCONNECTED)
+    flush_details_cache (self);
+}
+
+static void
+details_cache_changed (YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+
+  if (priv->details_cache_id == 0)
+    priv->details_cache_id = g_timeout_add_seconds (
+        DETAILS_CACHE_SAVE_DELAY, save_details_cache_cb, self);
+}
+
+/* Remembers @record as what @uid was advertised in full as, so if
+ * anyone advertises the same thing compactly later, even after a
+ * restart, we needn't ask them for it */
+static void
+remember_service_details (YtstStatusStore *self,
+    const gchar *uid,
+    ServiceRecord *record)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  gchar *digest, *uid_digest;
+
+  digest = ytst_service_digest (uid, record->type,
+      (const gchar * const *) record->names,
+      (const gchar * const *) record->caps);
+  uid_digest = g_strdup_printf ("%s/%s", uid, digest);
+
+  if (lookup_details (self, uid_digest) == NULL)
+    {
+      insert_details (self, uid_digest, service_record_ref (record));
+      details_cache_changed (self);
+    }
+  else
+    {
+      g_free (uid_digest);
+    }
+
+  g_free (digest);
+}
+
+static WockyDataForm *
+get_local_service_form (YtstStatusStore *self,
+    const gchar *uid,
+    const gchar *digest)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  TpChannelManagerIter iter;
+  TpChannelManager *manager;
+
+  tp_base_connection_channel_manager_iter_init (&iter, priv->connection);
+  while (tp_base_connection_channel_manager_iter_next (&iter, &manager))
+    {
+      if (YTST_IS_CAPS_MANAGER (manager))
+        return ytst_caps_manager_get_service_form (
+            YTST_CAPS_MANAGER (manager), uid, digest);
+    }
+
+  return NULL;
+}
+
+/*
+ * Adds the details of @uid, advertised compactly by @contact, to
+ * @services if we already know them. Otherwise, get the transport to
+ * ask @contact for them, and return %FALSE; it calls
+ * ytst_status_store_add_details once they come back.
+ */
+static gboolean
+add_indexed_service (YtstStatusStore *self,
+    GObject *contact,
+    const gchar *jid,
+    GHashTable *services,
+    const gchar *uid,
+    const gchar *digest)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  ServiceRecord *record;
+  WockyDataForm *form;
+  gchar *uid_digest;
+  gboolean asked = FALSE;
+
+  uid_digest = g_strdup_printf ("%s/%s", uid, digest);
+
+  record = lookup_details (self, uid_digest);
+
+  if (record == NULL)
+    {
+      /* the same digest means the same details, so if it's one of ours
+       * (including when @contact is us) there's no need to ask */
+      form = get_local_service_form (self, uid, digest);
+
+      if (form != NULL)
+        {
+          record = service_record_from_form (self, form);
+          if (record != NULL)
+            insert_details (self, g_strdup (uid_digest), record);
+        }
+    }
+
+  if (record != NULL)
+    {
+      g_hash_table_insert (services, g_strdup (uid),
+          service_record_ref (record));
+      g_free (uid_digest);
+      return TRUE;
+    }
+
+  if (g_hash_table_lookup (priv->pending_details, uid_digest) != NULL)
+    {
+      g_free (uid_digest);
+      return FALSE;
+    }
+
+  g_signal_emit (self, signals[FETCH_DETAILS], 0, contact, jid, uid,
+      digest, &asked);
+
+  if (asked)
+    g_hash_table_insert (priv->pending_details, uid_digest,
+        GUINT_TO_POINTER (TRUE));
+  else
+    g_free (uid_digest);
+
+  return FALSE;
+}
+
+static void
+dropped_requests_changed_cb (YtstChannelManager *manager,
+    GParamSpec *pspec,
+    YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+
+  g_object_get (manager,
+      "dropped-requests", &priv->dropped_requests,
+      NULL);
+
+  /* a flood of these mustn't turn into a flood of signals */
+  priv->dropped_requests_changed = TRUE;
+  batch_schedule (self);
+}
+
+/* Forgets, and signals the end of, everything @jid advertised */
+static void
+forget_contact (YtstStatusStore *self,
+    const gchar *jid)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GPtrArray *no_forms;
+  GHashTable *keys;
+  GList *l, *statuses = NULL;
+
+  no_forms = g_ptr_array_new ();
+  ytst_status_store_update_services (self, NULL, jid, no_forms, TRUE);
+  g_ptr_array_unref (no_forms);
+
+  /* each key goes as its status is removed, so copy them first */
+  keys = g_hash_table_lookup (priv->contact_statuses,
+      pool_lookup (self, jid));
+
+  if (keys != NULL)
+    {
+      GHashTableIter iter;
+      gpointer key;
+
+      g_hash_table_iter_init (&iter, keys);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          StatusKey *status_key = key;
+
+          statuses = g_list_prepend (statuses,
+              g_strdup (status_key->service));
+          statuses = g_list_prepend (statuses,
+              g_strdup (status_key->capability));
+        }
+    }
+
+  for (l = statuses; l != NULL; l = l->next->next)
+    ytst_status_store_update_status (self, jid, l->data, l->next->data,
+        NULL);
+
+  g_list_foreach (statuses, (GFunc) g_free, NULL);
+  g_list_free (statuses);
+
+  g_hash_table_remove (priv->contact_digests, jid);
+}
+
+/* Contacts don't take back what they advertised when they go away, so
+ * this is when we let go of it */
+static void
+presences_changed_cb (GObject *connection,
+    GHashTable *presences,
+    YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  TpHandleRepoIface *handle_repo = tp_base_connection_get_handles (
+      priv->connection, TP_HANDLE_TYPE_CONTACT);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, presences);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      TpHandle handle = GPOINTER_TO_UINT (key);
+      guint type = g_value_get_uint (g_value_array_get_nth (value, 0));
+      const gchar *jid;
+
+      if (type != TP_CONNECTION_PRESENCE_TYPE_OFFLINE
+          || handle == tp_base_connection_get_self_handle (priv->connection)
+          || !tp_handle_is_valid (handle_repo, handle, NULL))
+        continue;
+
+      jid = tp_handle_inspect (handle_repo, handle);
+
+      DEBUG ("%s has gone, forgetting what they advertised", jid);
+      forget_contact (self, jid);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * OBJECT
+ */
+
+static void
+ytst_status_store_init (YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      YTST_TYPE_STATUS_STORE, YtstStatusStorePrivate);
+  self->priv = priv;
+}
+
+static void
+ytst_status_store_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  YtstStatusStore *self = YTST_STATUS_STORE (object);
+  YtstStatusStorePrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+      case PROP_CONNECTION:
+        g_value_set_object (value, priv->connection);
+        break;
+      case PROP_BATCH_WINDOW:
+        g_value_set_uint (value, priv->batch_window);
+        break;
+      case PROP_MIN_PUBLISH_INTERVAL:
+        g_value_set_uint (value, priv->min_publish_interval);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+ytst_status_store_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  YtstStatusStore *self = YTST_STATUS_STORE (object);
+  YtstStatusStorePrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+      case PROP_CONNECTION:
+        priv->connection = g_value_dup_object (value);
+        break;
+      case PROP_BATCH_WINDOW:
+        priv->batch_window = g_value_get_uint (value);
+        break;
+      case PROP_MIN_PUBLISH_INTERVAL:
+        priv->min_publish_interval = g_value_get_uint (value);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+ytst_status_store_constructed (GObject *object)
+{
+  YtstStatusStore *self = YTST_STATUS_STORE (object);
+  YtstStatusStorePrivate *priv = self->priv;
+  TpChannelManagerIter iter;
+  TpChannelManager *manager;
+
+  if (G_OBJECT_CLASS (ytst_status_store_parent_class)->constructed)
+    G_OBJECT_CLASS (ytst_status_store_parent_class)->constructed (object);
+
+  priv->strings = g_hash_table_new (g_str_hash, g_str_equal);
+
+  priv->discovered_statuses = g_hash_table_new_full (status_key_hash,
+      status_key_equal, status_key_free, g_free);
+
+  priv->discovered_services = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+
+  priv->contact_statuses = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, (GDestroyNotify) g_hash_table_unref);
+  priv->service_jids = g_sequence_new (pool_unref);
+  priv->status_jids = g_sequence_new (pool_unref);
+
+  priv->service_records = g_hash_table_new (g_str_hash, g_str_equal);
+
+  priv->capability_index = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, pool_unref, (GDestroyNotify) g_hash_table_unref);
+  priv->type_index = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, pool_unref, (GDestroyNotify) g_hash_table_unref);
+
+  priv->indexed_details = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, details_entry_free);
+  priv->details_lru = g_queue_new ();
+  priv->pending_details = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
+
+  /* so peers we've seen before don't need asking about their services
+   * again */
+  load_details_cache (self);
+  priv->contact_digests = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, g_free);
+
+  priv->batched_added = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+  priv->batched_removed = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+  priv->batched_statuses = g_hash_table_new_full (status_key_hash,
+      status_key_equal, status_key_free, g_free);
+
+  /* start from the time rather than 0 so versions from before we were
+   * restarted are (almost certainly) older than the log */
+  priv->change_version = g_get_real_time ();
+  priv->change_log_start = priv->change_version;
+  priv->change_log = g_queue_new ();
+
+  priv->publish_slots = g_hash_table_new_full (status_key_hash,
+      status_key_equal, status_key_free, publish_slot_free);
+  priv->ready = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, g_object_unref);
+
+  tp_g_signal_connect_object (priv->connection, "status-changed",
+      G_CALLBACK (connection_status_changed_cb), self, 0);
+
+  if (TP_IS_SVC_CONNECTION_INTERFACE_SIMPLE_PRESENCE (priv->connection))
+    tp_g_signal_connect_object (priv->connection, "presences-changed",
+        G_CALLBACK (presences_changed_cb), self, 0);
+
+  /* Pass on refused requests to handlers */
+  tp_base_connection_channel_manager_iter_init (&iter, priv->connection);
+  while (tp_base_connection_channel_manager_iter_next (&iter, &manager))
+    {
+      if (!YTST_IS_CHANNEL_MANAGER (manager))
+        continue;
+
+      tp_g_signal_connect_object (manager, "notify::dropped-requests",
+          G_CALLBACK (dropped_requests_changed_cb), self, 0);
+      g_object_get (manager,
+          "dropped-requests", &priv->dropped_requests,
+          NULL);
+    }
+
+  ytst_config_apply (object, "Status");
+}
+
+static void
+ytst_status_store_dispose (GObject *object)
+{
+  YtstStatusStore *self = YTST_STATUS_STORE (object);
+  YtstStatusStorePrivate *priv = self->priv;
+
+  if (priv->dispose_has_run)
+    return;
+
+  priv->dispose_has_run = TRUE;
+
+  tp_clear_pointer (&priv->discovered_statuses, g_hash_table_unref);
+
+  if (priv->batch_id != 0)
+    {
+      g_source_remove (priv->batch_id);
+      priv->batch_id = 0;
+    }
+
+  tp_clear_pointer (&priv->batched_added, g_hash_table_unref);
+  tp_clear_pointer (&priv->batched_removed, g_hash_table_unref);
+  tp_clear_pointer (&priv->batched_statuses, g_hash_table_unref);
+
+  tp_clear_pointer (&priv->ready, g_hash_table_unref);
+  tp_clear_pointer (&priv->publish_slots, g_hash_table_unref);
+
+  if (priv->change_log != NULL)
+    {
+      g_queue_foreach (priv->change_log, (GFunc) change_free, NULL);
+      g_queue_free (priv->change_log);
+      priv->change_log = NULL;
+    }
+
+  tp_clear_pointer (&priv->contact_statuses, g_hash_table_unref);
+  tp_clear_pointer (&priv->service_jids, g_sequence_free);
+  tp_clear_pointer (&priv->status_jids, g_sequence_free);
+  tp_clear_pointer (&priv->capability_index, g_hash_table_unref);
+  tp_clear_pointer (&priv->type_index, g_hash_table_unref);
+  tp_clear_pointer (&priv->discovered_services, g_hash_table_unref);
+
+  flush_details_cache (self);
+  tp_clear_pointer (&priv->indexed_details, g_hash_table_unref);
+  tp_clear_pointer (&priv->details_lru, g_queue_free);
+  /* whatever's left in here goes with the last reference to it */
+  tp_clear_pointer (&priv->service_records, g_hash_table_unref);
+  tp_clear_pointer (&priv->pending_details, g_hash_table_unref);
+  tp_clear_pointer (&priv->contact_digests, g_hash_table_unref);
+  /* and whatever's left in here goes with the last key mentioning it */
+  tp_clear_pointer (&priv->strings, g_hash_table_unref);
+
+  tp_clear_object (&priv->connection);
+
+  if (G_OBJECT_CLASS (ytst_status_store_parent_class)->dispose)
+    G_OBJECT_CLASS (ytst_status_store_parent_class)->dispose (object);
+}
+
+static void
+ytst_status_store_class_init (YtstStatusStoreClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GParamSpec *param_spec;
+
+  g_type_class_add_private (klass, sizeof (YtstStatusStorePrivate));
+
+  object_class->dispose = ytst_status_store_dispose;
+  object_class->constructed = ytst_status_store_constructed;
+  object_class->get_property = ytst_status_store_get_property;
+  object_class->set_property = ytst_status_store_set_property;
+
+  param_spec = g_param_spec_object (
+      "connection",
+      "Connection",
+      "The connection whose peers' services and statuses these are",
+      TP_TYPE_BASE_CONNECTION,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_CONNECTION,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "batch-window",
+      "Batch window",
+      "How long to collect changes for, in milliseconds, before emitting "
+      "them together in ServicesChanged, StatusesChanged and "
+      "DroppedRequestsChanged",
+      0, G_MAXUINT, DEFAULT_BATCH_WINDOW,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_BATCH_WINDOW,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "min-publish-interval",
+      "Minimum publish interval",
+      "The least time, in milliseconds, between publishing two statuses "
+      "for the same capability and service. Statuses which come in "
+      "quicker than that are held back, and only the latest is sent.",
+      0, G_MAXUINT, DEFAULT_MIN_PUBLISH_INTERVAL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_MIN_PUBLISH_INTERVAL,
+      param_spec);
+
+  /* Contact, Service, Details */
+  signals[SERVICE_ADDED] = g_signal_new ("service-added",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 3,
+      G_TYPE_STRING, G_TYPE_STRING, G_TYPE_VALUE_ARRAY);
+
+  /* Contact, Service */
+  signals[SERVICE_REMOVED] = g_signal_new ("service-removed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 2,
+      G_TYPE_STRING, G_TYPE_STRING);
+
+  /* Contact, Capability, Service, Status */
+  signals[STATUS_CHANGED] = g_signal_new ("status-changed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 4,
+      G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+
+  /* Added, Removed: the batched changes, shaped for ServicesChanged */
+  signals[SERVICES_CHANGED] = g_signal_new ("services-changed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 2,
+      G_TYPE_HASH_TABLE, G_TYPE_HASH_TABLE);
+
+  /* Statuses, shaped for StatusesChanged */
+  signals[STATUSES_CHANGED] = g_signal_new ("statuses-changed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 1,
+      G_TYPE_HASH_TABLE);
+
+  /* Dropped */
+  signals[DROPPED_REQUESTS_CHANGED] = g_signal_new (
+      "dropped-requests-changed",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 1,
+      G_TYPE_UINT);
+
+  /* Contact, Jid, Uid, Digest: the transport should ask the contact
+   * for the details of a compactly advertised service, and return
+   * whether it has */
+  signals[FETCH_DETAILS] = g_signal_new ("fetch-details",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, g_signal_accumulator_true_handled, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_BOOLEAN, 4,
+      G_TYPE_OBJECT, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+
+  /* Capability, Status trees: the transport should publish these */
+  signals[SEND_STATUSES] = g_signal_new ("send-statuses",
+      G_OBJECT_CLASS_TYPE (klass),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_generic,
+      G_TYPE_NONE, 2,
+      G_TYPE_STRING, G_TYPE_PTR_ARRAY);
+}
+
+/* -----------------------------------------------------------------------------
+ * PUBLIC METHODS
+ */
+
+YtstStatusStore *
+ytst_status_store_new (TpBaseConnection *connection)
+{
+  return g_object_new (YTST_TYPE_STATUS_STORE,
+      "connection", connection,
+      NULL);
+}
+
+/* Looks again at what @contact, which is @jid, advertises in
+ * @data_forms, and records and signals whatever has changed since last
+ * time. The initial scan passes %FALSE for @do_signal; it still goes in
+ * the change log. */
+void
+ytst_status_store_update_services (YtstStatusStore *self,
+    GObject *contact,
+    const gchar *jid,
+    const GPtrArray *data_forms,
+    gboolean do_signal)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  guint i;
+  GHashTable *old, *new;
+  GHashTableIter iter;
+  gpointer key, value;
+  const gchar *old_digest;
+  gchar *digest;
+  /* whether we have the details of everything they advertise */
+  gboolean complete = TRUE;
+
+  /* Caps change all the time for things we don't care about */
+  digest = dup_forms_digest (data_forms);
+  old_digest = g_hash_table_lookup (priv->contact_digests, jid);
+
+  if (!tp_strdiff (digest, old_digest))
+    {
+      g_free (digest);
+      return;
+    }
+
+  old = g_hash_table_lookup (priv->discovered_services, jid);
+
+  new = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) service_record_unref);
+
+  for (i = 0; i < data_forms->len; i++)
+    {
+      WockyDataForm *form = g_ptr_array_index (data_forms, i);
+      WockyDataFormField *type, *tmp;
+      const gchar *form_type;
+      ServiceRecord *record;
+
+      type = g_hash_table_lookup (form->fields, "FORM_TYPE");
+
+      if (type == NULL
+          || type->type != WOCKY_DATA_FORM_FIELD_TYPE_HIDDEN)
+        continue;
+
+      form_type = g_value_get_string (type->default_value);
+
+      if (g_str_has_prefix (form_type, SERVICE_PREFIX))
+        {
+          const gchar *service = form_type + strlen (SERVICE_PREFIX);
+
+          /* only look properly at forms which have changed */
+          record = old != NULL ? g_hash_table_lookup (old, service) : NULL;
+
+          if (record != NULL && service_record_matches_form (record, form))
+            {
+              service_record_ref (record);
+            }
+          else
+            {
+              record = service_record_from_form (self, form);
+
+              if (record != NULL)
+                remember_service_details (self, service, record);
+            }
+
+          if (record != NULL)
+            g_hash_table_insert (new, g_strdup (service), record);
+        }
+      else if (!tp_strdiff (form_type, YTST_INDEX_NS))
+        {
+          /* a summary of all their services */
+          tmp = g_hash_table_lookup (form->fields, "services");
+
+          if (tmp != NULL && tmp->raw_value_contents != NULL
+              && tmp->type == WOCKY_DATA_FORM_FIELD_TYPE_TEXT_MULTI)
+            {
+              gchar **entry;
+
+              for (entry = tmp->raw_value_contents; *entry != NULL; entry++)
+                {
+                  gchar **parts = g_strsplit (*entry, "/", 2);
+
+                  if (parts[0] != NULL && parts[1] != NULL
+                      && !add_indexed_service (self, contact, jid, new,
+                          parts[0], parts[1]))
+                    complete = FALSE;
+
+                  g_strfreev (parts);
+                }
+            }
+        }
+      else if (g_str_has_prefix (form_type, INDEX_PREFIX))
+        {
+          /* just the one service */
+          tmp = g_hash_table_lookup (form->fields, "digest");
+
+          if (tmp != NULL && tmp->default_value != NULL
+              && tmp->type == WOCKY_DATA_FORM_FIELD_TYPE_TEXT_SINGLE
+              && !add_indexed_service (self, contact, jid, new,
+                  form_type + strlen (INDEX_PREFIX),
+                  g_value_get_string (tmp->default_value)))
+            complete = FALSE;
+        }
+    }
+
+  /* Every change goes in the change log, so GetChangesSince has the
+   * whole story; the initial scan just doesn't signal them. First
+   * check for services in old but not in new; they've been removed.
+   * old can be NULL. */
+  if (old != NULL)
+    {
+      g_hash_table_iter_init (&iter, old);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          if (g_hash_table_lookup (new, key) != NULL)
+            continue;
+
+          if (do_signal)
+            {
+              g_signal_emit (self, signals[SERVICE_REMOVED], 0, jid, key);
+              batch_service_removed (self, jid, key);
+            }
+          else
+            {
+              log_change (self, CHANGE_SERVICE_REMOVED, jid, NULL, key,
+                  NULL, NULL);
+            }
+        }
+    }
+
+  /* next check for services in new but not in old, which have been
+   * added, and ones in both with different details; records are
+   * shared, so if the details are the same so is the record */
+  g_hash_table_iter_init (&iter, new);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      ServiceRecord *old_record = NULL;
+
+      if (old != NULL)
+        old_record = g_hash_table_lookup (old, key);
+
+      if (old_record == value)
+        continue;
+
+      if (do_signal)
+        {
+          /* the old signal only ever said a service had arrived */
+          if (old_record == NULL)
+            g_signal_emit (self, signals[SERVICE_ADDED], 0, jid, key,
+                service_record_get_details (value));
+
+          batch_service_added (self, jid, key, value);
+        }
+      else
+        {
+          log_change (self, CHANGE_SERVICE_ADDED, jid, NULL, key, value,
+              NULL);
+        }
+    }
+
+  /* keep the indexes in step, while the old records are still around */
+  if (old != NULL)
+    {
+      g_hash_table_iter_init (&iter, old);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        reindex_service (self, jid, key, value,
+            g_hash_table_lookup (new, key));
+    }
+
+  g_hash_table_iter_init (&iter, new);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (old == NULL || g_hash_table_lookup (old, key) == NULL)
+        reindex_service (self, jid, key, NULL, value);
+    }
+
+  if (g_hash_table_size (new) > 0)
+    {
+      if (old == NULL)
+        sorted_jids_add (self, priv->service_jids, jid);
+
+      g_hash_table_replace (priv->discovered_services,
+          g_strdup (jid), new);
+    }
+  else
+    {
+      if (old != NULL)
+        sorted_jids_remove (priv->service_jids, jid);
+
+      g_hash_table_remove (priv->discovered_services, jid);
+      g_hash_table_unref (new);
+    }
+
+  /* the same forms need looking at again once the details we asked
+   * for come back */
+  if (complete)
+    g_hash_table_replace (priv->contact_digests, g_strdup (jid), digest);
+  else
+    {
+      g_hash_table_remove (priv->contact_digests, jid);
+      g_free (digest);
+    }
+}
+
+/* Called by the transport with the details of @uid it fetched because
+ * of ::fetch-details, or with %NULL for @form if it couldn't get them.
+ * Returns whether they were good, in which case whoever advertised them
+ * wants looking at again. */
+gboolean
+ytst_status_store_add_details (YtstStatusStore *self,
+    const gchar *uid,
+    const gchar *digest,
+    WockyDataForm *form)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  ServiceRecord *record;
+  gchar *uid_digest;
+
+  uid_digest = g_strdup_printf ("%s/%s", uid, digest);
+  g_hash_table_remove (priv->pending_details, uid_digest);
+
+  if (form == NULL || !form_matches_digest (form, uid, digest))
+    {
+      DEBUG ("got bad details for %s", uid);
+      g_free (uid_digest);
+      return FALSE;
+    }
+
+  record = service_record_from_form (self, form);
+  if (record != NULL)
+    {
+      insert_details (self, uid_digest, record);
+      details_cache_changed (self);
+    }
+  else
+    {
+      g_free (uid_digest);
+    }
+
+  return TRUE;
+}
+
+void
+ytst_status_store_update_status (YtstStatusStore *self,
+    const gchar *jid,
+    const gchar *capability,
+    const gchar *service,
+    const gchar *status)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  StatusKey lookup;
+  const gchar *old_status;
+  gboolean emit = FALSE;
+
+  lookup.contact = pool_lookup (self, jid);
+  lookup.capability = pool_lookup (self, capability);
+  lookup.service = pool_lookup (self, service);
+
+  old_status = g_hash_table_lookup (priv->discovered_statuses, &lookup);
+
+  /* Save this value as old_status will be freed when we call
+   * g_hash_table_insert next and the spec says we need to update the
+   * property before emitting the signal. In reality this wouldn't be
+   * a problem, but let's be nice. */
+  emit = tp_strdiff (old_status, status);
+
+  if (status != NULL)
+    {
+      StatusKey *key = status_key_new (self, jid, capability, service);
+
+      /* this keeps the key that's already there, if there is one */
+      g_hash_table_insert (priv->discovered_statuses, key,
+          g_strdup (status));
+
+      if (old_status == NULL)
+        contact_status_added (self, key);
+    }
+  else if (old_status != NULL)
+    {
+      gpointer key;
+
+      g_hash_table_lookup_extended (priv->discovered_statuses, &lookup,
+          &key, NULL);
+      contact_status_removed (self, key);
+      g_hash_table_remove (priv->discovered_statuses, &lookup);
+    }
+
+  if (emit)
+    {
+      g_signal_emit (self, signals[STATUS_CHANGED], 0, jid, capability,
+          service, status);
+
+      batch_status_change (self, jid, capability, service, status);
+    }
+}
+
+guint
+ytst_status_store_get_dropped_requests (YtstStatusStore *self)
+{
+  return self->priv->dropped_requests;
+}
+
+/* Builds the a{sa{sa{ss}}} DiscoveredStatuses is on D-Bus */
+GHashTable *
+ytst_status_store_dup_statuses (YtstStatusStore *self)
+{
+  return dup_status_map (self->priv->discovered_statuses);
+}
+
+/* Builds the a{sa{s(sa{ss}as)}} DiscoveredServices is on D-Bus */
+GHashTable *
+ytst_status_store_dup_services (YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GHashTable *out;
+  GHashTableIter iter;
+  gpointer jid, records;
+
+  out = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+
+  if (priv->discovered_services == NULL)
+    return out;
+
+  g_hash_table_iter_init (&iter, priv->discovered_services);
+  while (g_hash_table_iter_next (&iter, &jid, &records))
+    g_hash_table_insert (out, g_strdup (jid), dup_services_map (records));
+
+  return out;
+}
+
+/* Builds the a{sa{ss}} of @jid's statuses */
+GHashTable *
+ytst_status_store_dup_contact_statuses (YtstStatusStore *self,
+    const gchar *jid)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GHashTable *out = new_capability_service_map ();
+  GHashTable *keys;
+  GHashTableIter iter;
+  gpointer key;
+
+  keys = g_hash_table_lookup (priv->contact_statuses,
+      pool_lookup (self, jid));
+
+  if (keys == NULL)
+    return out;
+
+  g_hash_table_iter_init (&iter, keys);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    add_to_capability_service_map (out, key,
+        g_hash_table_lookup (priv->discovered_statuses, key));
+
+  return out;
+}
+
+/* Builds the a{s(sa{ss}as)} of @jid's services */
+GHashTable *
+ytst_status_store_dup_contact_services (YtstStatusStore *self,
+    const gchar *jid)
+{
+  return dup_services_map (
+      g_hash_table_lookup (self->priv->discovered_services, jid));
+}
+
+GHashTable *
+ytst_status_store_find_services_by_capability (YtstStatusStore *self,
+    const gchar *capability)
+{
+  return dup_indexed_services (self, self->priv->capability_index,
+      capability);
+}
+
+GHashTable *
+ytst_status_store_find_services_by_type (YtstStatusStore *self,
+    const gchar *type)
+{
+  return dup_indexed_services (self, self->priv->type_index, type);
+}
+
+GHashTable *
+ytst_status_store_dup_statuses_page (YtstStatusStore *self,
+    const gchar *cursor,
+    guint limit,
+    const gchar **next)
+{
+  GHashTable *statuses;
+  GPtrArray *jids;
+  guint i;
+
+  jids = page_jids (self->priv->status_jids, cursor, limit, next);
+
+  statuses = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+
+  for (i = 0; i < jids->len; i++)
+    {
+      const gchar *jid = g_ptr_array_index (jids, i);
+
+      g_hash_table_insert (statuses, g_strdup (jid),
+          ytst_status_store_dup_contact_statuses (self, jid));
+    }
+
+  g_ptr_array_unref (jids);
+
+  return statuses;
+}
+
+GHashTable *
+ytst_status_store_dup_services_page (YtstStatusStore *self,
+    const gchar *cursor,
+    guint limit,
+    const gchar **next)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GHashTable *services;
+  GPtrArray *jids;
+  guint i;
+
+  jids = page_jids (priv->service_jids, cursor, limit, next);
+
+  services = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+
+  for (i = 0; i < jids->len; i++)
+    {
+      const gchar *jid = g_ptr_array_index (jids, i);
+
+      g_hash_table_insert (services, g_strdup (jid), dup_services_map (
+              g_hash_table_lookup (priv->discovered_services, jid)));
+    }
+
+  g_ptr_array_unref (jids);
+
+  return services;
+}
+
+/* Adds up every change since @since into what GetChangesSince returns,
+ * and returns the current version */
+guint64
+ytst_status_store_get_changes_since (YtstStatusStore *self,
+    guint64 since,
+    gboolean *complete,
+    GHashTable **added,
+    GHashTable **removed,
+    GHashTable **statuses)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GHashTable *added_in, *removed_in, *statuses_in;
+  GHashTableIter iter, services_iter;
+  gpointer jid, services, service;
+  GList *l, *first = NULL;
+
+  /* the same shapes as batched_added, batched_removed and
+   * batched_statuses, so the changes add up the same way */
+  added_in = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+  removed_in = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+  statuses_in = g_hash_table_new_full (status_key_hash,
+      status_key_equal, status_key_free, g_free);
+
+  /* otherwise the log has gone past them, or they're talking about
+   * someone else's versions; either way they need to start again from
+   * DiscoveredServices and DiscoveredStatuses */
+  *complete = (since >= priv->change_log_start
+      && since <= priv->change_version);
+
+  if (*complete)
+    {
+      for (l = g_queue_peek_tail_link (priv->change_log);
+           l != NULL && ((Change *) l->data)->version > since;
+           l = l->prev)
+        first = l;
+    }
+
+  for (l = first; l != NULL; l = l->next)
+    {
+      Change *change = l->data;
+
+      switch (change->kind)
+        {
+          case CHANGE_SERVICE_ADDED:
+            batch_service_change (removed_in, added_in, change->key.contact,
+                change->key.service, change->record);
+            break;
+          case CHANGE_SERVICE_REMOVED:
+            batch_service_change (added_in, removed_in, change->key.contact,
+                change->key.service, NULL);
+            break;
+          case CHANGE_STATUS:
+            g_hash_table_replace (statuses_in,
+                status_key_new (self, change->key.contact,
+                    change->key.capability, change->key.service),
+                g_strdup (change->status));
+            break;
+        }
+    }
+
+  DEBUG ("changes since %" G_GUINT64_FORMAT " up to %" G_GUINT64_FORMAT
+      "%s", since, priv->change_version, *complete ? "" : " are gone");
+
+  /* unlike the batched tables, these outlive what they're built from */
+  *added = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_hash_table_unref);
+
+  g_hash_table_iter_init (&iter, added_in);
+  while (g_hash_table_iter_next (&iter, &jid, &services))
+    g_hash_table_insert (*added, g_strdup (jid), dup_services_map (services));
+
+  *removed = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_strfreev);
+
+  g_hash_table_iter_init (&iter, removed_in);
+  while (g_hash_table_iter_next (&iter, &jid, &services))
+    {
+      gchar **strv = g_new0 (gchar *, g_hash_table_size (services) + 1);
+      guint i = 0;
+
+      g_hash_table_iter_init (&services_iter, services);
+      while (g_hash_table_iter_next (&services_iter, &service, NULL))
+        strv[i++] = g_strdup (service);
+
+      g_hash_table_insert (*removed, g_strdup (jid), strv);
+    }
+
+  *statuses = dup_status_map (statuses_in);
+
+  g_hash_table_unref (added_in);
+  g_hash_table_unref (removed_in);
+  g_hash_table_unref (statuses_in);
+
+  return priv->change_version;
+}
+
+static WockyNodeTree *
+parse_status_body (const gchar *body,
+    GError **error)
+{
+  WockyXmppReader *reader;
+  WockyNodeTree *tree;
+  GError *err = NULL;
+
+  reader = wocky_xmpp_reader_new_no_stream ();
+  wocky_xmpp_reader_push (reader, (guint8 *) body, strlen (body));
+  tree = WOCKY_NODE_TREE (wocky_xmpp_reader_pop_stanza (reader));
+  g_object_unref (reader);
+
+  if (tree == NULL)
+    {
+      err = wocky_xmpp_reader_get_error (reader);
+      g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "Invalid XML%s%s",
+          err != NULL && err->message != NULL ? ": " : ".",
+          err != NULL && err->message != NULL ? err->message : "");
+      g_clear_error (&err);
+    }
+
+  return tree;
+}
+
+/* Checks the arguments of AdvertiseStatus and makes the <status/> to
+ * publish out of them */
+WockyNodeTree *
+ytst_status_tree_new (const gchar *capability,
+    const gchar *service,
+    const gchar *status,
+    GError **error)
+{
+  WockyNodeTree *status_tree;
+  WockyNode *status_node;
+
+  if (tp_str_empty (capability))
+    {
+      g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "Capability argument must be set");
+      return NULL;
+    }
+
+  if (tp_str_empty (service))
+    {
+      g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "Service name argument must be set");
+      return NULL;
+    }
+
+  if (!tp_str_empty (status))
+    {
+      status_tree = parse_status_body (status, error);
+      if (status_tree == NULL)
+        return NULL;
+    }
+  else
+    {
+      status_tree = wocky_node_tree_new ("status", YTST_STATUS_NS, NULL);
+    }
+
+  status_node = wocky_node_tree_get_top_node (status_tree);
+
+  wocky_node_set_attribute (status_node, "from-service", service);
+  wocky_node_set_attribute (status_node, "capability", capability);
+
+  return status_tree;
+}
+
+/* Publishes @status_tree, taking ownership of it, unless one for the
+ * same capability and service went out too recently; then it waits,
+ * replacing anything else that was already waiting, so the latest one
+ * always gets there in the end. Either way it goes out through
+ * ::send-statuses.
+ *
+ * While publishing is frozen, ones which can go now are kept back
+ * until it's thawed, and then sent together, a capability at a time;
+ * if the same capability and service comes up twice only the last
+ * one counts. */
+void
+ytst_status_store_publish (YtstStatusStore *self,
+    const gchar *capability,
+    const gchar *service,
+    WockyNodeTree *status_tree)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  StatusKey key = { NULL, NULL, NULL };
+  PublishSlot *slot;
+  GPtrArray *status_trees;
+  gint64 now, next;
+
+  key.capability = pool_lookup (self, capability);
+  key.service = pool_lookup (self, service);
+
+  slot = g_hash_table_lookup (priv->publish_slots, &key);
+
+  if (slot == NULL)
+    {
+      slot = g_slice_new0 (PublishSlot);
+      slot->self = self;
+      slot->capability = pool_ref (self, capability);
+      slot->service = pool_ref (self, service);
+      g_hash_table_insert (priv->publish_slots,
+          status_key_new (self, NULL, capability, service), slot);
+    }
+
+  if (slot->timeout_id != 0)
+    {
+      DEBUG ("replacing status for %s/%s which hasn't gone out yet",
+          capability, service);
+      g_object_unref (slot->pending);
+      slot->pending = status_tree;
+      return;
+    }
+
+  if (priv->publish_freeze > 0
+      && g_hash_table_lookup (priv->ready, slot) != NULL)
+    {
+      g_hash_table_replace (priv->ready, slot, status_tree);
+      return;
+    }
+
+  now = g_get_monotonic_time ();
+  next = slot->last_sent + (gint64) priv->min_publish_interval * 1000;
+
+  if (slot->last_sent == 0 || now >= next)
+    {
+      slot->last_sent = now;
+
+      if (priv->publish_freeze > 0)
+        {
+          g_hash_table_insert (priv->ready, slot, status_tree);
+        }
+      else
+        {
+          status_trees = g_ptr_array_new_with_free_func (g_object_unref);
+          g_ptr_array_add (status_trees, status_tree);
+          send_statuses (self, slot->capability, status_trees);
+          g_ptr_array_unref (status_trees);
+        }
+
+      return;
+    }
+
+  DEBUG ("holding status for %s/%s back for %" G_GINT64_FORMAT " ms",
+      capability, service, (next - now) / 1000);
+
+  slot->pending = status_tree;
+  slot->timeout_id = g_timeout_add ((next - now + 999) / 1000,
+      publish_timeout_cb, slot);
+}
+
+void
+ytst_status_store_freeze_publishing (YtstStatusStore *self)
+{
+  self->priv->publish_freeze++;
+}
+
+void
+ytst_status_store_thaw_publishing (YtstStatusStore *self)
+{
+  YtstStatusStorePrivate *priv = self->priv;
+  GHashTable *by_capability;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_return_if_fail (priv->publish_freeze > 0);
+
+  if (--priv->publish_freeze > 0)
+    return;
+
+  /* GHashTable<pooled gchar *capability, GPtrArray<WockyNodeTree*>> */
+  by_capability = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) g_ptr_array_unref);
+
+  g_hash_table_iter_init (&iter, priv->ready);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      PublishSlot *slot = key;
+      GPtrArray *status_trees = g_hash_table_lookup (by_capability,
+          slot->capability);
+
+      if (status_trees == NULL)
+        {
+          status_trees = g_ptr_array_new_with_free_func (g_object_unref);
+          g_hash_table_insert (by_capability, (gpointer) slot->capability,
+              status_trees);
+        }
+
+      /* the array takes this one */
+      g_hash_table_iter_steal (&iter);
+      g_ptr_array_add (status_trees, value);
+    }
+
+  g_hash_table_iter_init (&iter, by_capability);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    send_statuses (self, key, value);
+
+  g_hash_table_unref (by_capability);
+}
@@ -0,0 +1,138 @@
+/*
+ * status-store.h - Header for YtstStatusStore
+ * Copyright (C) 2011 Intel, Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __YTST_STATUS_STORE_H__
+#define __YTST_STATUS_STORE_H__
+
+#include <glib-object.h>
+
+#include <telepathy-glib/base-connection.h>
+
+#include <wocky/wocky.h>
+
+G_BEGIN_DECLS
+
+typedef struct _YtstStatusStore YtstStatusStore;
+typedef struct _YtstStatusStoreClass YtstStatusStoreClass;
+typedef struct _YtstStatusStorePrivate YtstStatusStorePrivate;
+
+struct _YtstStatusStoreClass {
+  GObjectClass parent_class;
+};
+
+struct _YtstStatusStore {
+  GObject parent;
+  YtstStatusStorePrivate *priv;
+};
+
+GType ytst_status_store_get_type (void);
+
+/* TYPE MACROS */
+#define YTST_TYPE_STATUS_STORE \
+  (ytst_status_store_get_type ())
+#define YTST_STATUS_STORE(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), YTST_TYPE_STATUS_STORE, \
+                              YtstStatusStore))
+#define YTST_STATUS_STORE_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass), YTST_TYPE_STATUS_STORE, \
+                           YtstStatusStoreClass))
+#define YTST_IS_STATUS_STORE(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), YTST_TYPE_STATUS_STORE))
+#define YTST_IS_STATUS_STORE_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass), YTST_TYPE_STATUS_STORE))
+#define YTST_STATUS_STORE_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), YTST_TYPE_STATUS_STORE, \
+                              YtstStatusStoreClass))
+
+YtstStatusStore * ytst_status_store_new (TpBaseConnection *connection);
+
+/* What peers advertise, as the transport hears about it */
+void ytst_status_store_update_services (YtstStatusStore *self,
+    GObject *contact,
+    const gchar *jid,
+    const GPtrArray *data_forms,
+    gboolean do_signal);
+
+gboolean ytst_status_store_add_details (YtstStatusStore *self,
+    const gchar *uid,
+    const gchar *digest,
+    WockyDataForm *form);
+
+void ytst_status_store_update_status (YtstStatusStore *self,
+    const gchar *jid,
+    const gchar *capability,
+    const gchar *service,
+    const gchar *status);
+
+guint ytst_status_store_get_dropped_requests (YtstStatusStore *self);
+
+/* Copies of what we know, shaped the way Status and Status.FUTURE have
+ * them on D-Bus */
+GHashTable * ytst_status_store_dup_statuses (YtstStatusStore *self);
+
+GHashTable * ytst_status_store_dup_services (YtstStatusStore *self);
+
+GHashTable * ytst_status_store_dup_contact_statuses (YtstStatusStore *self,
+    const gchar *jid);
+
+GHashTable * ytst_status_store_dup_contact_services (YtstStatusStore *self,
+    const gchar *jid);
+
+GHashTable * ytst_status_store_find_services_by_capability (
+    YtstStatusStore *self,
+    const gchar *capability);
+
+GHashTable * ytst_status_store_find_services_by_type (YtstStatusStore *self,
+    const gchar *type);
+
+GHashTable * ytst_status_store_dup_statuses_page (YtstStatusStore *self,
+    const gchar *cursor,
+    guint limit,
+    const gchar **next);
+
+GHashTable * ytst_status_store_dup_services_page (YtstStatusStore *self,
+    const gchar *cursor,
+    guint limit,
+    const gchar **next);
+
+guint64 ytst_status_store_get_changes_since (YtstStatusStore *self,
+    guint64 since,
+    gboolean *complete,
+    GHashTable **added,
+    GHashTable **removed,
+    GHashTable **statuses);
+
+/* Our own statuses */
+WockyNodeTree * ytst_status_tree_new (const gchar *capability,
+    const gchar *service,
+    const gchar *status,
+    GError **error);
+
+void ytst_status_store_publish (YtstStatusStore *self,
+    const gchar *capability,
+    const gchar *service,
+    WockyNodeTree *status_tree);
+
+void ytst_status_store_freeze_publishing (YtstStatusStore *self);
+
+void ytst_status_store_thaw_publishing (YtstStatusStore *self);
+
+G_END_DECLS
+
+#endif /* #ifndef __YTST_STATUS_STORE_H__*/
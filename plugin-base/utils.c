@@ -22,8 +22,16 @@
 
 #include "utils.h"
 
+#include <errno.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+
 #include <telepathy-ytstenut-glib/telepathy-ytstenut-glib.h>
 
+#define DEBUG(msg, ...) \
+  g_debug ("%s: " msg, G_STRFUNC, ##__VA_ARGS__)
+
 GQuark
 ytst_message_error_quark (void)
 {
@@ -124,3 +132,248 @@ ytst_message_error_type_from_wocky (gint wocky_type)
         g_return_val_if_reached (0);
     }
 }
+
+static gint
+compare_strings (gconstpointer a,
+    gconstpointer b)
+{
+  return g_strcmp0 (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+static void
+checksum_update_sorted (GChecksum *checksum,
+    const gchar * const *strv)
+{
+  GPtrArray *sorted = g_ptr_array_new ();
+  const gchar * const *s;
+  guint i;
+
+  for (s = strv; s != NULL && *s != NULL; s++)
+    g_ptr_array_add (sorted, (gpointer) *s);
+
+  g_ptr_array_sort (sorted, compare_strings);
+
+  for (i = 0; i < sorted->len; i++)
+    {
+      const gchar *str = g_ptr_array_index (sorted, i);
+
+      g_checksum_update (checksum, (const guchar *) str, strlen (str));
+      g_checksum_update (checksum, (const guchar *) "\n", 1);
+    }
+
+  g_checksum_update (checksum, (const guchar *) "", 1);
+
+  g_ptr_array_unref (sorted);
+}
+
+/* Digest of what a service's data form says, so a compact summary can
+ * tell peers whether what they fetched before is still current. Order
+ * of names and caps doesn't matter. */
+gchar *
+ytst_service_digest (const gchar *uid,
+    const gchar *type,
+    const gchar * const *names,
+    const gchar * const *caps)
+{
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  gchar *out;
+
+  g_checksum_update (checksum, (const guchar *) uid, strlen (uid) + 1);
+  g_checksum_update (checksum, (const guchar *) type, strlen (type) + 1);
+  checksum_update_sorted (checksum, names);
+  checksum_update_sorted (checksum, caps);
+
+  out = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return out;
+}
+
+static gchar *
+cache_path (const gchar *name)
+{
+  return g_build_filename (g_get_user_cache_dir (), "ytstenut", name, NULL);
+}
+
+/* Maps the cache file @name, as written by ytst_cache_save(), and
+ * returns what's in it without copying it, or %NULL if it isn't there
+ * or isn't a valid @type. */
+GVariant *
+ytst_cache_load (const gchar *name,
+    const GVariantType *type,
+    GError **error)
+{
+  gchar *path = cache_path (name);
+  GMappedFile *file;
+  GVariant *boxed, *value;
+
+  file = g_mapped_file_new (path, FALSE, error);
+  g_free (path);
+
+  if (file == NULL)
+    return NULL;
+
+  if (g_mapped_file_get_length (file) == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+          "%s is empty", name);
+      g_mapped_file_unref (file);
+      return NULL;
+    }
+
+  /* the variant keeps the file mapped for as long as it's around */
+  boxed = g_variant_new_from_data (G_VARIANT_TYPE_VARIANT,
+      g_mapped_file_get_contents (file), g_mapped_file_get_length (file),
+      FALSE, (GDestroyNotify) g_mapped_file_unref, file);
+  g_variant_ref_sink (boxed);
+
+  /* anything could have happened to it on disk, so don't let a broken
+   * one anywhere near the deserialiser's slow paths */
+  if (!g_variant_is_normal_form (boxed))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+          "%s is corrupt", name);
+      g_variant_unref (boxed);
+      return NULL;
+    }
+
+  /* and it might have been written by something else entirely */
+  value = g_variant_get_variant (boxed);
+  g_variant_unref (boxed);
+
+  if (!g_variant_is_of_type (value, type))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+          "%s holds a %s, not a %.*s", name, g_variant_get_type_string (value),
+          (gint) g_variant_type_get_string_length (type),
+          g_variant_type_peek_string (type));
+      g_variant_unref (value);
+      return NULL;
+    }
+
+  return value;
+}
+
+/* Atomically replaces the cache file @name with @value */
+gboolean
+ytst_cache_save (const gchar *name,
+    GVariant *value,
+    GError **error)
+{
+  gchar *path = cache_path (name);
+  gchar *dir = g_path_get_dirname (path);
+  GVariant *boxed = g_variant_ref_sink (g_variant_new_variant (value));
+  gboolean ret = FALSE;
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+          "Couldn't create %s: %s", dir, g_strerror (saved_errno));
+      goto out;
+    }
+
+  /* boxed, so what it holds is written down along with it */
+  ret = g_file_set_contents (path, g_variant_get_data (boxed),
+      g_variant_get_size (boxed), error);
+
+out:
+  g_variant_unref (boxed);
+  g_free (dir);
+  g_free (path);
+  return ret;
+}
+
+/* Sets the properties of @object named by the keys in @group of
+ * $XDG_CONFIG_HOME/ytstenut/plugins.conf, for tuning things that have
+ * no D-Bus API. Only writable boolean and unsigned integer properties
+ * can be set; anything else is ignored and logged. */
+void
+ytst_config_apply (GObject *object,
+    const gchar *group)
+{
+  gchar *path = g_build_filename (g_get_user_config_dir (), "ytstenut",
+      "plugins.conf", NULL);
+  GKeyFile *key_file = g_key_file_new ();
+  GError *error = NULL;
+  gchar **keys = NULL;
+  guint i;
+
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error))
+    {
+      /* not having one at all is the usual case */
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        DEBUG ("Couldn't read %s: %s", path, error->message);
+
+      goto out;
+    }
+
+  keys = g_key_file_get_keys (key_file, group, NULL, NULL);
+
+  for (i = 0; keys != NULL && keys[i] != NULL; i++)
+    {
+      GParamSpec *pspec;
+      GValue value = { 0, };
+
+      pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (object),
+          keys[i]);
+
+      if (pspec == NULL || (pspec->flags & G_PARAM_WRITABLE) == 0
+          || (pspec->flags & G_PARAM_CONSTRUCT_ONLY) != 0)
+        {
+          DEBUG ("%s: [%s] has no setting called %s", path, group,
+              keys[i]);
+          continue;
+        }
+
+      if (G_PARAM_SPEC_VALUE_TYPE (pspec) == G_TYPE_BOOLEAN)
+        {
+          gboolean b = g_key_file_get_boolean (key_file, group, keys[i],
+              &error);
+
+          g_value_init (&value, G_TYPE_BOOLEAN);
+          g_value_set_boolean (&value, b);
+        }
+      else if (G_PARAM_SPEC_VALUE_TYPE (pspec) == G_TYPE_UINT)
+        {
+          guint64 u = g_key_file_get_uint64 (key_file, group, keys[i],
+              &error);
+
+          g_value_init (&value, G_TYPE_UINT);
+          g_value_set_uint (&value, MIN (u, G_MAXUINT));
+        }
+      else
+        {
+          DEBUG ("%s: [%s] %s can't be set from here", path, group,
+              keys[i]);
+          continue;
+        }
+
+      /* out of range values get clamped, which is as good as wrong */
+      if (error == NULL && g_param_value_validate (pspec, &value))
+        g_set_error (&error, G_KEY_FILE_ERROR,
+            G_KEY_FILE_ERROR_INVALID_VALUE, "out of range");
+
+      if (error != NULL)
+        {
+          DEBUG ("%s: [%s] %s: %s", path, group, keys[i],
+              error->message);
+          g_clear_error (&error);
+        }
+      else
+        {
+          DEBUG ("%s: setting %s from %s", G_OBJECT_TYPE_NAME (object),
+              keys[i], path);
+          g_object_set_property (object, keys[i], &value);
+        }
+
+      g_value_unset (&value);
+    }
+
+out:
+  g_strfreev (keys);
+  g_clear_error (&error);
+  g_key_file_free (key_file);
+  g_free (path);
+}
@@ -47,6 +47,31 @@ typedef enum {
 
 #define SERVICE_PREFIX YTST_CAPABILITIES_NS "#"
 
+/* Compact advertisement: a caps feature saying we understand it, the
+ * FORM_TYPE of the summary form listing "<uid>/<digest>" for each
+ * service, and the disco#info node prefix to ask for one of them. */
+#define YTST_INDEX_NS "urn:ytstenut:index"
+#define INDEX_PREFIX YTST_INDEX_NS "#"
+
+gchar * ytst_service_digest (const gchar *uid,
+    const gchar *type,
+    const gchar * const *names,
+    const gchar * const *caps);
+
+/* Small binary caches under $XDG_CACHE_HOME/ytstenut, kept in the
+ * native GVariant serialisation so they can be mapped straight in */
+GVariant * ytst_cache_load (const gchar *name,
+    const GVariantType *type,
+    GError **error);
+
+gboolean ytst_cache_save (const gchar *name,
+    GVariant *value,
+    GError **error);
+
+/* Settings from $XDG_CONFIG_HOME/ytstenut/plugins.conf; see README */
+void ytst_config_apply (GObject *object,
+    const gchar *group);
+
 gint ytst_message_error_type_to_wocky (guint ytstenut_type);
 
 guint ytst_message_error_type_from_wocky (gint wocky_type);
@@ -152,13 +152,17 @@ ytstenut_plugin_create_channel_managers (
     FooPlugin *plugin,
     FooConnection *plugin_connection)
 {
-  GPtrArray *ret = g_ptr_array_sized_new (1);
+  GPtrArray *ret = g_ptr_array_sized_new (2);
   TpBaseConnection *connection = TP_BASE_CONNECTION (plugin_connection);
+  YtstCapsManager *caps_manager;
 
   DEBUG ("%p on connection %p", plugin, plugin_connection);
 
-  g_ptr_array_add (ret, g_object_new (YTST_TYPE_CAPS_MANAGER, NULL));
-  g_ptr_array_add (ret, ytst_channel_manager_new (connection));
+  caps_manager = g_object_new (YTST_TYPE_CAPS_MANAGER,
+      "connection", connection,
+      NULL);
+  g_ptr_array_add (ret, caps_manager);
+  g_ptr_array_add (ret, ytst_channel_manager_new (connection, caps_manager));
 
   return ret;
 }
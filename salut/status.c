@@ -27,23 +27,35 @@
 
 #include <salut/plugin.h>
 
+#include <telepathy-glib/dbus.h>
 #include <telepathy-glib/svc-generic.h>
 #include <telepathy-glib/gtypes.h>
 
 #include <telepathy-ytstenut-glib/telepathy-ytstenut-glib.h>
 
+#include "channel-manager.h"
+#include "direct-bus.h"
+#include "status-future.h"
+#include "status-store.h"
 #include "utils.h"
 
 #define DEBUG(msg, ...) \
   g_debug ("%s: " msg, G_STRFUNC, ##__VA_ARGS__)
 
+/* how many contacts the initial scan looks at each time round the main
+ * loop */
+#define SCAN_SLICE_SIZE 50
+
 static void sidecar_iface_init (SalutSidecarInterface *iface);
 
 static void ytst_status_iface_init (TpYtsSvcStatusClass *iface);
+static void ytst_status_future_iface_init (YtstSvcStatusFutureClass *iface);
 
 G_DEFINE_TYPE_WITH_CODE (YtstStatus, ytst_status, G_TYPE_OBJECT,
     G_IMPLEMENT_INTERFACE (SALUT_TYPE_SIDECAR, sidecar_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_YTS_SVC_STATUS, ytst_status_iface_init);
+    G_IMPLEMENT_INTERFACE (YTST_TYPE_SVC_STATUS_FUTURE,
+      ytst_status_future_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_DBUS_PROPERTIES,
       tp_dbus_properties_mixin_iface_init);
 );
@@ -55,6 +67,10 @@ enum
   PROP_CONNECTION,
   PROP_DISCOVERED_STATUSES,
   PROP_DISCOVERED_SERVICES,
+  PROP_SCAN_COMPLETE,
+  PROP_DROPPED_REQUESTS,
+  PROP_DIRECT_BUS_ADDRESS,
+  PROP_DIRECT_BUS_PATH,
   LAST_PROPERTY
 };
 
@@ -67,17 +83,19 @@ struct _YtstStatusPrivate
   guint handler_id;
   gulong capabilities_changed_id;
 
-  /* GHashTable<gchar*,
-   *     GHashTable<gchar*,
-   *         GHashTable<gchar*,gchar*>>>
-   */
-  GHashTable *discovered_statuses;
+  /* everything we know about everyone's services and statuses, and
+   * when ours next go out */
+  YtstStatusStore *store;
 
-  /* GHashTable<gchar*,
-   *     GHashTable<gchar*,
-   *         GValueArray(gchar*,GHashTable<gchar*,gchar*>,GPtrArray<gchar*>)>>
-   */
-  GHashTable *discovered_services;
+  /* jids of the contacts the initial scan still has to look at */
+  GQueue *scan_jids;
+  guint scan_id;
+  gboolean scan_complete;
+
+  /* NULL until someone calls EnableDirectBus, and then where we are
+   * on it */
+  YtstDirectBus *direct_bus;
+  gchar *direct_bus_path;
 
   gboolean dispose_has_run;
 };
@@ -86,137 +104,6 @@ struct _YtstStatusPrivate
  * INTERNAL
  */
 
-
-/* -----------------------------------------------------------------------------
- * OBJECT
- */
-
-static void
-ytst_status_init (YtstStatus *self)
-{
-  YtstStatusPrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
-      YTST_TYPE_STATUS, YtstStatusPrivate);
-  self->priv = priv;
-}
-
-static void
-ytst_status_get_property (GObject *object,
-    guint property_id,
-    GValue *value,
-    GParamSpec *pspec)
-{
-  YtstStatus *self = YTST_STATUS (object);
-  YtstStatusPrivate *priv = self->priv;
-
-  switch (property_id)
-    {
-      case PROP_SESSION:
-        g_value_set_object (value, priv->session);
-        break;
-      case PROP_CONNECTION:
-        g_value_set_object (value, priv->connection);
-        break;
-      case PROP_DISCOVERED_STATUSES:
-        g_value_set_boxed (value, priv->discovered_statuses);
-        break;
-      case PROP_DISCOVERED_SERVICES:
-        g_value_set_boxed (value, priv->discovered_services);
-        break;
-      default:
-        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
-        break;
-    }
-}
-
-static void
-ytst_status_set_property (GObject *object,
-    guint property_id,
-    const GValue *value,
-    GParamSpec *pspec)
-{
-  YtstStatus *self = YTST_STATUS (object);
-  YtstStatusPrivate *priv = self->priv;
-
-  switch (property_id)
-    {
-      case PROP_SESSION:
-        priv->session = g_value_dup_object (value);
-        break;
-      case PROP_CONNECTION:
-        priv->connection = g_value_dup_object (value);
-        break;
-      default:
-        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
-        break;
-    }
-}
-
-static void
-update_contact_status (YtstStatus *self,
-    const gchar *from,
-    const gchar *capability,
-    const gchar *service_name,
-    const gchar *status_str)
-{
-  YtstStatusPrivate *priv = self->priv;
-  const gchar *old_status;
-  gboolean emit = FALSE;
-
-  GHashTable *capability_service_map;
-  GHashTable *service_status_map;
-
-  capability_service_map = g_hash_table_lookup (priv->discovered_statuses, from);
-
-  if (capability_service_map == NULL)
-    {
-      capability_service_map = g_hash_table_new_full (g_str_hash, g_str_equal,
-          g_free, (GDestroyNotify) g_hash_table_unref);
-      g_hash_table_insert (priv->discovered_statuses, g_strdup (from),
-          capability_service_map);
-    }
-
-  service_status_map = g_hash_table_lookup (capability_service_map,
-      capability);
-
-  if (service_status_map == NULL)
-    {
-      service_status_map = g_hash_table_new_full (g_str_hash, g_str_equal,
-          g_free, g_free);
-      g_hash_table_insert (capability_service_map,
-          g_strdup (capability), service_status_map);
-    }
-
-  old_status = g_hash_table_lookup (service_status_map, service_name);
-
-  /* Save this value as old_status will be freed when we call
-   * g_hash_table_insert next and the spec says we need to update the
-   * property before emitting the signal. In reality this wouldn't be
-   * a problem, but let's be nice. */
-  emit = tp_strdiff (old_status, status_str);
-
-  if (status_str != NULL)
-    {
-      g_hash_table_insert (service_status_map, g_strdup (service_name),
-          g_strdup (status_str));
-    }
-  else
-    {
-      /* remove the service from the service status map */
-      g_hash_table_remove (service_status_map, service_name);
-
-      /* now run along up the hash table cleaning up */
-      if (g_hash_table_size (service_status_map) == 0)
-        g_hash_table_remove (capability_service_map, capability);
-
-      if (g_hash_table_size (capability_service_map) == 0)
-        g_hash_table_remove (priv->discovered_statuses, from);
-    }
-
-  if (emit)
-    tp_yts_svc_status_emit_status_changed (self, from, capability,
-        service_name, status_str);
-}
-
 static gchar *
 get_node_body (WockyNode *node)
 {
@@ -243,8 +130,9 @@ pep_event_cb (WockyPorter *porter,
 {
   YtstStatus *self = user_data;
   WockyNode *message, *event, *items, *item, *status;
-  gchar *status_str = NULL;
-  const gchar *from, *capability, *service_name;
+  WockyNodeIter iter;
+  const gchar *from, *capability;
+  gboolean handled = FALSE;
 
   message = wocky_stanza_get_top_node (stanza);
 
@@ -257,185 +145,212 @@ pep_event_cb (WockyPorter *porter,
   if (items == NULL || tp_strdiff (items->name, "items"))
     return TRUE;
 
-  item = wocky_node_get_first_child (items);
-  if (item == NULL || tp_strdiff (item->name, "item"))
-    return FALSE;
+  from = wocky_stanza_get_from (stanza);
+  capability = wocky_node_get_attribute (items, "node");
 
-  status = wocky_node_get_first_child (item);
-  if (status == NULL || tp_strdiff (status->name, "status"))
-    return FALSE;
+  /* there's one item for each service with a status on this node */
+  wocky_node_iter_init (&iter, items, "item", NULL);
+  while (wocky_node_iter_next (&iter, &item))
+    {
+      const gchar *service_name;
+      gchar *status_str = NULL;
 
-  /* looks good */
+      status = wocky_node_get_first_child (item);
+      if (status == NULL || tp_strdiff (status->name, "status"))
+        continue;
 
-  from = wocky_stanza_get_from (stanza);
-  capability = wocky_node_get_attribute (items, "node");
-  service_name = wocky_node_get_attribute (status, "from-service");
+      /* looks good */
+      handled = TRUE;
 
-  if (wocky_node_get_attribute (status, "activity") != NULL)
-    status_str = get_node_body (status);
+      service_name = wocky_node_get_attribute (status, "from-service");
 
-  update_contact_status (self, from, capability, service_name, status_str);
+      if (wocky_node_get_attribute (status, "activity") != NULL)
+        status_str = get_node_body (status);
 
-  g_free (status_str);
+      ytst_status_store_update_status (self->priv->store, from, capability,
+          service_name, status_str);
 
-  return TRUE;
+      g_free (status_str);
+    }
+
+  return handled;
 }
 
-static GHashTable *
-get_name_map_from_strv (const gchar **strv)
+/* Sends all of @status_trees, which are for the same capability, in as
+ * few stanzas as we can */
+static void
+send_statuses_cb (YtstStatusStore *store,
+    const gchar *capability,
+    GPtrArray *status_trees,
+    YtstStatus *self)
 {
-  GHashTable *out = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, g_free);
-  const gchar **s;
+  YtstStatusPrivate *priv = self->priv;
+  WockyStanza *stanza;
+  WockyNode *items, *item;
+  guint i;
 
-  for (s = strv; s != NULL && *s != NULL; s++)
-    {
-      gchar **parts = g_strsplit (*s, "/", 2);
+  stanza = wocky_pubsub_make_event_stanza (capability,
+      salut_plugin_connection_get_name (priv->connection), &item);
+
+  /* they're all on the same node, so they can all go in one event */
+  items = wocky_node_get_first_child (wocky_node_get_first_child (
+          wocky_stanza_get_top_node (stanza)));
 
-      g_hash_table_insert (out,
-          g_strdup (parts[0]), g_strdup(parts[1]));
+  for (i = 0; i < status_trees->len; i++)
+    {
+      if (i > 0)
+        item = wocky_node_add_child (items, "item");
 
-      g_strfreev (parts);
+      wocky_node_add_node_tree (item, g_ptr_array_index (status_trees, i));
     }
 
-  return out;
+  wocky_send_ll_pep_event (priv->session, stanza);
+  g_object_unref (stanza);
 }
 
+typedef struct
+{
+  YtstStatus *self;
+  /* a WockyContact */
+  gpointer contact;
+  gchar *uid;
+  gchar *digest;
+} DetailsRequest;
+
 static void
-contact_capabilities_changed (YtstStatus *self,
-    gpointer contact,
-    gboolean do_signal)
+details_request_free (DetailsRequest *request)
 {
-  YtstStatusPrivate *priv = self->priv;
-  const GPtrArray *data_forms;
-  guint i;
-  GHashTable *old, *new;
-  GHashTableIter iter;
-  gpointer key, value;
-  gchar *jid;
+  g_object_unref (request->self);
+  g_object_unref (request->contact);
+  g_free (request->uid);
+  g_free (request->digest);
+  g_slice_free (DetailsRequest, request);
+}
 
-  data_forms = wocky_xep_0115_capabilities_get_data_forms (
-      WOCKY_XEP_0115_CAPABILITIES (contact));
+static void contact_capabilities_changed (YtstStatus *self,
+    gpointer contact,
+    gboolean do_signal);
 
-  /* A bit of a hack: both SalutContact and SalutSelf implement
-   * WockyXep0115Capabilities, so contact could be either one. We only
-   * need the contact jid, so let's just check whether it's a
-   * WockyContact or not then. */
-  if (WOCKY_IS_CONTACT (contact))
-    jid = wocky_contact_dup_jid (WOCKY_CONTACT (contact));
-  else
-    jid = g_strdup (wocky_session_get_jid (priv->session));
+static void
+details_reply_cb (GObject *source_object,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  DetailsRequest *request = user_data;
+  YtstStatus *self = request->self;
+  YtstStatusPrivate *priv = self->priv;
+  WockyStanza *reply;
+  WockyNode *query, *x = NULL;
+  WockyDataForm *form = NULL;
+  GError *error = NULL;
 
-  old = g_hash_table_lookup (priv->discovered_services, jid);
+  reply = wocky_porter_send_iq_finish (WOCKY_PORTER (source_object),
+      result, &error);
 
-  new = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) g_value_array_free);
+  if (priv->dispose_has_run)
+    goto out;
 
-  for (i = 0; i < data_forms->len; i++)
+  if (reply == NULL)
     {
-      WockyDataForm *form = g_ptr_array_index (data_forms, i);
-      WockyDataFormField *type, *tmp;
-      const gchar *form_type;
-      const gchar *service;
-      GValueArray *details;
-
-      gchar *yts_service_name;
-      GHashTable *yts_name_map;
-      gchar **yts_caps;
+      DEBUG ("couldn't get details of %s: %s", request->uid, error->message);
+      g_clear_error (&error);
+    }
+  else if (wocky_stanza_extract_errors (reply, NULL, &error, NULL, NULL))
+    {
+      DEBUG ("couldn't get details of %s: %s", request->uid, error->message);
+      g_clear_error (&error);
+    }
+  else
+    {
+      query = wocky_node_get_child_ns (wocky_stanza_get_top_node (reply),
+          "query", WOCKY_XMPP_NS_DISCO_INFO);
+      if (query != NULL)
+        x = wocky_node_get_child_ns (query, "x", WOCKY_XMPP_NS_DATA);
+    }
 
-      type = g_hash_table_lookup (form->fields, "FORM_TYPE");
+  if (x != NULL)
+    form = wocky_data_form_new_from_node (x, NULL);
 
-      if (type == NULL
-          || type->type != WOCKY_DATA_FORM_FIELD_TYPE_HIDDEN)
-        continue;
+  /* now they'll be found */
+  if (ytst_status_store_add_details (priv->store, request->uid,
+          request->digest, form))
+    contact_capabilities_changed (self, request->contact, TRUE);
 
-      form_type = g_value_get_string (type->default_value);
+out:
+  g_clear_error (&error);
+  tp_clear_object (&form);
+  tp_clear_object (&reply);
+  details_request_free (request);
+}
 
-      if (!g_str_has_prefix (form_type, SERVICE_PREFIX))
-        continue;
+/* Asks @contact for the details of @uid, which it advertised
+ * compactly, and looks at it again once they come back */
+static gboolean
+fetch_details_cb (YtstStatusStore *store,
+    GObject *contact,
+    const gchar *jid,
+    const gchar *uid,
+    const gchar *digest,
+    YtstStatus *self)
+{
+  YtstStatusPrivate *priv = self->priv;
+  WockyStanza *stanza;
+  DetailsRequest *request;
+  gchar *node;
 
-      service = form_type + strlen (SERVICE_PREFIX);
+  /* we can't very well ask ourselves */
+  if (!WOCKY_IS_CONTACT (contact))
+    return FALSE;
 
-      /* service type */
-      tmp = g_hash_table_lookup (form->fields, "type");
-      if (tmp == NULL || tmp->type != WOCKY_DATA_FORM_FIELD_TYPE_TEXT_SINGLE)
-        continue;
-      yts_service_name = g_value_dup_string (tmp->default_value);
+  node = g_strdup_printf ("%s%s", INDEX_PREFIX, uid);
 
-      tmp = g_hash_table_lookup (form->fields, "name");
+  stanza = wocky_stanza_build_to_contact (WOCKY_STANZA_TYPE_IQ,
+      WOCKY_STANZA_SUB_TYPE_GET, NULL, WOCKY_CONTACT (contact),
+      '(', "query",
+        ':', WOCKY_XMPP_NS_DISCO_INFO,
+        '@', "node", node,
+      ')', NULL);
 
-      if (tmp != NULL && tmp->default_value != NULL &&
-          tmp->type == WOCKY_DATA_FORM_FIELD_TYPE_TEXT_MULTI)
-        {
-          yts_name_map = get_name_map_from_strv (
-              g_value_get_boxed (tmp->default_value));
-        }
-      else
-        {
-          yts_name_map = g_hash_table_new (g_str_hash, g_str_equal);
-        }
+  request = g_slice_new0 (DetailsRequest);
+  request->self = g_object_ref (self);
+  request->contact = g_object_ref (contact);
+  request->uid = g_strdup (uid);
+  request->digest = g_strdup (digest);
 
-      /* caps */
-      tmp = g_hash_table_lookup (form->fields, "capabilities");
-      if (tmp != NULL && tmp->default_value != NULL &&
-          tmp->type == WOCKY_DATA_FORM_FIELD_TYPE_TEXT_MULTI)
-        {
-          yts_caps = g_strdupv (tmp->raw_value_contents);
-        }
-      else
-        {
-          gchar *caps_tmp[] = { NULL };
-          yts_caps = g_strdupv (caps_tmp);
-        }
+  DEBUG ("asking %s for the details of %s", jid, uid);
 
-      /* now build the value array and add it to the new hash table */
-      details = tp_value_array_build (3,
-          G_TYPE_STRING, yts_service_name,
-          TP_HASH_TYPE_STRING_STRING_MAP, yts_name_map,
-          G_TYPE_STRV, yts_caps,
-          G_TYPE_INVALID);
+  wocky_porter_send_iq_async (wocky_session_get_porter (priv->session),
+      stanza, NULL, details_reply_cb, request);
 
-      g_hash_table_insert (new, g_strdup (service), details);
+  g_object_unref (stanza);
+  g_free (node);
 
-      g_free (yts_service_name);
-      g_hash_table_unref (yts_name_map);
-      g_strfreev (yts_caps);
-    }
+  return TRUE;
+}
 
-  if (do_signal)
-    {
-      /* first check for services in old but not in new; they've been
-       * removed. old can be NULL. */
-      if (old != NULL)
-        {
-          g_hash_table_iter_init (&iter, old);
-          while (g_hash_table_iter_next (&iter, &key, NULL))
-            {
-              if (g_hash_table_lookup (new, key) == NULL)
-                tp_yts_svc_status_emit_service_removed (self, jid, key);
-            }
-        }
+static void
+contact_capabilities_changed (YtstStatus *self,
+    gpointer contact,
+    gboolean do_signal)
+{
+  YtstStatusPrivate *priv = self->priv;
+  const GPtrArray *data_forms;
+  gchar *jid;
 
-      /* next check for services in new but not in old; they've been
-       * added */
-      g_hash_table_iter_init (&iter, new);
-      while (g_hash_table_iter_next (&iter, &key, &value))
-        {
-          if (old == NULL || g_hash_table_lookup (old, key) == NULL)
-            tp_yts_svc_status_emit_service_added (self, jid, key, value);
-        }
-    }
+  data_forms = wocky_xep_0115_capabilities_get_data_forms (
+      WOCKY_XEP_0115_CAPABILITIES (contact));
 
-  if (g_hash_table_size (new) > 0)
-    {
-      g_hash_table_replace (priv->discovered_services,
-          g_strdup (jid), new);
-    }
+  /* A bit of a hack: both SalutContact and SalutSelf implement
+   * WockyXep0115Capabilities, so contact could be either one. We only
+   * need the contact jid, so let's just check whether it's a
+   * WockyContact or not then. */
+  if (WOCKY_IS_CONTACT (contact))
+    jid = wocky_contact_dup_jid (WOCKY_CONTACT (contact));
   else
-    {
-      g_hash_table_remove (priv->discovered_services, jid);
-      g_hash_table_unref (new);
-    }
+    jid = g_strdup (wocky_session_get_jid (priv->session));
+
+  ytst_status_store_update_services (priv->store, contact, jid,
+      data_forms, do_signal);
 
   g_free (jid);
 }
@@ -454,6 +369,52 @@ capabilities_changed_cb (GSignalInvocationHint *ihint,
   return TRUE;
 }
 
+static void
+scan_finished (YtstStatus *self)
+{
+  YtstStatusPrivate *priv = self->priv;
+
+  DEBUG ("initial scan complete");
+
+  priv->scan_complete = TRUE;
+  ytst_svc_status_future_emit_scan_complete (self);
+}
+
+/* Looks at the next few contacts which were around before this sidecar
+ * was ensured, and returns whether there are any left */
+static gboolean
+scan_slice_cb (gpointer data)
+{
+  YtstStatus *self = YTST_STATUS (data);
+  YtstStatusPrivate *priv = self->priv;
+  WockyContactFactory *factory;
+  guint n;
+
+  factory = wocky_session_get_contact_factory (priv->session);
+
+  for (n = 0; n < SCAN_SLICE_SIZE
+       && !g_queue_is_empty (priv->scan_jids); n++)
+    {
+      gchar *jid = g_queue_pop_head (priv->scan_jids);
+      WockyLLContact *contact;
+
+      /* they might have gone away since */
+      contact = wocky_contact_factory_lookup_ll_contact (factory, jid);
+
+      if (contact != NULL && WOCKY_IS_XEP_0115_CAPABILITIES (contact))
+        contact_capabilities_changed (self, contact, FALSE);
+
+      g_free (jid);
+    }
+
+  if (!g_queue_is_empty (priv->scan_jids))
+    return TRUE;
+
+  priv->scan_id = 0;
+  scan_finished (self);
+  return FALSE;
+}
+
 static gboolean
 capabilities_idle_cb (gpointer data)
 {
@@ -468,33 +429,206 @@ capabilities_idle_cb (gpointer data)
       0, capabilities_changed_cb, self, NULL);
 
   /* and now look through all the contacts that had caps before this
-   * sidecar was ensured */
+   * sidecar was ensured, a few at a time so a busy network doesn't
+   * hold up everything else */
   factory = wocky_session_get_contact_factory (priv->session);
   contacts = wocky_contact_factory_get_ll_contacts (factory);
 
   for (l = contacts; l != NULL; l = l->next)
     {
       if (WOCKY_IS_XEP_0115_CAPABILITIES (l->data))
-        contact_capabilities_changed (self, l->data, FALSE);
+        g_queue_push_tail (priv->scan_jids,
+            wocky_contact_dup_jid (l->data));
     }
 
   g_list_free (contacts);
 
+  DEBUG ("%u contacts to scan", g_queue_get_length (priv->scan_jids));
+
+  if (scan_slice_cb (self))
+    priv->scan_id = g_idle_add (scan_slice_cb, self);
+
   return FALSE;
 }
 
 static void
-ytst_status_constructed (GObject *object)
+backlog_changed_cb (YtstChannelManager *manager,
+    const gchar *service,
+    guint pending,
+    guint limit,
+    YtstStatus *self)
+{
+  ytst_svc_status_future_emit_backlog_changed (self, service, pending,
+      limit);
+}
+
+static void
+service_added_cb (YtstStatusStore *store,
+    const gchar *jid,
+    const gchar *service,
+    GValueArray *details,
+    YtstStatus *self)
+{
+  tp_yts_svc_status_emit_service_added (self, jid, service, details);
+}
+
+static void
+service_removed_cb (YtstStatusStore *store,
+    const gchar *jid,
+    const gchar *service,
+    YtstStatus *self)
+{
+  tp_yts_svc_status_emit_service_removed (self, jid, service);
+}
+
+static void
+status_changed_cb (YtstStatusStore *store,
+    const gchar *jid,
+    const gchar *capability,
+    const gchar *service,
+    const gchar *status,
+    YtstStatus *self)
+{
+  tp_yts_svc_status_emit_status_changed (self, jid, capability, service,
+      status);
+}
+
+static void
+services_changed_cb (YtstStatusStore *store,
+    GHashTable *added,
+    GHashTable *removed,
+    YtstStatus *self)
+{
+  ytst_svc_status_future_emit_services_changed (self, added, removed);
+}
+
+static void
+statuses_changed_cb (YtstStatusStore *store,
+    GHashTable *statuses,
+    YtstStatus *self)
+{
+  ytst_svc_status_future_emit_statuses_changed (self, statuses);
+}
+
+static void
+dropped_requests_changed_cb (YtstStatusStore *store,
+    guint dropped_requests,
+    YtstStatus *self)
+{
+  ytst_svc_status_future_emit_dropped_requests_changed (self,
+      dropped_requests);
+}
+
+/* -----------------------------------------------------------------------------
+ * OBJECT
+ */
+
+static void
+ytst_status_init (YtstStatus *self)
+{
+  YtstStatusPrivate *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      YTST_TYPE_STATUS, YtstStatusPrivate);
+  self->priv = priv;
+}
+
+static void
+ytst_status_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  YtstStatus *self = YTST_STATUS (object);
+  YtstStatusPrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+      case PROP_SESSION:
+        g_value_set_object (value, priv->session);
+        break;
+      case PROP_CONNECTION:
+        g_value_set_object (value, priv->connection);
+        break;
+      case PROP_DISCOVERED_STATUSES:
+        g_value_take_boxed (value,
+            ytst_status_store_dup_statuses (priv->store));
+        break;
+      case PROP_DISCOVERED_SERVICES:
+        g_value_take_boxed (value,
+            ytst_status_store_dup_services (priv->store));
+        break;
+      case PROP_SCAN_COMPLETE:
+        g_value_set_boolean (value, priv->scan_complete);
+        break;
+      case PROP_DROPPED_REQUESTS:
+        g_value_set_uint (value,
+            ytst_status_store_get_dropped_requests (priv->store));
+        break;
+      case PROP_DIRECT_BUS_ADDRESS:
+        g_value_set_string (value, priv->direct_bus == NULL ? "" :
+            ytst_direct_bus_get_address (priv->direct_bus));
+        break;
+      case PROP_DIRECT_BUS_PATH:
+        g_value_set_boxed (value, priv->direct_bus_path == NULL ? "/" :
+            priv->direct_bus_path);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+ytst_status_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
 {
   YtstStatus *self = YTST_STATUS (object);
   YtstStatusPrivate *priv = self->priv;
-  WockyPorter *porter;
 
-  priv->discovered_statuses = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) g_hash_table_unref);
+  switch (property_id)
+    {
+      case PROP_SESSION:
+        priv->session = g_value_dup_object (value);
+        break;
+      case PROP_CONNECTION:
+        priv->connection = g_value_dup_object (value);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
 
-  priv->discovered_services = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) g_hash_table_unref);
+static void
+ytst_status_constructed (GObject *object)
+{
+  YtstStatus *self = YTST_STATUS (object);
+  YtstStatusPrivate *priv = self->priv;
+  WockyPorter *porter;
+  TpChannelManagerIter iter;
+  TpChannelManager *manager;
+
+  priv->store = ytst_status_store_new (TP_BASE_CONNECTION (priv->connection));
+
+  g_signal_connect (priv->store, "service-added",
+      G_CALLBACK (service_added_cb), self);
+  g_signal_connect (priv->store, "service-removed",
+      G_CALLBACK (service_removed_cb), self);
+  g_signal_connect (priv->store, "status-changed",
+      G_CALLBACK (status_changed_cb), self);
+  g_signal_connect (priv->store, "services-changed",
+      G_CALLBACK (services_changed_cb), self);
+  g_signal_connect (priv->store, "statuses-changed",
+      G_CALLBACK (statuses_changed_cb), self);
+  g_signal_connect (priv->store, "dropped-requests-changed",
+      G_CALLBACK (dropped_requests_changed_cb), self);
+  g_signal_connect (priv->store, "fetch-details",
+      G_CALLBACK (fetch_details_cb), self);
+  g_signal_connect (priv->store, "send-statuses",
+      G_CALLBACK (send_statuses_cb), self);
+
+  priv->scan_jids = g_queue_new ();
 
   porter = wocky_session_get_porter (priv->session);
   priv->handler_id = wocky_porter_register_handler_from_anyone (
@@ -504,6 +638,18 @@ ytst_status_constructed (GObject *object)
         ':', "http://jabber.org/protocol/pubsub#event",
       ')', NULL);
 
+  /* Pass on backlog pressure to handlers */
+  tp_base_connection_channel_manager_iter_init (&iter,
+      TP_BASE_CONNECTION (priv->connection));
+  while (tp_base_connection_channel_manager_iter_next (&iter, &manager))
+    {
+      if (!YTST_IS_CHANNEL_MANAGER (manager))
+        continue;
+
+      tp_g_signal_connect_object (manager, "backlog-changed",
+          G_CALLBACK (backlog_changed_cb), self, 0);
+    }
+
   /* we need an idle for this otherwise the g_signal_lookup fails
    * giving this (not entirely sure why):
    *
@@ -537,8 +683,25 @@ ytst_status_dispose (GObject *object)
         g_signal_lookup ("capabilities-changed", WOCKY_TYPE_XEP_0115_CAPABILITIES),
         priv->capabilities_changed_id);
 
-  tp_clear_pointer (&priv->discovered_statuses, g_hash_table_unref);
-  tp_clear_pointer (&priv->discovered_services, g_hash_table_unref);
+  if (priv->scan_id != 0)
+    {
+      g_source_remove (priv->scan_id);
+      priv->scan_id = 0;
+    }
+
+  if (priv->scan_jids != NULL)
+    {
+      g_queue_foreach (priv->scan_jids, (GFunc) g_free, NULL);
+      g_queue_free (priv->scan_jids);
+      priv->scan_jids = NULL;
+    }
+
+  tp_clear_object (&priv->store);
+
+  if (priv->direct_bus != NULL)
+    ytst_direct_bus_unexport (priv->direct_bus, priv->direct_bus_path);
+  tp_clear_object (&priv->direct_bus);
+  tp_clear_pointer (&priv->direct_bus_path, g_free);
 
   tp_clear_object (&priv->session);
   tp_clear_object (&priv->connection);
@@ -572,6 +735,13 @@ ytst_status_class_init (YtstStatusClass *klass)
       { "DiscoveredServices", "discovered-services", NULL },
       { NULL }
   };
+  static TpDBusPropertiesMixinPropImpl future_props[] = {
+      { "ScanComplete", "scan-complete", NULL },
+      { "DroppedRequests", "dropped-requests", NULL },
+      { "DirectBusAddress", "direct-bus-address", NULL },
+      { "DirectBusPath", "direct-bus-path", NULL },
+      { NULL }
+  };
 
   g_type_class_add_private (klass, sizeof (YtstStatusPrivate));
 
@@ -617,6 +787,46 @@ ytst_status_class_init (YtstStatusClass *klass)
   g_object_class_install_property (object_class, PROP_DISCOVERED_SERVICES,
       param_spec);
 
+  param_spec = g_param_spec_boolean (
+      "scan-complete",
+      "Scan complete",
+      "Whether everyone who was around when the sidecar was created has "
+      "been looked at, so DiscoveredServices is fully populated",
+      FALSE,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_SCAN_COMPLETE,
+      param_spec);
+
+  param_spec = g_param_spec_uint (
+      "dropped-requests",
+      "Dropped requests",
+      "Number of incoming requests the connection has refused because "
+      "their sender was sending them too fast",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DROPPED_REQUESTS,
+      param_spec);
+
+  param_spec = g_param_spec_string (
+      "direct-bus-address",
+      "Direct bus address",
+      "Where clients can connect to us without going through the bus "
+      "daemon, or empty until EnableDirectBus is called",
+      "",
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DIRECT_BUS_ADDRESS,
+      param_spec);
+
+  param_spec = g_param_spec_boxed (
+      "direct-bus-path",
+      "Direct bus path",
+      "Where this object is on the direct bus, or / until EnableDirectBus "
+      "is called",
+      DBUS_TYPE_G_OBJECT_PATH,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DIRECT_BUS_PATH,
+      param_spec);
+
   tp_dbus_properties_mixin_class_init (object_class,
       G_STRUCT_OFFSET (YtstStatusClass, dbus_props_class));
 
@@ -624,99 +834,280 @@ ytst_status_class_init (YtstStatusClass *klass)
       TP_YTS_IFACE_QUARK_STATUS,
       tp_dbus_properties_mixin_getter_gobject_properties, NULL,
       ytstenut_props);
+
+  tp_dbus_properties_mixin_implement_interface (object_class,
+      YTST_IFACE_QUARK_STATUS_FUTURE,
+      tp_dbus_properties_mixin_getter_gobject_properties, NULL,
+      future_props);
 }
 
-static WockyNodeTree *
-parse_status_body (const gchar *body,
-    GError **error)
+static void
+ytst_status_advertise_status (TpYtsSvcStatus *svc,
+    const gchar *capability,
+    const gchar *service_name,
+    const gchar *status,
+    DBusGMethodInvocation *context)
 {
-  WockyXmppReader *reader;
-  WockyNodeTree *tree;
-  GError *err = NULL;
+  YtstStatus *self = YTST_STATUS (svc);
+  WockyNodeTree *status_tree;
+  GError *error = NULL;
 
-  reader = wocky_xmpp_reader_new_no_stream ();
-  wocky_xmpp_reader_push (reader, (guint8 *) body, strlen (body));
-  tree = WOCKY_NODE_TREE (wocky_xmpp_reader_pop_stanza (reader));
-  g_object_unref (reader);
+  status_tree = ytst_status_tree_new (capability, service_name, status,
+      &error);
 
-  if (tree == NULL)
+  if (status_tree == NULL)
     {
-      err = wocky_xmpp_reader_get_error (reader);
-      g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
-          "Invalid XML%s%s",
-          err != NULL && err->message != NULL ? ": " : ".",
-          err != NULL && err->message != NULL ? err->message : "");
-      g_clear_error (&err);
+      dbus_g_method_return_error (context, error);
+      g_clear_error (&error);
+      return;
     }
 
-  return tree;
+  ytst_status_store_publish (self->priv->store, capability, service_name,
+      status_tree);
+
+  tp_yts_svc_status_return_from_advertise_status (context);
 }
 
 static void
-ytst_status_advertise_status (TpYtsSvcStatus *svc,
-    const gchar *capability,
-    const gchar *service_name,
-    const gchar *status,
+ytst_status_advertise_statuses (YtstSvcStatusFuture *svc,
+    const GPtrArray *statuses,
     DBusGMethodInvocation *context)
 {
   YtstStatus *self = YTST_STATUS (svc);
   YtstStatusPrivate *priv = self->priv;
-  WockyNodeTree *status_tree = NULL;
+  GPtrArray *status_trees;
   GError *error = NULL;
-  WockyStanza *stanza;
-  WockyNode *item, *status_node;
+  guint i;
 
-  if (tp_str_empty (capability))
+  status_trees = g_ptr_array_new_with_free_func (g_object_unref);
+
+  /* check them all before sending any, so it's all or nothing */
+  for (i = 0; i < statuses->len; i++)
     {
-      g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
-          "Capability argument must be set");
-      goto out;
+      GValueArray *va = g_ptr_array_index (statuses, i);
+      const gchar *capability, *service_name, *status;
+      WockyNodeTree *status_tree;
+
+      capability = g_value_get_string (g_value_array_get_nth (va, 0));
+      service_name = g_value_get_string (g_value_array_get_nth (va, 1));
+      status = g_value_get_string (g_value_array_get_nth (va, 2));
+
+      status_tree = ytst_status_tree_new (capability, service_name, status,
+          &error);
+
+      if (status_tree == NULL)
+        {
+          dbus_g_method_return_error (context, error);
+          g_clear_error (&error);
+          g_ptr_array_unref (status_trees);
+          return;
+        }
+
+      g_ptr_array_add (status_trees, status_tree);
     }
 
-  if (tp_str_empty (service_name))
+  /* so the ones which can go now go together, a capability at a time */
+  ytst_status_store_freeze_publishing (priv->store);
+
+  for (i = 0; i < status_trees->len; i++)
     {
-      g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
-          "Service name argument must be set");
-      goto out;
+      WockyNodeTree *status_tree = g_ptr_array_index (status_trees, i);
+      WockyNode *status_node = wocky_node_tree_get_top_node (status_tree);
+
+      ytst_status_store_publish (priv->store,
+          wocky_node_get_attribute (status_node, "capability"),
+          wocky_node_get_attribute (status_node, "from-service"),
+          g_object_ref (status_tree));
     }
 
-  if (!tp_str_empty (status))
+  ytst_status_store_thaw_publishing (priv->store);
+
+  g_ptr_array_unref (status_trees);
+
+  ytst_svc_status_future_return_from_advertise_statuses (context);
+}
+
+static void
+ytst_status_find_services_by_capability (YtstSvcStatusFuture *svc,
+    const gchar *capability,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *services;
+  GError *error = NULL;
+
+  if (tp_str_empty (capability))
     {
-      status_tree = parse_status_body (status, &error);
-      if (status_tree == NULL)
-        goto out;
+      g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "Capability argument must be set");
+      dbus_g_method_return_error (context, error);
+      g_clear_error (&error);
+      return;
     }
-  else
+
+  services = ytst_status_store_find_services_by_capability (
+      self->priv->store, capability);
+  ytst_svc_status_future_return_from_find_services_by_capability (context,
+      services);
+  g_hash_table_unref (services);
+}
+
+static void
+ytst_status_find_services_by_type (YtstSvcStatusFuture *svc,
+    const gchar *type,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *services;
+  GError *error = NULL;
+
+  if (tp_str_empty (type))
     {
-      status_tree = wocky_node_tree_new ("status", YTST_STATUS_NS, NULL);
+      g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "Type argument must be set");
+      dbus_g_method_return_error (context, error);
+      g_clear_error (&error);
+      return;
     }
 
-  status_node = wocky_node_tree_get_top_node (status_tree);
+  services = ytst_status_store_find_services_by_type (self->priv->store,
+      type);
+  ytst_svc_status_future_return_from_find_services_by_type (context, services);
+  g_hash_table_unref (services);
+}
 
-  wocky_node_set_attribute (status_node, "from-service",
-      service_name);
-  wocky_node_set_attribute (status_node, "capability",
-      capability);
+static void
+ytst_status_get_services_for_contact (YtstSvcStatusFuture *svc,
+    const gchar *contact,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *services;
 
-  stanza = wocky_pubsub_make_event_stanza (capability,
-      salut_plugin_connection_get_name (priv->connection), &item);
+  services = ytst_status_store_dup_contact_services (self->priv->store,
+      contact);
+  ytst_svc_status_future_return_from_get_services_for_contact (context,
+      services);
+  g_hash_table_unref (services);
+}
 
-  wocky_node_add_node_tree (item, status_tree);
-  g_object_unref (status_tree);
+static void
+ytst_status_get_statuses_for_contact (YtstSvcStatusFuture *svc,
+    const gchar *contact,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *statuses;
 
-  wocky_send_ll_pep_event (priv->session, stanza);
-  g_object_unref (stanza);
+  statuses = ytst_status_store_dup_contact_statuses (self->priv->store,
+      contact);
+  ytst_svc_status_future_return_from_get_statuses_for_contact (context,
+      statuses);
+  g_hash_table_unref (statuses);
+}
 
-out:
-  if (error == NULL)
-    {
-      tp_yts_svc_status_return_from_advertise_status (context);
-    }
-  else
+static void
+ytst_status_get_services_page (YtstSvcStatusFuture *svc,
+    const gchar *cursor,
+    guint limit,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *services;
+  const gchar *next;
+
+  services = ytst_status_store_dup_services_page (self->priv->store,
+      cursor, limit, &next);
+
+  ytst_svc_status_future_return_from_get_services_page (context, services,
+      next);
+
+  g_hash_table_unref (services);
+}
+
+static void
+ytst_status_get_statuses_page (YtstSvcStatusFuture *svc,
+    const gchar *cursor,
+    guint limit,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *statuses;
+  const gchar *next;
+
+  statuses = ytst_status_store_dup_statuses_page (self->priv->store,
+      cursor, limit, &next);
+
+  ytst_svc_status_future_return_from_get_statuses_page (context, statuses,
+      next);
+
+  g_hash_table_unref (statuses);
+}
+
+static void
+ytst_status_get_changes_since (YtstSvcStatusFuture *svc,
+    guint64 since,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  GHashTable *added, *removed, *statuses;
+  gboolean complete;
+  guint64 version;
+
+  version = ytst_status_store_get_changes_since (self->priv->store, since,
+      &complete, &added, &removed, &statuses);
+
+  ytst_svc_status_future_return_from_get_changes_since (context,
+      version, complete, added, removed, statuses);
+
+  g_hash_table_unref (added);
+  g_hash_table_unref (removed);
+  g_hash_table_unref (statuses);
+}
+
+static void
+ytst_status_enable_direct_bus (YtstSvcStatusFuture *svc,
+    DBusGMethodInvocation *context)
+{
+  YtstStatus *self = YTST_STATUS (svc);
+  YtstStatusPrivate *priv = self->priv;
+  TpBaseConnection *base = TP_BASE_CONNECTION (priv->connection);
+  TpChannelManagerIter iter;
+  TpChannelManager *manager;
+  GError *error = NULL;
+
+  if (priv->direct_bus != NULL)
+    goto out;
+
+  priv->direct_bus = ytst_direct_bus_dup_for_connection (base, TRUE);
+
+  if (priv->direct_bus == NULL)
     {
+      g_set_error (&error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "Couldn't listen for direct connections");
       dbus_g_method_return_error (context, error);
       g_clear_error (&error);
+      return;
+    }
+
+  /* under the connection, so it's different for each one */
+  priv->direct_bus_path = g_strdup_printf ("%s/ytstenut/Status",
+      tp_base_connection_get_object_path (base));
+  ytst_direct_bus_export (priv->direct_bus, priv->direct_bus_path,
+      G_OBJECT (self));
+
+  /* and the channels which are open already */
+  tp_base_connection_channel_manager_iter_init (&iter, base);
+  while (tp_base_connection_channel_manager_iter_next (&iter, &manager))
+    {
+      if (YTST_IS_CHANNEL_MANAGER (manager))
+        ytst_channel_manager_export_channels (YTST_CHANNEL_MANAGER (manager),
+            priv->direct_bus);
     }
+
+out:
+  ytst_svc_status_future_return_from_enable_direct_bus (context,
+      ytst_direct_bus_get_address (priv->direct_bus), priv->direct_bus_path);
 }
 
 static void
@@ -728,6 +1119,23 @@ ytst_status_iface_init (TpYtsSvcStatusClass *iface)
 #undef IMPLEMENT
 }
 
+static void
+ytst_status_future_iface_init (YtstSvcStatusFutureClass *iface)
+{
+#define IMPLEMENT(x) ytst_svc_status_future_implement_##x (\
+    iface, ytst_status_##x)
+  IMPLEMENT(find_services_by_capability);
+  IMPLEMENT(find_services_by_type);
+  IMPLEMENT(get_services_for_contact);
+  IMPLEMENT(get_statuses_for_contact);
+  IMPLEMENT(get_services_page);
+  IMPLEMENT(get_statuses_page);
+  IMPLEMENT(get_changes_since);
+  IMPLEMENT(advertise_statuses);
+  IMPLEMENT(enable_direct_bus);
+#undef IMPLEMENT
+}
+
 static void
 sidecar_iface_init (SalutSidecarInterface *iface)
 {
@@ -333,3 +333,14 @@ if __name__ == '__main__':
         }
     assertEquals('q07IKJEyjvHSyhy//CH0CxmKi8w=',
         compute_caps_hash(identities, features, dataforms))
+
+def service_digest(uid, type, names, caps):
+    # keep in sync with ytst_service_digest()
+    h = hashlib.sha1()
+    h.update(uid + '\0')
+    h.update(type + '\0')
+    for strings in (names, caps):
+        for s in sorted(strings):
+            h.update(s + '\n')
+        h.update('\0')
+    return h.hexdigest()
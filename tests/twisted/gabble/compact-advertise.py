@@ -0,0 +1,120 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2011 Intel Corp.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+from gabbleservicetest import call_async, EventPattern, assertEquals, \
+    assertContains, assertSameSets
+from gabbletest import exec_test, elem_iq, elem, sync_stream
+from gabblecaps_helper import disco_caps, service_digest
+from pluginconfig import write_config, remove_config
+import ns
+import yconstants as ycs
+
+from twisted.words.xish import xpath
+
+INDEX_NS = 'urn:ytstenut:index'
+SERVICE_FORM = 'urn:ytstenut:capabilities#'
+
+UID = 'org.gnome.Banshee'
+TYPE = 'application'
+NAMES = ['en_GB/Banshee Media Player',
+         'fr/Banshee Lecteur de Musique']
+CAPS = ['urn:ytstenut:capabilities:yts-caps-audio',
+        'urn:ytstenut:data:jingle:rtp']
+
+def get_forms(stanza):
+    forms = {}
+
+    for x in xpath.queryForNodes('/iq/query/x', stanza) or []:
+        name = None
+        fields = {}
+
+        for field in xpath.queryForNodes('/x/field', x):
+            values = [str(v) for v in
+                      xpath.queryForNodes('/field/value', field) or []]
+
+            if field['var'] == 'FORM_TYPE':
+                name = values[0]
+            else:
+                fields[field['var']] = values
+
+        forms[name] = fields
+
+    return forms
+
+def test(q, bus, conn, stream):
+    remove_config()
+
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+    conn.Connect()
+
+    q.expect('dbus-signal', signal='StatusChanged', args=[0, 1])
+    q.expect('dbus-return', method='EnsureSidecar')
+
+    # get the initial presence out of the way
+    sync_stream(q, stream)
+
+    conn.ContactCapabilities.UpdateCapabilities([
+        ('well.gnome.name', [],
+         ['org.freedesktop.ytstenut.xpmn.Channel/uid/' + UID,
+          'org.freedesktop.ytstenut.xpmn.Channel/type/' + TYPE] +
+         ['org.freedesktop.ytstenut.xpmn.Channel/name/' + n for n in NAMES] +
+         ['org.freedesktop.ytstenut.xpmn.Channel/caps/' + c for c in CAPS])])
+
+    _, e = q.expect_many(EventPattern('dbus-signal', signal='ServiceAdded'),
+                         EventPattern('stream-presence'))
+
+    # our caps just have a stub for the service, and say we understand
+    # them
+    _, features, dataforms = disco_caps(q, stream, e)
+    assertContains(INDEX_NS, features)
+
+    digest = service_digest(UID, TYPE, NAMES, CAPS)
+    assertEquals({INDEX_NS + '#' + UID: {'digest': [digest]}}, dataforms)
+
+    def disco(node):
+        request = \
+            elem_iq(stream, 'get', from_='fake_contact@jabber.org/resource')(
+              elem(ns.DISCO_INFO, 'query', node=node)
+            )
+        stream.send(request)
+
+        return q.expect('stream-iq', iq_id=request['id'])
+
+    # peers ask for the details of the service separately
+    e = disco(INDEX_NS + '#' + UID)
+    assertEquals('result', e.stanza['type'])
+
+    forms = get_forms(e.stanza)
+    assertEquals([SERVICE_FORM + UID], forms.keys())
+    form = forms[SERVICE_FORM + UID]
+    assertEquals([TYPE], form['type'])
+    assertSameSets(NAMES, form['name'])
+    assertSameSets(CAPS, form['capabilities'])
+
+    # and get an error for one we don't have
+    e = disco(INDEX_NS + '#org.gnome.Nothing')
+    assertEquals('error', e.stanza['type'])
+    assert xpath.queryForNodes('/iq/error/item-not-found', e.stanza), \
+        e.stanza.toXml()
+
+if __name__ == '__main__':
+    write_config({
+        'Advertisement': { 'compact-advertisement': True },
+        })
+    exec_test(test, do_connect=False)
@@ -0,0 +1,127 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2011 Intel Corp.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+import dbus
+
+from gabbleservicetest import call_async, EventPattern, assertEquals, \
+    ProxyWrapper
+from gabbletest import exec_test, make_presence
+import gabbleconstants as cs
+import yconstants as ycs
+from gabblecaps_helper import *
+
+from twisted.words.xish.domish import Element
+
+CAP_NAME = 'urn:ytstenut:capabilities:yts-caps-audio'
+
+client = 'http://telepathy.im/fake'
+client_caps = {'ver': '0.1', 'node': client}
+features = [
+    ns.JINGLE_015,
+    ns.JINGLE_015_AUDIO,
+    ns.JINGLE_015_VIDEO,
+    ns.GOOGLE_P2P,
+    ]
+identity = ['client/pc/en/Lolclient 0.L0L']
+
+banshee = {
+    'urn:ytstenut:capabilities#org.gnome.Banshee':
+    {'type': ['application'],
+     'name': ['en_GB/Banshee Media Player'],
+     'capabilities': [CAP_NAME]
+     }
+}
+
+def send_status(stream, jid, service, activity):
+    msg = Element((None, 'message'))
+    msg['type'] = 'headline'
+    msg['from'] = jid
+    msg['to'] = 'test@localhost/Resource'
+    event = msg.addElement('event')
+    event['xmlns'] = ns.PUBSUB_EVENT
+    items = event.addElement('items')
+    items['node'] = CAP_NAME
+    item = items.addElement('item')
+    status_el = item.addElement(('urn:ytstenut:status', 'status'))
+    status_el['capability'] = CAP_NAME
+    status_el['from-service'] = service
+    status_el['activity'] = activity
+
+    stream.send(msg)
+
+def test(q, bus, conn, stream):
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+
+    conn.Connect()
+
+    e = q.expect('dbus-return', method='EnsureSidecar')
+    path, props = e.value
+
+    status = ProxyWrapper(bus.get_object(conn.bus_name, path),
+                          ycs.STATUS_IFACE, {})
+
+    def discovered(name):
+        return status.Get(ycs.STATUS_IFACE, name,
+                          dbus_interface=dbus.PROPERTIES_IFACE)
+
+    bare_jid = "test-leaves@example.com"
+    full_jid = bare_jid + "/Resource"
+
+    # a contact turns up with a service and a status for it
+    client_caps['ver'] = compute_caps_hash(identity, features, banshee)
+    presence_and_disco(q, conn, stream, full_jid, True, client, client_caps,
+                       features, identity, banshee, True, None)
+    q.expect('dbus-signal', signal='ServiceAdded',
+             args=[bare_jid, 'org.gnome.Banshee',
+                   ('application', {'en_GB': 'Banshee Media Player'},
+                    [CAP_NAME])])
+
+    send_status(stream, bare_jid, 'org.gnome.Banshee', 'playing')
+    e = q.expect('dbus-signal', signal='StatusChanged',
+                 interface=ycs.STATUS_IFACE)
+    assertEquals([bare_jid, CAP_NAME, 'org.gnome.Banshee'], e.args[:3])
+
+    assertEquals([bare_jid], discovered('DiscoveredServices').keys())
+    assertEquals([bare_jid], discovered('DiscoveredStatuses').keys())
+
+    # once they go, nothing they advertised is left behind
+    stream.send(make_presence(full_jid, type='unavailable'))
+
+    q.expect_many(
+        EventPattern('dbus-signal', signal='ServiceRemoved',
+                     args=[bare_jid, 'org.gnome.Banshee']),
+        EventPattern('dbus-signal', signal='StatusChanged',
+                     interface=ycs.STATUS_IFACE,
+                     args=[bare_jid, CAP_NAME, 'org.gnome.Banshee', '']))
+
+    assertEquals({}, discovered('DiscoveredServices'))
+    assertEquals({}, discovered('DiscoveredStatuses'))
+
+    # and when they come back with the same caps, their service is new
+    # again rather than skipped for being what they had before
+    send_presence(q, conn, stream, full_jid, client_caps)
+    q.expect('dbus-signal', signal='ServiceAdded',
+             args=[bare_jid, 'org.gnome.Banshee',
+                   ('application', {'en_GB': 'Banshee Media Player'},
+                    [CAP_NAME])])
+
+    assertEquals([bare_jid], discovered('DiscoveredServices').keys())
+
+if __name__ == '__main__':
+    exec_test(test, do_connect=False)
@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2011 Intel Corp.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+import time
+
+from gabbleservicetest import EventPattern, assertContains
+from gabbletest import exec_test, sync_stream
+from gabblecaps_helper import disco_caps
+from pluginconfig import write_config, remove_config
+
+from twisted.words.xish import xpath
+
+SERVICE_FORM = 'urn:ytstenut:capabilities#'
+
+# milliseconds
+WINDOW = 1000
+
+def client(name):
+    uid = 'org.example.' + name
+    return ('client.' + name, [],
+            ['org.freedesktop.ytstenut.xpmn.Channel/uid/' + uid,
+             'org.freedesktop.ytstenut.xpmn.Channel/type/application',
+             'org.freedesktop.ytstenut.xpmn.Channel/name/en_GB/' + name])
+
+def get_ver(e):
+    c_nodes = xpath.queryForNodes('/presence/c', e.stanza)
+
+    if c_nodes is None:
+        return None
+
+    return c_nodes[0]['ver']
+
+def test(q, bus, conn, stream):
+    remove_config()
+
+    conn.Connect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[0, 1])
+
+    # get the initial presence out of the way
+    sync_stream(q, stream)
+
+    # the first client to register goes out straight away...
+    conn.ContactCapabilities.UpdateCapabilities([client('One')])
+
+    e = q.expect('stream-presence')
+    ver = get_ver(e)
+    _, _, dataforms = disco_caps(q, stream, e)
+    assertContains(SERVICE_FORM + 'org.example.One', dataforms)
+
+    # ...but the ones right behind it don't change our caps hash
+    changed = [EventPattern('stream-presence',
+                            predicate=lambda e: get_ver(e) != ver)]
+    q.forbid_events(changed)
+
+    conn.ContactCapabilities.UpdateCapabilities([
+            client('One'), client('Two')])
+    conn.ContactCapabilities.UpdateCapabilities([
+            client('One'), client('Two'), client('Three')])
+
+    sync_stream(q, stream)
+
+    # once the window has closed, the next update has everything
+    time.sleep(WINDOW * 1.5 / 1000)
+    q.unforbid_events(changed)
+
+    conn.ContactCapabilities.UpdateCapabilities([
+            client('One'), client('Two'), client('Three')])
+
+    e = q.expect('stream-presence', predicate=lambda e: get_ver(e) != ver)
+    _, _, dataforms = disco_caps(q, stream, e)
+    assertContains(SERVICE_FORM + 'org.example.One', dataforms)
+    assertContains(SERVICE_FORM + 'org.example.Two', dataforms)
+    assertContains(SERVICE_FORM + 'org.example.Three', dataforms)
+
+if __name__ == '__main__':
+    write_config({'Advertisement': {'debounce-window': WINDOW}})
+    exec_test(test, do_connect=False)
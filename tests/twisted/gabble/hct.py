@@ -24,6 +24,7 @@ from gabbleservicetest import call_async, EventPattern, assertEquals, \
 from gabbletest import exec_test, elem_iq, elem
 from gabblecaps_helper import presence_and_disco, receive_presence_and_ask_caps, \
     disco_caps
+from pluginconfig import write_config, remove_config
 
 import gabbleconstants as cs
 import ns
@@ -40,6 +41,8 @@ features = [
 identity = ['client/pc/en/Lolclient 0.L0L']
 
 def test(q, bus, conn, stream):
+    remove_config()
+
     bare_jid = "test-hct@example.com"
     full_jid = bare_jid + "/LikeLava"
 
@@ -182,4 +185,6 @@ def test(q, bus, conn, stream):
     assertEquals({}, discovered)
 
 if __name__ == '__main__':
+    # every change here is expected to go out as soon as it's made
+    write_config({'Advertisement': {'debounce-window': 0}})
     exec_test(test, do_connect=False)
@@ -17,8 +17,11 @@
 # Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
 # 02110-1301 USA
 
+import dbus
+
 from gabbleservicetest import call_async, EventPattern, assertEquals, ProxyWrapper
-from gabbletest import exec_test, make_result_iq, sync_stream
+from gabbletest import exec_test, make_result_iq, sync_stream, \
+    make_presence
 from gabblecaps_helper import presence_and_disco
 
 from twisted.words.protocols.jabber.client import IQ
@@ -189,12 +192,21 @@ def bad_requests(q, bus, conn, stream):
     # RequestBody
     ensure_error({ycs.REQUEST_BODY: 'no way is this real XML'})
 
+def register_handler(conn, service):
+    conn.ContactCapabilities.UpdateCapabilities([
+            ('the.handler', [dbus.Dictionary({
+                            cs.CHANNEL_TYPE: ycs.CHANNEL_IFACE,
+                            ycs.TARGET_SERVICE: service,
+                            }, signature='sv')], [])])
+
 def setup_incoming_tests(q, bus, conn, stream):
     handle, bare_jid, full_jid = setup_tests(q, bus, conn, stream)
 
     self_handle = conn.GetSelfHandle()
     self_handle_name =  conn.InspectHandles(cs.HT_CONTACT, [self_handle])[0]
 
+    register_handler(conn, 'the.to.service')
+
     iq = IQ(None, 'get')
     iq['id'] = 'le-loldongs'
     iq['from'] = full_jid
@@ -382,9 +394,81 @@ def incoming_fail(q, bus, conn, stream):
     call_async(q, chan, 'Request')
     q.expect('dbus-error', method='Request')
 
+def incoming_unknown_service(q, bus, conn, stream):
+    handle, bare_jid, full_jid = setup_tests(q, bus, conn, stream)
+
+    self_handle = conn.GetSelfHandle()
+    self_handle_name =  conn.InspectHandles(cs.HT_CONTACT, [self_handle])[0]
+
+    register_handler(conn, 'the.to.service')
+
+    # nobody handles this service, so no channel should appear
+    forbidden = [EventPattern('dbus-signal', signal='NewChannels',
+                              predicate=lambda e:
+                                  e.args[0][0][1][cs.CHANNEL_TYPE] == ycs.CHANNEL_IFACE)]
+    q.forbid_events(forbidden)
+
+    iq = IQ(None, 'get')
+    iq['id'] = 'le-nobody-home'
+    iq['from'] = full_jid
+    iq['to'] = self_handle_name
+    msg = iq.addElement((ycs.MESSAGE_NS, 'message'))
+    msg['from-service'] = 'the.from.service'
+    msg['to-service'] = 'the.nobody.service'
+
+    stream.send(iq)
+
+    e = q.expect('stream-iq', iq_type='error', iq_id='le-nobody-home')
+
+    error = [c for c in e.stanza.children if c.name == 'error'][0]
+    assertEquals('cancel', error['type'])
+    assert 'item-not-found' in [c.name for c in error.children], error
+
+    q.unforbid_events(forbidden)
+
+def outgoing_resource_change(q, bus, conn, stream):
+    handle, bare_jid, full_jid = setup_tests(q, bus, conn, stream, True)
+    other_jid = bare_jid + '/ColdColdResource'
+
+    def request():
+        call_async(q, conn.Requests, 'CreateChannel', {
+            cs.CHANNEL_TYPE: ycs.CHANNEL_IFACE,
+            cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+            cs.TARGET_HANDLE: handle,
+            ycs.REQUEST_TYPE: ycs.REQUEST_TYPE_GET,
+            ycs.TARGET_SERVICE: 'the.target.service',
+            ycs.INITIATOR_SERVICE: 'the.initiator.service'
+            })
+        e = q.expect('dbus-return', method='CreateChannel')
+        path, props = e.value
+
+        chan = wrap_channel(bus, conn, path)
+        call_async(q, chan, 'Request')
+
+        e, _ = q.expect_many(
+            EventPattern('stream-iq', query_ns=ycs.MESSAGE_NS),
+            EventPattern('dbus-return', method='Request'))
+        stream.send(make_result_iq(stream, e.stanza))
+
+        return e.stanza['to']
+
+    # the only resource which has the service gets the request
+    assertEquals(full_jid, request())
+
+    # another resource with the same caps turns up, so nothing about
+    # what the contact can do changes, and then the first one goes away
+    stream.send(make_presence(other_jid, status='hello', caps=caps))
+    stream.send(make_presence(full_jid, type='unavailable'))
+    sync_stream(q, stream)
+
+    # the resource picked last time isn't used again
+    assertEquals(other_jid, request())
+
 if __name__ == '__main__':
     exec_test(outgoing_reply)
     exec_test(outgoing_fail)
     exec_test(bad_requests)
     exec_test(incoming_reply)
     exec_test(incoming_fail)
+    exec_test(incoming_unknown_service)
+    exec_test(outgoing_resource_change)
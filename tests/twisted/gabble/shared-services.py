@@ -0,0 +1,142 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2011 Intel Corp.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+import dbus
+
+from gabbleservicetest import call_async, EventPattern, assertEquals, \
+    ProxyWrapper, assertSameSets
+from gabbletest import exec_test
+import yconstants as ycs
+from gabblecaps_helper import *
+
+client = 'http://telepathy.im/fake'
+features = [
+    ns.JINGLE_015,
+    ns.JINGLE_015_AUDIO,
+    ns.JINGLE_015_VIDEO,
+    ns.GOOGLE_P2P,
+    ]
+identity = ['client/pc/en/Lolclient 0.L0L']
+
+NAMES = {'en_GB': 'Banshee Media Player',
+         'fr': 'Banshee Lecteur de Musique'}
+CAPS = ['urn:ytstenut:capabilities:yts-caps-audio',
+        'urn:ytstenut:data:jingle:rtp']
+NEW_CAPS = CAPS + ['urn:ytstenut:capabilities:yts-caps-video']
+
+def banshee(caps):
+    return {
+        'urn:ytstenut:capabilities#org.gnome.Banshee':
+        {'type': ['application'],
+         'name': ['%s/%s' % item for item in NAMES.items()],
+         'capabilities': caps,
+         }
+    }
+
+def check_banshee(details, caps):
+    type, name_map, service_caps = details
+    assertEquals('application', type)
+    assertEquals(NAMES, name_map)
+    assertSameSets(caps, service_caps)
+
+def advertise(q, conn, stream, jid, extra_features, dataforms, initial):
+    """Sends presence for @jid with @dataforms, and answers the disco
+    for it. Each contact's extra features give it a caps hash of its
+    own, so each of them gets asked."""
+    all_features = features + extra_features
+    caps = {'node': client,
+            'ver': compute_caps_hash(identity, all_features, dataforms)}
+    presence_and_disco(q, conn, stream, jid, True, client, caps,
+                       all_features, identity, dataforms, initial)
+
+def test(q, bus, conn, stream):
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+
+    conn.Connect()
+
+    e = q.expect('dbus-return', method='EnsureSidecar')
+    path, props = e.value
+
+    status = ProxyWrapper(bus.get_object(conn.bus_name, path),
+                          ycs.STATUS_IFACE, {})
+
+    def discovered():
+        return status.Get(ycs.STATUS_IFACE, 'DiscoveredServices',
+                          dbus_interface=dbus.PROPERTIES_IFACE)
+
+    one = 'test-shared-one@example.com'
+    two = 'test-shared-two@example.com'
+
+    def expect_added(jid):
+        e, _ = q.expect_many(
+            EventPattern('dbus-signal', signal='ServiceAdded',
+                         predicate=lambda e: e.args[0] == jid),
+            EventPattern('dbus-signal', signal='ServicesChanged',
+                         interface=ycs.STATUS_FUTURE_IFACE,
+                         predicate=lambda e: jid in e.args[0]))
+        check_banshee(e.args[2], CAPS)
+
+    # two contacts with exactly the same service
+    advertise(q, conn, stream, one + '/Resource',
+              ['http://example.com/one'], banshee(CAPS), True)
+    expect_added(one)
+
+    advertise(q, conn, stream, two + '/Resource',
+              ['http://example.com/two'], banshee(CAPS), True)
+    expect_added(two)
+
+    # the first one's caps change, but not in any way which touches its
+    # services, so nobody hears about it
+    forbidden = [EventPattern('dbus-signal', signal='ServiceAdded',
+                              predicate=lambda e: e.args[0] == one),
+                 EventPattern('dbus-signal', signal='ServiceRemoved',
+                              predicate=lambda e: e.args[0] == one),
+                 EventPattern('dbus-signal', signal='ServicesChanged',
+                              interface=ycs.STATUS_FUTURE_IFACE,
+                              predicate=lambda e: one in e.args[0]
+                                  or one in e.args[1])]
+    q.forbid_events(forbidden)
+
+    advertise(q, conn, stream, one + '/Resource',
+              ['http://example.com/one', 'http://example.com/more'],
+              banshee(CAPS), False)
+
+    # the second one's service changes; by the time that comes out, the
+    # first one's change would have gone with it
+    advertise(q, conn, stream, two + '/Resource',
+              ['http://example.com/two'], banshee(NEW_CAPS), False)
+
+    e = q.expect('dbus-signal', signal='ServicesChanged',
+                 interface=ycs.STATUS_FUTURE_IFACE)
+    added, removed = e.args
+    assertEquals([two], added.keys())
+    assertEquals(['org.gnome.Banshee'], added[two].keys())
+    check_banshee(added[two]['org.gnome.Banshee'], NEW_CAPS)
+    assertEquals({}, removed)
+
+    q.unforbid_events(forbidden)
+
+    # and only the second one's details have changed
+    services = discovered()
+    assertSameSets([one, two], services.keys())
+    check_banshee(services[one]['org.gnome.Banshee'], CAPS)
+    check_banshee(services[two]['org.gnome.Banshee'], NEW_CAPS)
+
+if __name__ == '__main__':
+    exec_test(test)
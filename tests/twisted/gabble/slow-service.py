@@ -131,6 +131,11 @@ def test(q, bus, conn, stream):
                        ['urn:ytstenut:capabilities:pics'])}
                 }, discovered)
 
+    # there was only the one contact to look at
+    complete = status.Get(ycs.STATUS_FUTURE_IFACE, 'ScanComplete',
+                          dbus_interface=dbus.PROPERTIES_IFACE)
+    assertEquals(True, complete)
+
     # sweet.
 
 if __name__ == '__main__':
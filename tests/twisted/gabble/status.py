@@ -20,11 +20,13 @@
 import dbus
 
 from gabbleservicetest import call_async, EventPattern, assertEquals, \
-    ProxyWrapper, assertNotEquals
-from gabbletest import exec_test, make_result_iq, acknowledge_iq
+    ProxyWrapper, assertNotEquals, sync_dbus
+from gabbletest import exec_test, make_result_iq, acknowledge_iq, \
+    send_error_reply
 import gabbleconstants as cs
 import yconstants as ycs
 from gabblecaps_helper import *
+from pluginconfig import write_config, remove_config
 
 from twisted.words.xish import xpath
 from twisted.words.xish.domish import Element
@@ -111,6 +113,7 @@ def test(q, bus, conn, stream):
     e = q.expect('dbus-return', method='EnsureSidecar')
     path, props = e.value
     assertEquals({}, props)
+    remove_config()
 
     status = ProxyWrapper(bus.get_object(conn.bus_name, path),
                           ycs.STATUS_IFACE, {})
@@ -154,8 +157,8 @@ def test(q, bus, conn, stream):
     call_async(q, status, 'AdvertiseStatus', CAP_NAME,
                'ants.in.their.pants', el.toXml())
 
-    e, _ = q.expect_many(EventPattern('stream-iq'),
-                         EventPattern('dbus-return', method='AdvertiseStatus'))
+    # it doesn't return until the server says yes
+    e = q.expect('stream-iq')
 
     status_el, desc = check_pep_set(e.stanza)
     assertEquals('messing-with-your-stuff', status_el['activity'])
@@ -164,6 +167,7 @@ def test(q, bus, conn, stream):
     assertEquals('Yeah sorry about that', desc.children[0])
 
     acknowledge_iq(stream, e.stanza)
+    q.expect('dbus-return', method='AdvertiseStatus')
     send_back_pep_event(stream, status_el)
 
     sig = q.expect('dbus-signal', signal='StatusChanged',
@@ -190,8 +194,8 @@ def test(q, bus, conn, stream):
     call_async(q, status, 'AdvertiseStatus', CAP_NAME,
                'bananaman.on.holiday', el.toXml())
 
-    e, _ = q.expect_many(EventPattern('stream-iq'),
-                         EventPattern('dbus-return', method='AdvertiseStatus'))
+    # it doesn't return until the server says yes
+    e = q.expect('stream-iq')
 
     status_el, desc = check_pep_set(e.stanza)
     assertEquals('rofling', status_el['activity'])
@@ -200,6 +204,7 @@ def test(q, bus, conn, stream):
     assertEquals('U MAD?', desc.children[0])
 
     acknowledge_iq(stream, e.stanza)
+    q.expect('dbus-return', method='AdvertiseStatus')
     send_back_pep_event(stream, status_el)
 
     sig = q.expect('dbus-signal', signal='StatusChanged',
@@ -223,8 +228,8 @@ def test(q, bus, conn, stream):
     call_async(q, status, 'AdvertiseStatus', CAP_NAME,
                'ants.in.their.pants', '')
 
-    e, _, = q.expect_many(EventPattern('stream-iq'),
-                          EventPattern('dbus-return', method='AdvertiseStatus'))
+    # it doesn't return until the server says yes
+    e = q.expect('stream-iq')
 
     status_el, desc = check_pep_set(e.stanza)
     assertEquals('ants.in.their.pants', status_el['from-service'])
@@ -233,6 +238,7 @@ def test(q, bus, conn, stream):
     assertEquals([], status_el.children)
 
     acknowledge_iq(stream, e.stanza)
+    q.expect('dbus-return', method='AdvertiseStatus')
     send_back_pep_event(stream, status_el)
 
     sig = q.expect('dbus-signal', signal='StatusChanged',
@@ -255,8 +261,8 @@ def test(q, bus, conn, stream):
     call_async(q, status, 'AdvertiseStatus', CAP_NAME,
                'bananaman.on.holiday', '')
 
-    e, _ = q.expect_many(EventPattern('stream-iq'),
-                         EventPattern('dbus-return', method='AdvertiseStatus'))
+    # it doesn't return until the server says yes
+    e = q.expect('stream-iq')
 
     # check message
     status_el, desc = check_pep_set(e.stanza)
@@ -266,6 +272,7 @@ def test(q, bus, conn, stream):
     assertEquals([], status_el.children)
 
     acknowledge_iq(stream, e.stanza)
+    q.expect('dbus-return', method='AdvertiseStatus')
     send_back_pep_event(stream, status_el)
 
     sig = q.expect('dbus-signal', signal='StatusChanged',
@@ -282,5 +289,105 @@ def test(q, bus, conn, stream):
                             dbus_interface=dbus.PROPERTIES_IFACE)
     assertEquals({}, discovered)
 
+    # only a few publishes wait for the server at once
+    def publish_for(service):
+        return EventPattern('stream-iq', query_ns=ns.PUBSUB,
+            predicate=lambda e: check_pep_set(e.stanza)[0]['from-service'] == service)
+
+    services = ['window.%d' % i for i in range(5)]
+    waiting = publish_for(services[4])
+    q.forbid_events([waiting])
+
+    for service in services:
+        call_async(q, status, 'AdvertiseStatus', CAP_NAME, service, '')
+
+    in_flight = [q.expect_many(publish_for(service))[0]
+                 for service in services[:4]]
+    sync_dbus(bus, q, conn)
+
+    # once the server acknowledges one, that call returns and the last
+    # one can go
+    q.unforbid_events([waiting])
+    acknowledge_iq(stream, in_flight[0].stanza)
+    _, e = q.expect_many(EventPattern('dbus-return', method='AdvertiseStatus'),
+                         waiting)
+    in_flight.append(e)
+
+    for e in in_flight[1:]:
+        acknowledge_iq(stream, e.stanza)
+
+    q.expect_many(*[EventPattern('dbus-return', method='AdvertiseStatus')
+                    for e in in_flight[1:]])
+
+    # if the server refuses a status, AdvertiseStatus fails
+    call_async(q, status, 'AdvertiseStatus', CAP_NAME, 'refused.service', '')
+    e = q.expect_many(publish_for('refused.service'))[0]
+    send_error_reply(stream, e.stanza)
+    q.expect('dbus-error', method='AdvertiseStatus', name=cs.NOT_AVAILABLE)
+
+def no_wait(q, bus, conn, stream):
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+    conn.Connect()
+
+    e = q.expect('dbus-return', method='EnsureSidecar')
+    path, props = e.value
+
+    status = ProxyWrapper(bus.get_object(conn.bus_name, path),
+                          ycs.STATUS_IFACE,
+                          {'Future': ycs.STATUS_FUTURE_IFACE})
+
+    # by default, the methods return without waiting for the server, so
+    # a refusal goes unreported
+    call_async(q, status, 'AdvertiseStatus', CAP_NAME, 'one.service', '')
+
+    e, _ = q.expect_many(
+        EventPattern('stream-iq', query_ns=ns.PUBSUB),
+        EventPattern('dbus-return', method='AdvertiseStatus'))
+    send_error_reply(stream, e.stanza)
+
+    call_async(q, status.Future, 'AdvertiseStatuses',
+               [(CAP_NAME, 'two.service', ''),
+                (CAP_NAME, 'three.service', '')])
+
+    q.expect('dbus-return', method='AdvertiseStatuses')
+
+def publish_window(q, bus, conn, stream):
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+    conn.Connect()
+
+    # the sidecar has read plugins.conf by the time it's been made
+    e = q.expect('dbus-return', method='EnsureSidecar')
+    path, props = e.value
+    remove_config()
+
+    status = ProxyWrapper(bus.get_object(conn.bus_name, path),
+                          ycs.STATUS_IFACE, {})
+
+    def publish_for(service):
+        return EventPattern('stream-iq', query_ns=ns.PUBSUB,
+            predicate=lambda e: check_pep_set(e.stanza)[0]['from-service'] == service)
+
+    # plugins.conf only lets one publish wait for the server at a time
+    waiting = publish_for('second.service')
+    q.forbid_events([waiting])
+
+    call_async(q, status, 'AdvertiseStatus', CAP_NAME, 'first.service', '')
+    call_async(q, status, 'AdvertiseStatus', CAP_NAME, 'second.service', '')
+
+    e = q.expect_many(publish_for('first.service'))[0]
+    sync_dbus(bus, q, conn)
+
+    q.unforbid_events([waiting])
+    acknowledge_iq(stream, e.stanza)
+
+    e = q.expect_many(waiting)[0]
+    acknowledge_iq(stream, e.stanza)
+
 if __name__ == '__main__':
+    write_config({'Status': {'wait-for-ack': True}})
     exec_test(test, do_connect=False)
+
+    exec_test(no_wait, do_connect=False)
+
+    write_config({'Status': {'publish-window': 1}})
+    exec_test(publish_window, do_connect=False)
@@ -0,0 +1,36 @@
+# Helpers for tests which need settings from plugins.conf; see README.
+#
+# The plugins read it when a connection is made, so write it before
+# exec_test() and remove it again once the test has started.
+
+import os
+
+def config_path():
+    return os.path.join(os.environ['XDG_CONFIG_HOME'], 'ytstenut',
+                        'plugins.conf')
+
+def write_config(groups):
+    """Writes {group: {key: value}} out as plugins.conf"""
+    path = config_path()
+    directory = os.path.dirname(path)
+
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    f = open(path, 'w')
+
+    for group, settings in groups.items():
+        f.write('[%s]\n' % group)
+
+        for key, value in settings.items():
+            if isinstance(value, bool):
+                value = value and 'true' or 'false'
+            f.write('%s=%s\n' % (key, value))
+
+    f.close()
+
+def remove_config():
+    try:
+        os.remove(config_path())
+    except OSError:
+        pass
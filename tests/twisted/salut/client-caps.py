@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2011 Intel Corp.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+import avahi
+
+from salutservicetest import assertContains, assertDoesNotContain
+from saluttest import exec_test, elem_iq, elem
+from avahitest import AvahiListener, txt_get_key, get_host_name
+from xmppstream import connect_to_stream
+from pluginconfig import write_config, remove_config
+import salutconstants as cs
+import ns
+
+from twisted.words.xish import xpath
+
+INTERESTED = 'org.freedesktop.ytstenut.xpmn.Channel/interested/'
+
+CAP_NAME = 'urn:ytstenut:capabilities:h264-over-ants'
+OTHER_CAP_NAME = 'urn:ytstenut:capabilities:pants-over-h264'
+
+def test(q, bus, conn):
+    remove_config()
+
+    contact_name = "test-client-caps@" + get_host_name()
+
+    conn.Connect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[0, 0])
+
+    self_handle = conn.GetSelfHandle()
+    self_handle_name = conn.InspectHandles(cs.HT_CONTACT, [self_handle])[0]
+
+    AvahiListener(q).listen_for_service("_presence._tcp")
+    e = q.expect('service-added', name=self_handle_name,
+        protocol=avahi.PROTO_INET)
+    service = e.service
+    service.resolve()
+
+    e = q.expect('service-resolved', service=service)
+    vers = [txt_get_key(e.txt, 'ver')]
+
+    outbound = connect_to_stream(q, contact_name,
+        self_handle_name, str(e.pt), e.port)
+    e = q.expect('connection-result')
+    assert e.succeeded, e.reason
+    q.expect('stream-opened', connection=outbound)
+
+    def update(client, tokens):
+        """Has @client represent @tokens, and returns our features once
+        they've changed because of it"""
+        conn.ContactCapabilities.UpdateCapabilities([(client, [], tokens)])
+
+        e = q.expect('service-resolved', service=service,
+                     predicate=lambda e: txt_get_key(e.txt, 'ver') != vers[-1])
+        node = txt_get_key(e.txt, 'node')
+        ver = txt_get_key(e.txt, 'ver')
+        vers.append(ver)
+
+        request = \
+            elem_iq(outbound, 'get', from_=contact_name)(
+              elem(ns.DISCO_INFO, 'query', node=node + '#' + ver)
+            )
+        outbound.send(request)
+
+        e = q.expect('stream-iq', connection=outbound, iq_id=request['id'])
+        return [f['var'] for f in
+                xpath.queryForNodes('/iq/query/feature', e.stanza)]
+
+    # a client which only wants to hear about statuses, so has no uid,
+    # still gets its interest advertised, as <capability>+notify
+    features = update('client.a', [INTERESTED + CAP_NAME])
+    assertContains(CAP_NAME + '+notify', features)
+    assertDoesNotContain(CAP_NAME, features)
+
+    # a second client is interested in the same thing and something else
+    features = update('client.b', [INTERESTED + CAP_NAME,
+                                   INTERESTED + OTHER_CAP_NAME])
+    assertContains(CAP_NAME + '+notify', features)
+    assertContains(OTHER_CAP_NAME + '+notify', features)
+
+    # the first one going away doesn't change what we advertise, so
+    # nothing is re-announced for that on its own...
+    conn.ContactCapabilities.UpdateCapabilities([('client.a', [], [])])
+
+    # ...and the shared feature is still there once something else does
+    features = update('client.b', [INTERESTED + CAP_NAME])
+    assertContains(CAP_NAME + '+notify', features)
+    assertDoesNotContain(OTHER_CAP_NAME + '+notify', features)
+
+    # until the last client interested in it goes too
+    features = update('client.b', [])
+    assertDoesNotContain(CAP_NAME + '+notify', features)
+
+if __name__ == '__main__':
+    # every change here is expected to go out as soon as it's made
+    write_config({'Advertisement': {'debounce-window': 0}})
+    exec_test(test)
@@ -0,0 +1,146 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2011 Intel Corp.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+import avahi
+
+from salutservicetest import call_async, EventPattern, assertEquals, \
+    assertContains, assertSameSets
+from saluttest import exec_test, elem_iq, elem
+from avahitest import AvahiListener, txt_get_key, get_host_name
+from xmppstream import connect_to_stream
+from caps_helper import service_digest
+from pluginconfig import write_config, remove_config
+import salutconstants as cs
+import ns
+import yconstants as ycs
+
+from twisted.words.xish import xpath
+
+INDEX_NS = 'urn:ytstenut:index'
+SERVICE_FORM = 'urn:ytstenut:capabilities#'
+
+UID = 'org.gnome.Banshee'
+TYPE = 'application'
+NAMES = ['en_GB/Banshee Media Player',
+         'fr/Banshee Lecteur de Musique']
+CAPS = ['urn:ytstenut:capabilities:yts-caps-audio',
+        'urn:ytstenut:data:jingle:rtp']
+
+def get_forms(stanza):
+    forms = {}
+
+    for x in xpath.queryForNodes('/iq/query/x', stanza) or []:
+        name = None
+        fields = {}
+
+        for field in xpath.queryForNodes('/x/field', x):
+            values = [str(v) for v in
+                      xpath.queryForNodes('/field/value', field) or []]
+
+            if field['var'] == 'FORM_TYPE':
+                name = values[0]
+            else:
+                fields[field['var']] = values
+
+        forms[name] = fields
+
+    return forms
+
+def test(q, bus, conn):
+    remove_config()
+
+    contact_name = "test-compact@" + get_host_name()
+
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+    conn.Connect()
+
+    q.expect('dbus-signal', signal='StatusChanged', args=[0, 0])
+    q.expect('dbus-return', method='EnsureSidecar')
+
+    self_handle = conn.GetSelfHandle()
+    self_handle_name =  conn.InspectHandles(cs.HT_CONTACT, [self_handle])[0]
+
+    AvahiListener(q).listen_for_service("_presence._tcp")
+    e = q.expect('service-added', name = self_handle_name,
+        protocol = avahi.PROTO_INET)
+    service = e.service
+    service.resolve()
+
+    q.expect('service-resolved', service=service)
+
+    conn.ContactCapabilities.UpdateCapabilities([
+        ('well.gnome.name', [],
+         ['org.freedesktop.ytstenut.xpmn.Channel/uid/' + UID,
+          'org.freedesktop.ytstenut.xpmn.Channel/type/' + TYPE] +
+         ['org.freedesktop.ytstenut.xpmn.Channel/name/' + n for n in NAMES] +
+         ['org.freedesktop.ytstenut.xpmn.Channel/caps/' + c for c in CAPS])])
+
+    e, _ = q.expect_many(EventPattern('service-resolved', service=service),
+                         EventPattern('dbus-signal', signal='ServiceAdded'))
+    node = txt_get_key(e.txt, 'node')
+    ver = txt_get_key(e.txt, 'ver')
+
+    outbound = connect_to_stream(q, contact_name,
+        self_handle_name, str(e.pt), e.port)
+    e = q.expect('connection-result')
+    assert e.succeeded, e.reason
+    e = q.expect('stream-opened', connection=outbound)
+
+    def disco(node):
+        request = \
+            elem_iq(outbound, 'get', from_=contact_name)(
+              elem(ns.DISCO_INFO, 'query', node=node)
+            )
+        outbound.send(request)
+
+        return q.expect('stream-iq', connection=outbound,
+                        iq_id=request['id'])
+
+    # our caps just have the summary, and say we understand it
+    e = disco(node + '#' + ver)
+    features = [f['var'] for f in
+                xpath.queryForNodes('/iq/query/feature', e.stanza)]
+    assertContains(INDEX_NS, features)
+
+    digest = service_digest(UID, TYPE, NAMES, CAPS)
+    assertEquals({INDEX_NS: {'services': ['%s/%s' % (UID, digest)]}},
+                 get_forms(e.stanza))
+
+    # peers ask for the details of the service separately
+    e = disco(INDEX_NS + '#' + UID)
+    assertEquals('result', e.stanza['type'])
+
+    forms = get_forms(e.stanza)
+    assertEquals([SERVICE_FORM + UID], forms.keys())
+    form = forms[SERVICE_FORM + UID]
+    assertEquals([TYPE], form['type'])
+    assertSameSets(NAMES, form['name'])
+    assertSameSets(CAPS, form['capabilities'])
+
+    # and get an error for one we don't have
+    e = disco(INDEX_NS + '#org.gnome.Nothing')
+    assertEquals('error', e.stanza['type'])
+    assert xpath.queryForNodes('/iq/error/item-not-found', e.stanza), \
+        e.stanza.toXml()
+
+if __name__ == '__main__':
+    write_config({
+        'Advertisement': { 'compact-advertisement': True },
+        })
+    exec_test(test)
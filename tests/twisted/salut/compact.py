@@ -0,0 +1,152 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2011 Intel Corp.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+import dbus
+
+from salutservicetest import call_async, EventPattern, assertEquals, \
+    ProxyWrapper, assertSameSets
+from saluttest import exec_test, wait_for_contact_in_publish, make_result_iq
+import yconstants as ycs
+from caps_helper import *
+
+from twisted.words.xish import xpath
+
+from avahitest import AvahiAnnouncer
+from avahitest import get_host_name
+from xmppstream import setup_stream_listener
+
+CLIENT_NAME = 'il-cliente-del-futuro'
+
+INDEX_NS = 'urn:ytstenut:index'
+
+UID = 'org.gnome.Banshee'
+TYPE = 'application'
+NAMES = ['en_GB/Banshee Media Player',
+         'fr/Banshee Lecteur de Musique']
+CAPS = ['urn:ytstenut:capabilities:yts-caps-audio',
+        'urn:ytstenut:data:jingle:rtp']
+
+def test(q, bus, conn):
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+
+    conn.Connect()
+
+    e = q.expect('dbus-return', method='EnsureSidecar')
+    path, props = e.value
+    assertEquals({}, props)
+
+    status = ProxyWrapper(bus.get_object(conn.bus_name, path),
+                          ycs.STATUS_IFACE, {})
+
+    # a contact which only lists its services in a summary
+    digest = service_digest(UID, TYPE, NAMES, CAPS)
+    index = { INDEX_NS: { 'services': ['%s/%s' % (UID, digest)] } }
+
+    ver = compute_caps_hash([], [INDEX_NS], index)
+    txt_record = { "txtvers": "1", "status": "avail",
+        "node": CLIENT_NAME, "ver": ver, "hash": "sha-1"}
+    contact_name = "test-service@" + get_host_name()
+    listener, port = setup_stream_listener(q, contact_name)
+
+    announcer = AvahiAnnouncer(contact_name, "_presence._tcp", port, txt_record)
+
+    handle = wait_for_contact_in_publish(q, bus, conn, contact_name)
+
+    e = q.expect('incoming-connection', listener=listener)
+    incoming = e.connection
+
+    # Salut looks up its capabilities
+    event = q.expect('stream-iq', connection=incoming,
+        query_ns=ns.DISCO_INFO)
+    query_node = xpath.queryForNodes('/iq/query', event.stanza)[0]
+    assertEquals(CLIENT_NAME + '#' + ver, query_node.attributes['node'])
+
+    result = make_result_iq(event.stanza)
+    query = result.firstChildElement()
+    query['node'] = CLIENT_NAME + '#' + ver
+
+    feature = query.addElement((None, 'feature'))
+    feature['var'] = INDEX_NS
+
+    x = query.addElement((ns.X_DATA, 'x'))
+    x['type'] = 'result'
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'FORM_TYPE'
+    field['type'] = 'hidden'
+    field.addElement((None, 'value'), content=INDEX_NS)
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'services'
+    field['type'] = 'text-multi'
+    field.addElement((None, 'value'), content='%s/%s' % (UID, digest))
+
+    incoming.send(result)
+
+    # now it asks for the details of the one service
+    event = q.expect('stream-iq', connection=incoming,
+        query_ns=ns.DISCO_INFO,
+        predicate=lambda e: xpath.queryForNodes('/iq/query', e.stanza)[0]
+            .getAttribute('node') == INDEX_NS + '#' + UID)
+
+    result = make_result_iq(event.stanza)
+    query = result.firstChildElement()
+
+    x = query.addElement((ns.X_DATA, 'x'))
+    x['type'] = 'result'
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'FORM_TYPE'
+    field['type'] = 'hidden'
+    field.addElement((None, 'value'), content='urn:ytstenut:capabilities#' + UID)
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'type'
+    field.addElement((None, 'value'), content=TYPE)
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'name'
+    for name in NAMES:
+        field.addElement((None, 'value'), content=name)
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'capabilities'
+    for cap in CAPS:
+        field.addElement((None, 'value'), content=cap)
+
+    incoming.send(result)
+
+    e = q.expect('dbus-signal', signal='ServiceAdded')
+
+    contact_id, service_name, details = e.args
+    assertEquals(contact_name, contact_id)
+    assertEquals(UID, service_name)
+
+    type, name_map, caps = details
+    assertEquals(TYPE, type)
+    assertEquals({'en_GB': 'Banshee Media Player',
+                  'fr': 'Banshee Lecteur de Musique'}, name_map)
+    assertSameSets(CAPS, caps)
+
+    discovered = status.Get(ycs.STATUS_IFACE, 'DiscoveredServices',
+                            dbus_interface=dbus.PROPERTIES_IFACE)
+    assertEquals([UID], discovered[contact_name].keys())
+
+if __name__ == '__main__':
+    exec_test(test)
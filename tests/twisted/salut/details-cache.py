@@ -0,0 +1,221 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2011 Intel Corp.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+import os
+
+from salutservicetest import call_async, EventPattern, assertEquals, \
+    assertSameSets
+from saluttest import exec_test, make_connection, \
+    wait_for_contact_in_publish, make_result_iq
+import salutconstants as cs
+import yconstants as ycs
+from caps_helper import *
+
+from twisted.words.xish import xpath
+
+from avahitest import AvahiAnnouncer
+from avahitest import get_host_name
+from xmppstream import setup_stream_listener
+
+CLIENT_NAME = 'il-cliente-del-futuro'
+
+INDEX_NS = 'urn:ytstenut:index'
+
+UID = 'org.gnome.Banshee'
+TYPE = 'application'
+NAMES = ['en_GB/Banshee Media Player',
+         'fr/Banshee Lecteur de Musique']
+CAPS = ['urn:ytstenut:capabilities:yts-caps-audio',
+        'urn:ytstenut:data:jingle:rtp']
+
+def cache_path():
+    return os.path.join(os.environ['XDG_CACHE_HOME'], 'ytstenut',
+                        'service-details')
+
+def write_cache(contents):
+    path = cache_path()
+    directory = os.path.dirname(path)
+
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    f = open(path, 'wb')
+    f.write(contents)
+    f.close()
+
+def is_details_query(e):
+    return xpath.queryForNodes('/iq/query', e.stanza)[0] \
+        .getAttribute('node') == INDEX_NS + '#' + UID
+
+def start(q, bus, conn):
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+    conn.Connect()
+    q.expect('dbus-return', method='EnsureSidecar')
+
+def stop(q, conn):
+    call_async(q, conn, 'Disconnect')
+    q.expect_many(EventPattern('dbus-signal', signal='StatusChanged',
+                               path=conn.object_path,
+                               args=[cs.CONN_STATUS_DISCONNECTED,
+                                     cs.CSR_REQUESTED]),
+                  EventPattern('dbus-return', method='Disconnect'))
+
+def announce(q, bus, conn, contact_name, extra_feature):
+    """Announces a contact which lists the one service in a summary. The
+    extra feature gives each one its own caps hash, so nothing can have
+    their caps already."""
+    digest = service_digest(UID, TYPE, NAMES, CAPS)
+    index = { INDEX_NS: { 'services': ['%s/%s' % (UID, digest)] } }
+    features = [INDEX_NS, extra_feature]
+
+    ver = compute_caps_hash([], features, index)
+    txt_record = { "txtvers": "1", "status": "avail",
+        "node": CLIENT_NAME, "ver": ver, "hash": "sha-1"}
+    listener, port = setup_stream_listener(q, contact_name)
+
+    announcer = AvahiAnnouncer(contact_name, "_presence._tcp", port,
+                               txt_record)
+
+    wait_for_contact_in_publish(q, bus, conn, contact_name)
+
+    e = q.expect('incoming-connection', listener=listener)
+    incoming = e.connection
+
+    event = q.expect('stream-iq', connection=incoming,
+        query_ns=ns.DISCO_INFO)
+
+    result = make_result_iq(event.stanza)
+    query = result.firstChildElement()
+    query['node'] = CLIENT_NAME + '#' + ver
+
+    for f in features:
+        feature = query.addElement((None, 'feature'))
+        feature['var'] = f
+
+    x = query.addElement((ns.X_DATA, 'x'))
+    x['type'] = 'result'
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'FORM_TYPE'
+    field['type'] = 'hidden'
+    field.addElement((None, 'value'), content=INDEX_NS)
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'services'
+    field['type'] = 'text-multi'
+    field.addElement((None, 'value'), content='%s/%s' % (UID, digest))
+
+    incoming.send(result)
+
+    return announcer, incoming
+
+def send_details(q, incoming):
+    event = q.expect('stream-iq', connection=incoming,
+        query_ns=ns.DISCO_INFO, predicate=is_details_query)
+
+    result = make_result_iq(event.stanza)
+    query = result.firstChildElement()
+
+    x = query.addElement((ns.X_DATA, 'x'))
+    x['type'] = 'result'
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'FORM_TYPE'
+    field['type'] = 'hidden'
+    field.addElement((None, 'value'),
+                     content='urn:ytstenut:capabilities#' + UID)
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'type'
+    field.addElement((None, 'value'), content=TYPE)
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'name'
+    for name in NAMES:
+        field.addElement((None, 'value'), content=name)
+
+    field = x.addElement((None, 'field'))
+    field['var'] = 'capabilities'
+    for cap in CAPS:
+        field.addElement((None, 'value'), content=cap)
+
+    incoming.send(result)
+
+def expect_service(q, contact_name):
+    e = q.expect('dbus-signal', signal='ServiceAdded',
+                 predicate=lambda e: e.args[0] == contact_name)
+
+    _, service_name, details = e.args
+    assertEquals(UID, service_name)
+
+    type, name_map, caps = details
+    assertEquals(TYPE, type)
+    assertEquals({'en_GB': 'Banshee Media Player',
+                  'fr': 'Banshee Lecteur de Musique'}, name_map)
+    assertSameSets(CAPS, caps)
+
+def test(q, bus, conn):
+    # a broken cache is ignored, so the details get fetched
+    write_cache('this is not a cache\n')
+    start(q, bus, conn)
+
+    contact_name = 'test-cache-1@' + get_host_name()
+    _, incoming = announce(q, bus, conn, contact_name,
+                           'http://example.com/first')
+    send_details(q, incoming)
+    expect_service(q, contact_name)
+
+    # they're written out when the connection goes away, and the next
+    # one knows them without asking anyone
+    stop(q, conn)
+    assert os.path.exists(cache_path())
+
+    details_query = EventPattern('stream-iq', query_ns=ns.DISCO_INFO,
+                                 predicate=is_details_query)
+    q.forbid_events([details_query])
+
+    conn = make_connection(bus, q.append,
+                           {'published-name': 'testsuite-again'})
+    start(q, bus, conn)
+
+    contact_name = 'test-cache-2@' + get_host_name()
+    announce(q, bus, conn, contact_name, 'http://example.com/second')
+    expect_service(q, contact_name)
+
+    stop(q, conn)
+    q.unforbid_events([details_query])
+
+    # a cache which is fine as a GVariant, but of the wrong type (here,
+    # a variant holding the string 'hello'), is ignored too
+    write_cache('hello\0\0s')
+
+    conn = make_connection(bus, q.append,
+                           {'published-name': 'testsuite-once-more'})
+    start(q, bus, conn)
+
+    contact_name = 'test-cache-3@' + get_host_name()
+    _, incoming = announce(q, bus, conn, contact_name,
+                           'http://example.com/third')
+    send_details(q, incoming)
+    expect_service(q, contact_name)
+
+    stop(q, conn)
+
+if __name__ == '__main__':
+    exec_test(test)
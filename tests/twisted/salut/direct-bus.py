@@ -0,0 +1,94 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2011 Intel Corp.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+import dbus
+import dbus.connection
+from dbus.mainloop.glib import DBusGMainLoop
+
+from salutservicetest import call_async, EventPattern, Event, \
+    assertEquals, ProxyWrapper
+from saluttest import exec_test
+import yconstants as ycs
+
+from twisted.words.xish.domish import Element
+
+CAP_NAME = 'urn:ytstenut:capabilities:h264-over-ants'
+
+def test(q, bus, conn):
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+
+    conn.Connect()
+
+    e = q.expect('dbus-return', method='EnsureSidecar')
+    path, props = e.value
+    assertEquals({}, props)
+
+    status = ProxyWrapper(bus.get_object(conn.bus_name, path),
+                          ycs.STATUS_IFACE,
+                          {'Future': ycs.STATUS_FUTURE_IFACE})
+
+    def get(proxy, name):
+        return proxy.Get(ycs.STATUS_FUTURE_IFACE, name,
+                         dbus_interface=dbus.PROPERTIES_IFACE)
+
+    # nobody's listening until someone asks
+    assertEquals('', get(status, 'DirectBusAddress'))
+    assertEquals('/', get(status, 'DirectBusPath'))
+
+    address, direct_path = status.Future.EnableDirectBus()
+    assert direct_path.startswith(conn.object_path + '/'), direct_path
+    assertEquals(address, get(status, 'DirectBusAddress'))
+    assertEquals(direct_path, get(status, 'DirectBusPath'))
+
+    # asking again gets the same one
+    assertEquals([address, direct_path],
+                 list(status.Future.EnableDirectBus()))
+
+    peer = dbus.connection.Connection(address, mainloop=DBusGMainLoop())
+    direct = ProxyWrapper(peer.get_object(None, direct_path),
+                          ycs.STATUS_IFACE,
+                          {'Future': ycs.STATUS_FUTURE_IFACE})
+
+    # it's the same object at the other end
+    assertEquals(address, get(direct, 'DirectBusAddress'))
+    assertEquals({}, direct.Future.GetStatusesForContact('nobody@nowhere'))
+
+    # methods can be called and signals come back without the bus daemon
+    peer.add_signal_receiver(
+        lambda *args: q.append(Event('direct-signal', args=args)),
+        signal_name='StatusChanged', dbus_interface=ycs.STATUS_IFACE,
+        path=direct_path)
+
+    el = Element((ycs.STATUS_NS, 'status'))
+    el['activity'] = 'going-direct'
+
+    call_async(q, direct, 'AdvertiseStatus', CAP_NAME,
+               'ants.in.their.pants', el.toXml())
+
+    _, sig, direct_sig = q.expect_many(
+        EventPattern('dbus-return', method='AdvertiseStatus'),
+        EventPattern('dbus-signal', signal='StatusChanged',
+                     interface=ycs.STATUS_IFACE),
+        EventPattern('direct-signal'))
+    assertEquals(sig.args, list(direct_sig.args))
+
+    peer.close()
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -25,11 +25,14 @@ from salutservicetest import call_async, EventPattern, assertEquals, \
 from saluttest import exec_test, elem_iq, elem
 from avahitest import AvahiAnnouncer, AvahiListener, txt_get_key, get_host_name
 from xmppstream import connect_to_stream
+from pluginconfig import write_config, remove_config
 import salutconstants as cs
 import ns
 import yconstants as ycs
 
 def test(q, bus, conn):
+    remove_config()
+
     contact_name = "test-hct@" + get_host_name()
 
     call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
@@ -195,4 +198,6 @@ def test(q, bus, conn):
     assertEquals({}, discovered)
 
 if __name__ == '__main__':
+    # every change here is expected to go out as soon as it's made
+    write_config({'Advertisement': {'debounce-window': 0}})
     exec_test(test)
@@ -17,6 +17,8 @@
 # Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
 # 02110-1301 USA
 
+import dbus
+
 from salutservicetest import call_async, EventPattern, assertEquals, ProxyWrapper
 from saluttest import exec_test, wait_for_contact_in_publish, \
     make_result_iq
@@ -32,6 +34,7 @@ import avahi
 import salutconstants as cs
 import yconstants as ycs
 import ns
+from pluginconfig import write_config, remove_config
 
 def wrap_channel(bus, conn, path):
     return ProxyWrapper(bus.get_object(conn.bus_name, path),
@@ -118,6 +121,78 @@ def outgoing_reply(q, bus, conn):
     assertEquals('<?xml version="1.0" encoding="UTF-8"?>\n' \
                  + '<message xmlns="urn:ytstenut:message"/>\n', xml)
 
+def outgoing_contact_returns(q, bus, conn):
+    conn.Connect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[0L, 0L])
+    basic_txt = { "txtvers": "1", "status": "avail" }
+
+    contact_name = "test-yst-returns@" + get_host_name()
+
+    def announce():
+        listener, port = setup_stream_listener(q, contact_name)
+        announcer = AvahiAnnouncer(contact_name, "_presence._tcp", port,
+                                   basic_txt)
+        handle = wait_for_contact_in_publish(q, bus, conn, contact_name)
+
+        return announcer, listener, handle
+
+    def request(handle, listener):
+        call_async(q, conn.Requests, 'CreateChannel', {
+            cs.CHANNEL_TYPE: ycs.CHANNEL_IFACE,
+            cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+            cs.TARGET_HANDLE: handle,
+            ycs.REQUEST_TYPE: ycs.REQUEST_TYPE_GET,
+            ycs.TARGET_SERVICE: 'the.target.service',
+            ycs.INITIATOR_SERVICE: 'the.initiator.service'
+            })
+        e = q.expect('dbus-return', method='CreateChannel')
+        path, props = e.value
+        chan = wrap_channel(bus, conn, path)
+
+        call_async(q, chan, 'Request')
+
+        e, _ = q.expect_many(
+            EventPattern('incoming-connection', listener=listener),
+            EventPattern('dbus-return', method='Request'))
+        incoming = e.connection
+
+        e = q.expect('stream-iq', connection=incoming,
+                     query_ns=ycs.MESSAGE_NS)
+        incoming.send(make_result_iq(e.stanza))
+        q.expect('dbus-signal', signal='Replied', path=path)
+
+        chan.Close()
+
+        return incoming
+
+    announcer, listener, handle = announce()
+    incoming = request(handle, listener)
+
+    # they go away, and everything which knew about them lets go of them
+    incoming.transport.loseConnection()
+    announcer.stop()
+
+    q.expect('dbus-signal', signal='MembersChangedDetailed',
+             predicate=lambda e: handle in e.args[1])
+
+    # when they come back somewhere else, that's where requests go, not
+    # wherever they were before
+    announcer, listener, handle = announce()
+    incoming = request(handle, listener)
+
+    # and requests from them come from the right contact
+    register_handler(conn, 'the.to.service')
+
+    self_handle = conn.GetSelfHandle()
+    self_handle_name = conn.InspectHandles(cs.HT_CONTACT, [self_handle])[0]
+    send_request(incoming, contact_name, self_handle_name, 'returned')
+
+    e = q.expect('dbus-signal', signal='NewChannels',
+                 predicate=is_ytstenut_channel)
+    path, props = e.args[0][0]
+    assertEquals(handle, props[cs.INITIATOR_HANDLE])
+    assertEquals(contact_name, props[cs.INITIATOR_ID])
+
 def outgoing_fail(q, bus, conn):
     path, incoming, stanza = setup_outgoing_tests(q, bus, conn)
 
@@ -185,7 +260,15 @@ def bad_requests(q, bus, conn):
     # RequestBody
     ensure_error({ycs.REQUEST_BODY: 'no way is this real XML'})
 
-def setup_incoming_tests(q, bus, conn):
+def register_handler(conn, *services):
+    conn.ContactCapabilities.UpdateCapabilities([
+            ('the.handler', [dbus.Dictionary({
+                            cs.CHANNEL_TYPE: ycs.CHANNEL_IFACE,
+                            ycs.TARGET_SERVICE: service,
+                            }, signature='sv') for service in services],
+             [])])
+
+def setup_incoming_stream(q, bus, conn):
     handle, contact_name, listener = setup_tests(q, bus, conn)
 
     self_handle = conn.GetSelfHandle()
@@ -207,6 +290,14 @@ def setup_incoming_tests(q, bus, conn):
 
     e = q.expect('stream-opened', connection=outbound)
 
+    return handle, contact_name, self_handle_name, outbound
+
+def setup_incoming_tests(q, bus, conn):
+    handle, contact_name, self_handle_name, outbound = \
+        setup_incoming_stream(q, bus, conn)
+
+    register_handler(conn, 'the.to.service')
+
     iq = IQ(None, 'get')
     iq['id'] = 'le-loldongs'
     iq['from'] = contact_name
@@ -394,9 +485,280 @@ def incoming_fail(q, bus, conn):
     call_async(q, chan, 'Request')
     q.expect('dbus-error', method='Request')
 
+def incoming_unknown_service(q, bus, conn):
+    handle, contact_name, self_handle_name, outbound = \
+        setup_incoming_stream(q, bus, conn)
+
+    register_handler(conn, 'the.to.service')
+
+    # nobody handles this service, so no channel should appear
+    forbidden = [EventPattern('dbus-signal', signal='NewChannels',
+                              predicate=lambda e:
+                                  e.args[0][0][1][cs.CHANNEL_TYPE] == ycs.CHANNEL_IFACE)]
+    q.forbid_events(forbidden)
+
+    iq = IQ(None, 'get')
+    iq['id'] = 'le-nobody-home'
+    iq['from'] = contact_name
+    iq['to'] = self_handle_name
+    msg = iq.addElement((ycs.MESSAGE_NS, 'message'))
+    msg['from-service'] = 'the.from.service'
+    msg['to-service'] = 'the.nobody.service'
+
+    outbound.send(iq)
+
+    e = q.expect('stream-iq', connection=outbound, iq_type='error',
+                 iq_id='le-nobody-home')
+
+    error = [c for c in e.stanza.children if c.name == 'error'][0]
+    assertEquals('cancel', error['type'])
+    assert 'item-not-found' in [c.name for c in error.children], error
+
+    q.unforbid_events(forbidden)
+
+def send_request(outbound, contact_name, self_handle_name, iq_id,
+                 to_service='the.to.service'):
+    iq = IQ(None, 'get')
+    iq['id'] = iq_id
+    iq['from'] = contact_name
+    iq['to'] = self_handle_name
+    msg = iq.addElement((ycs.MESSAGE_NS, 'message'))
+    msg['from-service'] = 'the.from.service'
+    msg['to-service'] = to_service
+    outbound.send(iq)
+
+def is_ytstenut_channel(e):
+    return e.args[0][0][1][cs.CHANNEL_TYPE] == ycs.CHANNEL_IFACE
+
+def incoming_handler_changes(q, bus, conn):
+    handle, contact_name, self_handle_name, outbound = \
+        setup_incoming_stream(q, bus, conn)
+
+    # a handler without a TargetService takes requests for anything
+    conn.ContactCapabilities.UpdateCapabilities([
+            ('the.handler', [dbus.Dictionary({
+                            cs.CHANNEL_TYPE: ycs.CHANNEL_IFACE,
+                            }, signature='sv')], [])])
+
+    send_request(outbound, contact_name, self_handle_name, 'wildcard',
+                 to_service='the.any.service')
+
+    e = q.expect('dbus-signal', signal='NewChannels',
+                 predicate=is_ytstenut_channel)
+    path, props = e.args[0][0]
+    assertEquals('the.any.service', props[ycs.TARGET_SERVICE])
+
+    # once it's gone, nobody handles anything, so requests are turned
+    # away without a channel
+    conn.ContactCapabilities.UpdateCapabilities([('the.handler', [], [])])
+
+    forbidden = [EventPattern('dbus-signal', signal='NewChannels',
+                              predicate=is_ytstenut_channel)]
+    q.forbid_events(forbidden)
+
+    send_request(outbound, contact_name, self_handle_name, 'gone',
+                 to_service='the.any.service')
+
+    e = q.expect('stream-iq', connection=outbound, iq_type='error',
+                 iq_id='gone')
+    error = [c for c in e.stanza.children if c.name == 'error'][0]
+    assertEquals('cancel', error['type'])
+    assert 'item-not-found' in [c.name for c in error.children], error
+
+    q.unforbid_events(forbidden)
+
+MANY_CHANNELS = 40
+
+def incoming_many_closed(q, bus, conn):
+    handle, contact_name, self_handle_name, outbound = \
+        setup_incoming_stream(q, bus, conn)
+
+    register_handler(conn, 'the.to.service')
+
+    for i in range(MANY_CHANNELS):
+        send_request(outbound, contact_name, self_handle_name,
+                     'many-%d' % i)
+
+    events = q.expect_many(*[EventPattern('dbus-signal', signal='NewChannels',
+                                          predicate=is_ytstenut_channel)
+                             for i in range(MANY_CHANNELS)])
+    paths = [e.args[0][0][0] for e in events]
+
+    # they're closed a few at a time after disconnecting, but every one
+    # of them gets closed
+    call_async(q, conn, 'Disconnect')
+    q.expect_many(*[EventPattern('dbus-signal', signal='Closed', path=path)
+                    for path in paths])
+
+BACKLOG_LIMIT = 2
+
+def incoming_backlog(q, bus, conn):
+    # written out before the connection was made; see __main__
+    remove_config()
+
+    handle, contact_name, self_handle_name, outbound = \
+        setup_incoming_stream(q, bus, conn)
+
+    register_handler(conn, 'the.to.service')
+
+    # handlers hear about backlog pressure from the Status sidecar
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+    q.expect('dbus-return', method='EnsureSidecar')
+
+    # requests up to the limit get channels, and the one which fills
+    # the backlog says so
+    paths = []
+    for i in range(BACKLOG_LIMIT):
+        send_request(outbound, contact_name, self_handle_name,
+                     'backlog-%d' % i)
+        e = q.expect('dbus-signal', signal='NewChannels',
+                     predicate=is_ytstenut_channel)
+        paths.append(e.args[0][0][0])
+
+    e = q.expect('dbus-signal', signal='BacklogChanged',
+                 interface=ycs.STATUS_FUTURE_IFACE)
+    assertEquals(['the.to.service', BACKLOG_LIMIT, BACKLOG_LIMIT], e.args)
+
+    # after that they're turned away until the handler catches up
+    forbidden = [EventPattern('dbus-signal', signal='NewChannels',
+                              predicate=is_ytstenut_channel)]
+    q.forbid_events(forbidden)
+
+    send_request(outbound, contact_name, self_handle_name, 'backlog-full')
+
+    e = q.expect('stream-iq', connection=outbound, iq_type='error',
+                 iq_id='backlog-full')
+    error = [c for c in e.stanza.children if c.name == 'error'][0]
+    assert 'resource-constraint' in [c.name for c in error.children], error
+
+    q.unforbid_events(forbidden)
+
+    # replying to one drains it back to half the limit
+    chan = wrap_channel(bus, conn, paths[0])
+    call_async(q, chan, 'Reply', {}, '')
+
+    _, _, e = q.expect_many(
+        EventPattern('dbus-return', method='Reply'),
+        EventPattern('stream-iq', connection=outbound, iq_type='result',
+                     iq_id='backlog-0'),
+        EventPattern('dbus-signal', signal='BacklogChanged',
+                     interface=ycs.STATUS_FUTURE_IFACE))
+    assertEquals(['the.to.service', BACKLOG_LIMIT / 2, BACKLOG_LIMIT],
+                 e.args)
+
+    # and there's room again
+    send_request(outbound, contact_name, self_handle_name, 'backlog-again')
+    q.expect('dbus-signal', signal='NewChannels',
+             predicate=is_ytstenut_channel)
+
+FLOOD_BURST = 5
+FLOOD_EXTRA = 3
+
+def incoming_flood(q, bus, conn):
+    # written out before the connection was made; see __main__
+    remove_config()
+
+    handle, contact_name, self_handle_name, outbound = \
+        setup_incoming_stream(q, bus, conn)
+
+    call_async(q, conn.Future, 'EnsureSidecar', ycs.STATUS_IFACE)
+    e = q.expect('dbus-return', method='EnsureSidecar')
+    path, props = e.value
+    status = bus.get_object(conn.bus_name, path)
+
+    # nobody handles this service, so the requests which get past the
+    # rate limiter are turned away with item-not-found, and the ones
+    # which don't with resource-constraint
+    for i in range(FLOOD_BURST + FLOOD_EXTRA):
+        send_request(outbound, contact_name, self_handle_name,
+                     'flood-%d' % i, to_service='the.nobody.service')
+
+    # and handlers hear about it, but not once per request
+    patterns = [EventPattern('stream-iq', connection=outbound,
+                             iq_type='error', iq_id='flood-%d' % i)
+                for i in range(FLOOD_BURST + FLOOD_EXTRA)]
+    patterns.append(EventPattern('dbus-signal',
+                                 signal='DroppedRequestsChanged',
+                                 interface=ycs.STATUS_FUTURE_IFACE,
+                                 predicate=lambda e:
+                                     e.args[0] == FLOOD_EXTRA))
+    events = q.expect_many(*patterns)
+
+    for i, e in enumerate(events[:-1]):
+        error = [c for c in e.stanza.children if c.name == 'error'][0]
+        conditions = [c.name for c in error.children]
+
+        if i < FLOOD_BURST:
+            assert 'item-not-found' in conditions, error
+        else:
+            assertEquals('wait', error['type'])
+            assert 'resource-constraint' in conditions, error
+
+    dropped = status.Get(ycs.STATUS_FUTURE_IFACE, 'DroppedRequests',
+                         dbus_interface=dbus.PROPERTIES_IFACE)
+    assertEquals(FLOOD_EXTRA, dropped)
+
+BATCH_SIZE = 3
+
+def incoming_batch(q, bus, conn):
+    # written out before the connection was made; see __main__
+    remove_config()
+
+    handle, contact_name, self_handle_name, outbound = \
+        setup_incoming_stream(q, bus, conn)
+
+    register_handler(conn, 'the.to.service', 'the.other.service')
+
+    def services(e):
+        return [props[ycs.TARGET_SERVICE] for path, props in e.args[0]]
+
+    # a burst for two services comes out as one NewChannels for each,
+    # not as one for everything
+    send_request(outbound, contact_name, self_handle_name, 'batch-0')
+    send_request(outbound, contact_name, self_handle_name, 'batch-1',
+                 to_service='the.other.service')
+    send_request(outbound, contact_name, self_handle_name, 'batch-2')
+
+    to, other = q.expect_many(
+        EventPattern('dbus-signal', signal='NewChannels',
+                     predicate=lambda e: is_ytstenut_channel(e) and
+                         'the.to.service' in services(e)),
+        EventPattern('dbus-signal', signal='NewChannels',
+                     predicate=lambda e: is_ytstenut_channel(e) and
+                         'the.other.service' in services(e)))
+    assertEquals(['the.to.service'] * 2, services(to))
+    assertEquals(['the.other.service'], services(other))
+
+    # a batch which fills up goes straight away, and the next one starts
+    # afresh
+    for i in range(BATCH_SIZE + 1):
+        send_request(outbound, contact_name, self_handle_name,
+                     'batch-full-%d' % i)
+
+    e = q.expect('dbus-signal', signal='NewChannels',
+                 predicate=is_ytstenut_channel)
+    assertEquals(['the.to.service'] * BATCH_SIZE, services(e))
+
+    e = q.expect('dbus-signal', signal='NewChannels',
+                 predicate=is_ytstenut_channel)
+    assertEquals(['the.to.service'], services(e))
+
 if __name__ == '__main__':
     exec_test(outgoing_reply)
     exec_test(outgoing_fail)
+    exec_test(outgoing_contact_returns)
     exec_test(bad_requests)
     exec_test(incoming_reply)
     exec_test(incoming_fail)
+    exec_test(incoming_unknown_service)
+    exec_test(incoming_handler_changes)
+    exec_test(incoming_many_closed)
+    write_config({'Requests': {'service-backlog-limit': BACKLOG_LIMIT}})
+    exec_test(incoming_backlog)
+    # no refilling, so exactly the burst gets through
+    write_config({'Requests': {'rate-limit-burst': FLOOD_BURST,
+                               'rate-limit-rate': 0}})
+    exec_test(incoming_flood)
+    write_config({'Requests': {'batch-window': 500,
+                               'batch-size': BATCH_SIZE}})
+    exec_test(incoming_batch)
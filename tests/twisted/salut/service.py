@@ -70,7 +70,8 @@ def test(q, bus, conn):
     assertEquals({}, props)
 
     status = ProxyWrapper(bus.get_object(conn.bus_name, path),
-                          ycs.STATUS_IFACE, {})
+                          ycs.STATUS_IFACE,
+                          {'Future': ycs.STATUS_FUTURE_IFACE})
 
     discovered = status.Get(ycs.STATUS_IFACE, 'DiscoveredServices',
                             dbus_interface=dbus.PROPERTIES_IFACE)
@@ -158,6 +159,18 @@ def test(q, bus, conn):
                       'urn:ytstenut:data:jingle:rtp'])},
                 }, discovered)
 
+    # and it can be found by what it does and what it is
+    assertEquals(discovered, status.Future.FindServicesByCapability(
+            'urn:ytstenut:data:jingle:rtp'))
+    assertEquals(discovered, status.Future.FindServicesByType('application'))
+    assertEquals({}, status.Future.FindServicesByCapability(
+            'urn:ytstenut:capabilities:pics'))
+
+    # or by who has it, without fetching everyone else's
+    assertEquals(discovered[contact_name],
+                 status.Future.GetServicesForContact(contact_name))
+    assertEquals((discovered, ''), status.Future.GetServicesPage('', 10))
+
     # add evince
     tmp = banshee.copy()
     tmp.update(evince)
@@ -306,13 +319,21 @@ def test(q, bus, conn):
 
     incoming.send(result)
 
-    sa, sr = q.expect_many(EventPattern('dbus-signal', signal='ServiceAdded'),
-                           EventPattern('dbus-signal', signal='ServiceRemoved'))
+    sa, sr, sc = q.expect_many(
+        EventPattern('dbus-signal', signal='ServiceAdded'),
+        EventPattern('dbus-signal', signal='ServiceRemoved'),
+        EventPattern('dbus-signal', signal='ServicesChanged',
+                     interface=ycs.STATUS_FUTURE_IFACE))
 
     contact_id, service_name, details = sa.args
     assertEquals(contact_name, contact_id)
     assertEquals('org.gnome.Evince', service_name)
 
+    # the batched signal has both halves of the swap in one go
+    added, removed = sc.args
+    assertEquals({contact_name: {'org.gnome.Evince': details}}, added)
+    assertEquals({contact_name: ['org.gnome.Banshee']}, removed)
+
     type, name_map, caps = details
     assertEquals('application', type)
     assertEquals({'en_GB': 'Evince Picture Viewer',
@@ -178,7 +178,8 @@ def test(q, bus, conn):
     assertEquals({}, props)
 
     status = ProxyWrapper(bus.get_object(conn.bus_name, path),
-                          ycs.STATUS_IFACE, {})
+                          ycs.STATUS_IFACE,
+                          {'Future': ycs.STATUS_FUTURE_IFACE})
 
     discovered = status.Get(ycs.STATUS_IFACE, 'DiscoveredServices',
                             dbus_interface=dbus.PROPERTIES_IFACE)
@@ -196,6 +197,22 @@ def test(q, bus, conn):
                        ['urn:ytstenut:capabilities:pics'])}
                 }, discovered)
 
+    # there was only the one contact to look at
+    complete = status.Get(ycs.STATUS_FUTURE_IFACE, 'ScanComplete',
+                          dbus_interface=dbus.PROPERTIES_IFACE)
+    assertEquals(True, complete)
+
+    # the scan doesn't signal what it finds, but it does log it, so
+    # GetChangesSince can be trusted from the very start
+    version, complete, _, _, _ = status.Future.GetChangesSince(0)
+    assertEquals(False, complete)
+
+    _, complete, added, removed, statuses = \
+        status.Future.GetChangesSince(version - 2)
+    assertEquals(True, complete)
+    assertEquals(discovered, added)
+    assertEquals({}, removed)
+
     # sweet.
 
 if __name__ == '__main__':
@@ -53,7 +53,8 @@ def test(q, bus, conn):
     assertEquals({}, props)
 
     status = ProxyWrapper(bus.get_object(conn.bus_name, path),
-                          ycs.STATUS_IFACE, {})
+                          ycs.STATUS_IFACE,
+                          {'Future': ycs.STATUS_FUTURE_IFACE})
 
     # bad capability argument
     call_async(q, status, 'AdvertiseStatus', '', 'service.name', '')
@@ -254,5 +255,85 @@ def test(q, bus, conn):
                             dbus_interface=dbus.PROPERTIES_IFACE)
     assertEquals({}, discovered)
 
+    # statuses which come in too quickly are held back and only the
+    # latest one goes out
+    def status_activity(e):
+        status_el = e.stanza.children[0].children[0].children[0].children[0]
+        return status_el.getAttribute('activity')
+
+    q.forbid_events([EventPattern('stream-message', connection=incoming,
+                                  predicate=lambda e: status_activity(e) == 'two')])
+
+    for activity in ['one', 'two', 'three']:
+        el = Element(('urn:ytstenut:status', 'status'))
+        el['activity'] = activity
+        call_async(q, status, 'AdvertiseStatus', CAP_NAME,
+                   'ants.in.their.pants', el.toXml())
+        q.expect('dbus-return', method='AdvertiseStatus')
+
+    q.expect('stream-message', connection=incoming,
+             predicate=lambda e: status_activity(e) == 'three')
+
+    # statuses for the same capability go out in one event
+    statuses = []
+    for service in ['pants.one', 'pants.two']:
+        el = Element(('urn:ytstenut:status', 'status'))
+        el['activity'] = 'batched'
+        statuses.append((CAP_NAME, service, el.toXml()))
+
+    call_async(q, status.Future, 'AdvertiseStatuses', statuses)
+
+    e, _, _, _ = q.expect_many(
+        EventPattern('stream-message', connection=incoming),
+        EventPattern('dbus-return', method='AdvertiseStatuses'),
+        EventPattern('dbus-signal', signal='StatusChanged',
+                     predicate=lambda e: e.args[2] == 'pants.one'),
+        EventPattern('dbus-signal', signal='StatusChanged',
+                     predicate=lambda e: e.args[2] == 'pants.two'))
+
+    items = e.stanza.children[0].children[0]
+    assertEquals(CAP_NAME, items['node'])
+    services = sorted([item.children[0]['from-service']
+                       for item in items.elements()])
+    assertEquals(['pants.one', 'pants.two'], services)
+
+    # and all of them are noticed when they come back
+    discovered = status.Get(ycs.STATUS_IFACE, 'DiscoveredStatuses',
+                            dbus_interface=dbus.PROPERTIES_IFACE)
+    assertEquals(['pants.one', 'pants.two'],
+                 sorted(discovered['testsuite@testsuite'][CAP_NAME].keys()))
+
+    # a bad one means none of them go
+    call_async(q, status.Future, 'AdvertiseStatuses',
+               [(CAP_NAME, 'pants.three', ''), ('', 'pants.four', '')])
+    q.expect('dbus-error', method='AdvertiseStatuses')
+
+    # changes which arrive within the batch window are reported
+    # together in one StatusesChanged, as well as one at a time
+    def batched_services(e):
+        return e.args[0].get('testsuite@testsuite', {}).get(CAP_NAME, {})
+
+    q.expect('dbus-signal', signal='StatusesChanged',
+             interface=ycs.STATUS_FUTURE_IFACE,
+             predicate=lambda e: 'pants.two' in batched_services(e))
+
+    for service in ['coalesce.one', 'coalesce.two']:
+        el = Element(('urn:ytstenut:status', 'status'))
+        el['activity'] = 'coalesced'
+        call_async(q, status, 'AdvertiseStatus', CAP_NAME, service,
+                   el.toXml())
+
+    _, _, e = q.expect_many(
+        EventPattern('dbus-signal', signal='StatusChanged',
+                     predicate=lambda e: e.args[2] == 'coalesce.one'),
+        EventPattern('dbus-signal', signal='StatusChanged',
+                     predicate=lambda e: e.args[2] == 'coalesce.two'),
+        EventPattern('dbus-signal', signal='StatusesChanged',
+                     interface=ycs.STATUS_FUTURE_IFACE,
+                     predicate=lambda e: 'coalesce.one' in batched_services(e)))
+
+    assertEquals(['coalesce.one', 'coalesce.two'],
+                 sorted(batched_services(e).keys()))
+
 if __name__ == '__main__':
     exec_test(test)
@@ -3,6 +3,7 @@ YTST_ACCOUNT_MANAGER_IFACE = "org.freedesktop.ytstenut.xpmn.AccountManager"
 YTST_ACCOUNT_PATH = "/org/freedesktop/Telepathy/Account/salut/local_ytstenut/automatic_account"
 
 STATUS_IFACE = 'org.freedesktop.ytstenut.xpmn.Status'
+STATUS_FUTURE_IFACE = STATUS_IFACE + '.FUTURE'
 
 CHANNEL_IFACE = 'org.freedesktop.ytstenut.xpmn.Channel'
 